@@ -3,7 +3,8 @@
 # collector.py
 #
 # Coleta métricas do receiver (mensagens/s) e CPU (%) do container do middleware1,
-# salva CSV e plota um gráfico com dois eixos Y.
+# salva CSV e plota um gráfico com dois eixos Y. O cenário 'coldstart' mede o
+# tempo até a primeira mensagem após reiniciar o container.
 #
 # Dep.: pip install requests docker matplotlib
 
@@ -101,7 +102,8 @@ def collect(duration_s=120, csv_path="metrics_run.csv", scenario="intermittent",
         writer.writerow([
             "timestamp","elapsed_s","delivered_per_s",
             "successful_total","failed_total","total_messages",
-            "delivery_rate_cum","cpu_middleware1"
+            "delivery_rate_cum","cpu_middleware1",
+            "latency_p99_ms","duplicates"
         ])
 
         while True:
@@ -119,11 +121,15 @@ def collect(duration_s=120, csv_path="metrics_run.csv", scenario="intermittent",
                 failed_total = r.get("failed", 0)
                 total_msgs = r.get("total_messages", successful_total + failed_total)
                 delivery_rate_cum = (successful_total / total_msgs) * 100.0 if total_msgs > 0 else 0.0
+                latency_p99 = r.get("latency_p99_ms", 0.0)
+                duplicates = r.get("duplicates", 0)
             except Exception as e:
                 print(f"[warn] receiver/metrics erro: {e}")
                 delivered_per_s = 0
                 successful_total = failed_total = total_msgs = 0
                 delivery_rate_cum = 0.0
+                latency_p99 = 0.0
+                duplicates = 0
 
             try:
                 cpu_mw = sample_container_cpu(mw)
@@ -135,11 +141,12 @@ def collect(duration_s=120, csv_path="metrics_run.csv", scenario="intermittent",
             print(f"[t+{elapsed:03d}s] msgs/s={delivered_per_s:.3f}  "
                   f"succ={successful_total}  fail={failed_total}  "
                   f"total={total_msgs}  rate_cum={delivery_rate_cum:.2f}%  "
-                  f"CPU={cpu_mw:.6f}%")
+                  f"CPU={cpu_mw:.6f}%  p99={latency_p99:.1f}ms  dup={duplicates}")
 
             writer.writerow([
                 iso_now(), elapsed, delivered_per_s, successful_total, failed_total,
-                total_msgs, round(delivery_rate_cum, 2), round(cpu_mw, 5)
+                total_msgs, round(delivery_rate_cum, 2), round(cpu_mw, 5),
+                round(latency_p99, 3), duplicates
             ])
             f.flush()
 
@@ -182,16 +189,110 @@ def collect(duration_s=120, csv_path="metrics_run.csv", scenario="intermittent",
     except Exception as e:
         print(f"[warn] não foi possível plotar: {e}\nInstale matplotlib com: pip install matplotlib")
 
+# ---- Partida a frio: tempo até a primeira mensagem entregue
+# Reinicia o container N vezes com o sender em taxa fixa e mede, do start do
+# container até o receiver contar uma entrega nova, o tempo até a primeira
+# mensagem. A quebra por fase vem da linha "Startup:" do log do middleware.
+# Deixe em execução só o middleware medido: os demais também entregariam.
+def receiver_successful():
+    return http_get_json(f"{RECEIVER_URL}/metrics?window=1").get("successful", 0)
+
+def parse_startup_line(logs):
+    for line in reversed(logs.splitlines()):
+        if "Startup:" in line:
+            phases = {}
+            for item in line.split("Startup:", 1)[1].split():
+                key, _, value = item.partition("=")
+                if value.endswith("ms"):
+                    phases[key] = float(value[:-2])
+            return phases
+    return {}
+
+def coldstart(runs=5, csv_path="coldstart.csv", container_name="middleware1", probe_mps=100.0,
+              broker_delay=0.0, timeout_s=60.0):
+    reset_endpoints()
+    ensure_sender_running()
+    previous_mps = http_get_json(f"{SENDER_URL}/status").get("base_mps", 1)
+    # taxa do sender define a resolução da medida (1/probe_mps)
+    http_get_json(f"{SENDER_URL}/set-rate/{float(probe_mps)}")
+
+    client = get_docker_client()
+    mw = client.containers.get(container_name)
+    broker = client.containers.get("mosquitto") if broker_delay > 0 else None
+    print(f"[coldstart] container={container_name}, runs={runs}, probe_mps={probe_mps}, broker_delay={broker_delay}s")
+
+    phase_names = ["process_init", "init", "pipeline", "connect", "subscribe", "first_message", "total"]
+    results = []
+    try:
+        with open(csv_path, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(["run", "time_to_first_message_ms"] + [f"{n}_ms" for n in phase_names])
+            for run in range(1, runs + 1):
+                mw.stop(timeout=5)
+                if broker is not None:
+                    broker.stop(timeout=5)
+                time.sleep(1.0)  # entregas em voo do container anterior
+                before = receiver_successful()
+
+                since = int(time.time())
+                started = time.perf_counter()
+                mw.start()
+                if broker is not None:
+                    # broker atrasado: exercita a retentativa de conexão com backoff
+                    # (inclui a reconexão do sender e do receiver ao broker)
+                    time.sleep(broker_delay)
+                    broker.start()
+
+                ttfm_ms = None
+                while time.perf_counter() - started < timeout_s:
+                    try:
+                        if receiver_successful() > before:
+                            ttfm_ms = (time.perf_counter() - started) * 1000.0
+                            break
+                    except Exception:
+                        pass
+                    time.sleep(0.01)
+
+                time.sleep(0.2)  # a linha "Startup:" sai logo após o primeiro forward
+                phases = parse_startup_line(mw.logs(since=since).decode("utf-8", errors="replace"))
+                shown = "  ".join(f"{n}={phases[n]:.1f}ms" for n in phase_names if n in phases)
+                ttfm_text = f"{ttfm_ms:.1f}ms" if ttfm_ms is not None else "timeout"
+                print(f"[coldstart] run {run}: first message after {ttfm_text}  {shown}")
+                writer.writerow([run, round(ttfm_ms, 1) if ttfm_ms is not None else ""] +
+                                [phases.get(n, "") for n in phase_names])
+                f.flush()
+                if ttfm_ms is not None:
+                    results.append(ttfm_ms)
+    finally:
+        http_get_json(f"{SENDER_URL}/set-rate/{float(previous_mps)}")
+
+    if results:
+        results.sort()
+        print(f"[coldstart] time to first message: min={results[0]:.1f}ms "
+              f"median={results[len(results) // 2]:.1f}ms max={results[-1]:.1f}ms "
+              f"({len(results)}/{runs} runs)")
+    print(f"[ok] CSV salvo em: {csv_path}")
+
 def main():
     p = argparse.ArgumentParser(description="Coletor de métricas (receiver+CPU middleware) + plot")
     p.add_argument("--duration", type=int, default=120, help="duração em segundos")
     p.add_argument("--csv", type=str, default="metrics_run.csv", help="arquivo CSV de saída")
-    p.add_argument("--scenario", choices=["intermittent","complete","overload"], default="intermittent")
+    p.add_argument("--scenario", choices=["intermittent","complete","overload","coldstart"], default="intermittent")
     p.add_argument("--rate", type=float, default=0.3, help="taxa de falha intermitente (0..1)")
     p.add_argument("--mps", type=int, default=1000, help="mensagens/seg para overload")
     p.add_argument("--container", type=str, default="middleware1", help="nome do container do middleware")
+    p.add_argument("--runs", type=int, default=5, help="coldstart: número de reinícios")
+    p.add_argument("--probe-mps", type=float, default=100.0, help="coldstart: taxa do sender durante a medida")
+    p.add_argument("--broker-delay", type=float, default=0.0,
+                   help="coldstart: reinicia também o broker, N segundos depois do middleware")
     args = p.parse_args()
 
+    if args.scenario == "coldstart":
+        csv_path = args.csv if args.csv != "metrics_run.csv" else "coldstart.csv"
+        coldstart(runs=args.runs, csv_path=csv_path, container_name=args.container,
+                  probe_mps=args.probe_mps, broker_delay=args.broker_delay)
+        return
+
     collect(duration_s=args.duration, csv_path=args.csv, scenario=args.scenario,
             rate=args.rate, mps=args.mps, container_name=args.container)
 
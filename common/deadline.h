@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+// Orçamento de tempo restante de uma mensagem. Criado na entrada com
+// MESSAGE_BUDGET_MS e estreitado pelo máximo configurado de cada estágio;
+// estágios verificam o prazo cooperativamente com check(). Sem configuração
+// (ou com 0) não há prazo. Comum ao middleware2 e ao middleware3.
+//
+// O prazo só limita a latência de fato quando o estágio pode ser
+// interrompido: no middleware3 com PIPELINE_ISOLATION=process o worker que
+// estoura é morto. Um estágio no próprio processo que bloqueia (I/O, lock)
+// sem chamar check() só é detectado no retorno; a mensagem segue para o
+// fallback, mas o p99 inclui o tempo bloqueado.
+class DeadlineExceeded : public std::runtime_error {
+public:
+    explicit DeadlineExceeded(const std::string& where)
+        : std::runtime_error("Deadline exceeded in " + where) {}
+};
+
+class Deadline {
+private:
+    std::chrono::steady_clock::time_point at;
+
+public:
+    explicit Deadline(std::chrono::steady_clock::time_point when) : at(when) {}
+
+    static Deadline after(std::chrono::microseconds budget) {
+        return Deadline(std::chrono::steady_clock::now() + budget);
+    }
+
+    static Deadline never() { return Deadline(std::chrono::steady_clock::time_point::max()); }
+
+    static constexpr std::chrono::microseconds NO_BUDGET = std::chrono::microseconds::max();
+
+    // Orçamento NO_BUDGET vira never() em vez de estourar now() + max
+    static Deadline within(std::chrono::microseconds budget) {
+        return budget == NO_BUDGET ? never() : after(budget);
+    }
+
+    // Orçamento em ms lido do ambiente; ausente ou <= 0 desativa o prazo
+    static std::chrono::microseconds budgetFromMillis(long ms) {
+        return ms > 0 ? std::chrono::milliseconds(ms) : NO_BUDGET;
+    }
+
+    Deadline narrowedTo(std::chrono::microseconds budget) const {
+        if (budget == NO_BUDGET) return *this;
+        auto limit = std::chrono::steady_clock::now() + budget;
+        return Deadline(std::min(at, limit));
+    }
+
+    bool expired() const { return std::chrono::steady_clock::now() >= at; }
+
+    std::chrono::microseconds remaining() const {
+        if (at == std::chrono::steady_clock::time_point::max()) return std::chrono::microseconds::max();
+        auto left = at - std::chrono::steady_clock::now();
+        return std::max(std::chrono::microseconds(0),
+                        std::chrono::duration_cast<std::chrono::microseconds>(left));
+    }
+
+    void check(const std::string& where) const {
+        if (expired()) throw DeadlineExceeded(where);
+    }
+
+    std::chrono::steady_clock::time_point time() const { return at; }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// Sketches sobre device_id: Space-Saving (top-K dispositivos mais quentes) e
+// HyperLogLog (dispositivos distintos ativos). Memória fixa e custo constante
+// por mensagem; zerados a cada relatório para refletir a janela corrente.
+// Comum aos três middlewares; cada um extrai o device_id do seu jeito e
+// alimenta o sketch com observe(id, hashDeviceId(id)).
+// ---------------------------------------------------------------------------
+
+static uint64_t hashDeviceId(std::string_view id) {
+    uint64_t h = 1469598103934665603ull;  // FNV-1a + finalizador do splitmix64
+    for (unsigned char c : id) h = (h ^ c) * 1099511628211ull;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+
+// Space-Saving com K contadores: o mais frio é substituído e herda sua
+// contagem como erro máximo. Os contadores ficam num heap mínimo por contagem
+// (o mais frio é a raiz) e um índice por hash com endereçamento aberto os
+// localiza; incrementos de 1 raramente movem o heap.
+class SpaceSaving {
+public:
+    struct Counter {
+        std::string id;
+        uint64_t count = 0;
+        uint64_t error = 0;
+    };
+
+private:
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> errors;
+    std::vector<std::string> ids;
+    std::vector<uint32_t> heap;    // posição -> contador
+    std::vector<uint32_t> where;   // contador -> posição no heap
+    std::vector<int32_t> table;    // hash -> contador (-1 = vazio), potência de 2
+    size_t used = 0;
+
+    size_t probe(std::string_view id, uint64_t hash) const {
+        size_t mask = table.size() - 1;
+        size_t i = hash & mask;
+        while (table[i] >= 0 && !(hashes[table[i]] == hash && ids[table[i]] == id)) i = (i + 1) & mask;
+        return i;
+    }
+
+    // Remoção com deslocamento para trás (mantém as sequências de sondagem)
+    void erase(size_t i) {
+        size_t mask = table.size() - 1;
+        for (size_t j = (i + 1) & mask; table[j] >= 0; j = (j + 1) & mask) {
+            size_t home = hashes[table[j]] & mask;
+            bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!between) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i] = -1;
+    }
+
+    void swapAt(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        where[heap[a]] = static_cast<uint32_t>(a);
+        where[heap[b]] = static_cast<uint32_t>(b);
+    }
+
+    void siftDown(size_t p) {
+        while (true) {
+            size_t smallest = p;
+            for (size_t c = 2 * p + 1; c <= 2 * p + 2 && c < used; ++c) {
+                if (counts[heap[c]] < counts[heap[smallest]]) smallest = c;
+            }
+            if (smallest == p) return;
+            swapAt(p, smallest);
+            p = smallest;
+        }
+    }
+
+    void siftUp(size_t p) {
+        while (p > 0 && counts[heap[p]] < counts[heap[(p - 1) / 2]]) {
+            swapAt(p, (p - 1) / 2);
+            p = (p - 1) / 2;
+        }
+    }
+
+public:
+    explicit SpaceSaving(size_t k)
+        : hashes(std::max<size_t>(k, 1)), counts(hashes.size()), errors(hashes.size()), ids(hashes.size()),
+          heap(hashes.size()), where(hashes.size()) {
+        size_t capacity = 4;
+        while (capacity < hashes.size() * 4) capacity <<= 1;
+        table.assign(capacity, -1);
+    }
+
+    void add(std::string_view id, uint64_t hash) {
+        size_t at = probe(id, hash);
+        if (table[at] >= 0) {
+            uint32_t c = static_cast<uint32_t>(table[at]);
+            ++counts[c];
+            siftDown(where[c]);
+            return;
+        }
+        uint32_t c;
+        uint64_t inherited = 0;
+        if (used < counts.size()) {
+            c = static_cast<uint32_t>(used);
+            heap[used] = c;
+            where[c] = static_cast<uint32_t>(used);
+            ++used;
+        } else {
+            c = heap[0];
+            inherited = counts[c];
+            erase(probe(ids[c], hashes[c]));
+            at = probe(id, hash);
+        }
+        hashes[c] = hash;
+        ids[c].assign(id.data(), id.size());
+        counts[c] = inherited + 1;
+        errors[c] = inherited;
+        table[at] = static_cast<int32_t>(c);
+        siftUp(where[c]);
+        siftDown(where[c]);
+    }
+
+    std::vector<Counter> top(size_t n) const {
+        std::vector<Counter> out;
+        for (size_t i = 0; i < used; ++i) out.push_back({ids[i], counts[i], errors[i]});
+        std::sort(out.begin(), out.end(), [](const Counter& a, const Counter& b) { return a.count > b.count; });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+
+    void reset() {
+        used = 0;
+        std::fill(table.begin(), table.end(), -1);
+    }
+};
+
+// HyperLogLog com 2^12 registradores (~1.6% de erro padrão, 4 KiB)
+class HyperLogLog {
+private:
+    static constexpr int P = 12;
+    static constexpr size_t M = size_t(1) << P;
+    uint8_t registers[M] = {};
+
+public:
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - P);
+        uint64_t rest = hash << P;
+        uint8_t rank = rest ? static_cast<uint8_t>(__builtin_clzll(rest) + 1) : static_cast<uint8_t>(64 - P + 1);
+        if (rank > registers[index]) registers[index] = rank;
+    }
+
+    double estimate() const {
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (uint8_t r : registers) {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        double alpha = 0.7213 / (1.0 + 1.079 / M);
+        double e = alpha * M * M / sum;
+        if (e <= 2.5 * M && zeros) e = M * std::log(static_cast<double>(M) / zeros);  // linear counting
+        return e;
+    }
+
+    void reset() { std::memset(registers, 0, sizeof(registers)); }
+};
+
+class DeviceSketch {
+private:
+    SpaceSaving hot;
+    HyperLogLog distinct;
+    uint64_t messages = 0;
+
+public:
+    explicit DeviceSketch(size_t k) : hot(k) {}
+
+    void observe(std::string_view id, uint64_t hash) {
+        hot.add(id, hash);
+        distinct.add(hash);
+        ++messages;
+    }
+
+    // Dispositivos mais quentes da janela (base para rebalancear partições)
+    std::vector<SpaceSaving::Counter> hottest(size_t n) const { return hot.top(n); }
+
+    // "messages=N distinct~=D hot=device_7:42(err 0) ..." e inicia nova janela
+    std::string report(size_t shown) {
+        std::ostringstream out;
+        out << "messages=" << messages << " distinct~=" << std::llround(messages ? distinct.estimate() : 0.0) << " hot=";
+        bool first = true;
+        for (const auto& c : hot.top(shown)) {
+            out << (first ? "" : ",") << c.id << ":" << c.count << "(err " << c.error << ")";
+            first = false;
+        }
+        hot.reset();
+        distinct.reset();
+        messages = 0;
+        return out.str();
+    }
+};
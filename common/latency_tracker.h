@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Janela deslizante de latências (µs) com percentil recalculado a cada 64 amostras.
+// Usada pelo hedging do middleware1 e pela entrega simulada dos modos soak
+class LatencyTracker {
+private:
+    std::mutex mtx;
+    std::vector<int64_t> samples;
+    size_t next = 0;
+    uint64_t count = 0;
+    std::atomic<int64_t> cachedP95{-1};
+    std::atomic<int64_t> cachedP99{-1};
+
+    static int64_t percentile(std::vector<int64_t> v, double q) {
+        size_t k = static_cast<size_t>(q * (v.size() - 1));
+        std::nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k];
+    }
+
+public:
+    explicit LatencyTracker(size_t window = 1024) { samples.reserve(window); }
+
+    void record(std::chrono::steady_clock::duration d) {
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        std::lock_guard<std::mutex> lock(mtx);
+        if (samples.size() < samples.capacity()) {
+            samples.push_back(us);
+        } else {
+            samples[next] = us;
+            next = (next + 1) % samples.size();
+        }
+        if (++count % 64 == 0) {
+            cachedP95 = percentile(samples, 0.95);
+            cachedP99 = percentile(samples, 0.99);
+        }
+    }
+
+    // Esvazia a janela (o soak mede cada fase normal sem as amostras da queda)
+    void reset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        samples.clear();
+        next = 0;
+        count = 0;
+        cachedP95 = -1;
+        cachedP99 = -1;
+    }
+
+    // -1 enquanto não houver amostras suficientes
+    int64_t p95Micros() const { return cachedP95.load(); }
+    int64_t p99Micros() const { return cachedP99.load(); }
+};
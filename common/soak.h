@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <malloc.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------------------
+// Soak: execução longa sem broker para encontrar vazamentos e fragmentação
+// nos caminhos cheios de strings. Comum ao middleware1 (filas de
+// retentativa, backlogs de destinos) e ao middleware3 (pipeline por core,
+// rings e bulkhead de publish): mesmo ciclo de fases, mesmo tráfego, mesmas
+// métricas e mesmo critério de tendência. 'tag' é o prefixo dos logs.
+// ---------------------------------------------------------------------------
+
+// RSS e estatísticas do glibc malloc (todas as arenas), em MB
+struct HeapStats {
+    double rssMb = 0;
+    double arenaMb = 0;   // heap obtido via brk/arenas
+    double inUseMb = 0;   // alocado pela aplicação
+    double freeMb = 0;    // livre dentro das arenas, ainda retido pelo processo
+    double mmapMb = 0;    // blocos grandes servidos por mmap
+
+    // Fração do heap que está livre mas não volta ao sistema
+    double fragmentation() const { return arenaMb > 0 ? freeMb / arenaMb : 0.0; }
+
+    static HeapStats sample() {
+        constexpr double MB = 1024.0 * 1024.0;
+        HeapStats stats;
+        std::ifstream in("/proc/self/statm");
+        long long size = 0;
+        long long resident = 0;
+        in >> size >> resident;
+        stats.rssMb = resident * sysconf(_SC_PAGESIZE) / MB;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 info = mallinfo2();
+        stats.arenaMb = info.arena / MB;
+        stats.inUseMb = info.uordblks / MB;
+        stats.freeMb = info.fordblks / MB;
+        stats.mmapMb = info.hblkhd / MB;
+#endif
+        return stats;
+    }
+};
+
+struct SoakBaseline {
+    double rssMb = 0;
+    double heapInUseMb = 0;
+    double fragmentation = 0;
+    double queueDepth = 0;
+    double p99Micros = 0;  // entrega na fase normal
+};
+
+// Ciclo de fases do soak:
+//   normal (60%) -> queda do receiver (15%) -> sobrecarga (15%) -> recuperação (10%)
+namespace soak {
+
+enum Phase { NORMAL = 0, OUTAGE = 1, OVERLOAD = 2, RECOVERY = 3 };
+
+inline const char* phaseName(int phase) {
+    static const char* names[] = {"normal", "outage", "overload", "recovery"};
+    return names[phase];
+}
+
+// 'position' é a fração já decorrida do ciclo, em [0, 1)
+inline int phaseAt(double position) {
+    return position < 0.6 ? NORMAL : position < 0.75 ? OUTAGE : position < 0.9 ? OVERLOAD : RECOVERY;
+}
+
+inline double setting(const char* name, double fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::atof(v) : fallback;
+}
+
+// SOAK_REPLAY: arquivo com um payload JSON por linha (por exemplo, a saída
+// de RECEIVER_SINK=file:/caminho do middleware1), reproduzido em laço
+inline std::vector<std::string> loadReplay(const std::string& tag, const std::string& path) {
+    std::vector<std::string> lines;
+    if (path.empty()) return lines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '}') lines.push_back(line);
+    }
+    if (lines.empty()) std::cerr << "[" << tag << "][soak] no payloads in " << path << ", using synthetic readings" << std::endl;
+    return lines;
+}
+
+// Embute o instante de envio (sent_ns, relógio monotônico) no fim do objeto
+inline std::string stamp(const std::string& reading) {
+    std::string stamped = reading.substr(0, reading.size() - 1);
+    stamped += ",\"sent_ns\":";
+    stamped += std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    stamped += "}";
+    return stamped;
+}
+
+// Latência desde o sent_ns embutido; false se o payload não tem o campo
+inline bool sinceSent(const std::string& payload, std::chrono::steady_clock::duration& out) {
+    auto at = payload.find("\"sent_ns\":");
+    if (at == std::string::npos) return false;
+    std::chrono::steady_clock::duration sent(std::strtoll(payload.c_str() + at + 10, nullptr, 10));
+    out = std::chrono::steady_clock::now().time_since_epoch() - sent;
+    return true;
+}
+
+// Leitura no formato do sender, com um conjunto de dispositivos que gira
+// devagar para que sketches e tabelas por dispositivo também vejam chaves novas
+inline std::string syntheticReading(uint64_t seq) {
+    static const char* statuses[] = {"normal", "warning", "error"};
+    std::ostringstream out;
+    out << "{\"seq\":" << seq << ",\"device_id\":\"device_" << (seq % 500 + seq / 100000) << "\","
+        << "\"timestamp\":\"2024-01-01T12:00:00.000000+00:00\",\"temperature\":" << 20 + seq % 150 / 10.0
+        << ",\"humidity\":" << 40 + seq % 300 / 10.0 << ",\"status\":\"" << statuses[seq % 7 == 0 ? 1 + seq % 2 : 0]
+        << "\"}";
+    return stamp(out.str());
+}
+
+// Inclinação (mínimos quadrados) por ciclo de cada métrica da linha de
+// base, sem o ciclo de aquecimento; retorna true se algo cresce acima do
+// limite SOAK_*_SLOPE / SOAK_P99_DRIFT
+inline bool reportTrends(const std::string& tag, const std::vector<SoakBaseline>& baselines) {
+    if (baselines.size() < 4) {
+        std::cout << "[" << tag << "][soak] " << baselines.size()
+                  << " complete cycle(s): trends need at least 4 (the first is warm-up)" << std::endl;
+        return false;
+    }
+    std::vector<SoakBaseline> steady(baselines.begin() + 1, baselines.end());
+    auto slope = [&](double SoakBaseline::*metric) {
+        double n = static_cast<double>(steady.size());
+        double sx = 0, sy = 0, sxy = 0, sxx = 0;
+        for (size_t i = 0; i < steady.size(); ++i) {
+            double y = steady[i].*metric;
+            sx += i;
+            sy += y;
+            sxy += i * y;
+            sxx += static_cast<double>(i) * i;
+        }
+        return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    };
+    double p99Base = std::max(1.0, steady.front().p99Micros);
+    struct Trend {
+        const char* name;
+        double perCycle;
+        double limit;
+        const char* unit;
+    } trends[] = {
+        {"rss", slope(&SoakBaseline::rssMb), setting("SOAK_RSS_SLOPE_MB", 1.0), "MB"},
+        {"heap_inuse", slope(&SoakBaseline::heapInUseMb), setting("SOAK_HEAP_SLOPE_MB", 0.5), "MB"},
+        {"fragmentation", slope(&SoakBaseline::fragmentation), setting("SOAK_FRAG_SLOPE", 0.02), ""},
+        {"queued", slope(&SoakBaseline::queueDepth), setting("SOAK_QUEUE_SLOPE", 100), " msgs"},
+        {"normal_p99", slope(&SoakBaseline::p99Micros), setting("SOAK_P99_DRIFT", 0.1) * p99Base, "us"},
+    };
+    bool flagged = false;
+    for (const auto& trend : trends) {
+        bool rising = trend.perCycle > trend.limit;
+        flagged = flagged || rising;
+        std::cout << "[" << tag << "][soak] " << (rising ? "TREND " : "steady ") << trend.name << ": "
+                  << trend.perCycle << trend.unit << "/cycle (limit " << trend.limit << trend.unit << ")"
+                  << std::endl;
+    }
+    return flagged;
+}
+
+}  // namespace soak
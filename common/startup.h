@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+
+// ---------------------------------------------------------------------------
+// Partida a frio: tempo de cada fase, do exec do processo até a primeira
+// mensagem, e conexão aos brokers em paralelo com retentativa limitada.
+// Comum aos três middlewares; 'tag' é o prefixo dos logs ("Middleware1"),
+// que o collector.py usa para separar os processos.
+// ---------------------------------------------------------------------------
+
+// Tempo desde o exec (campo 22 de /proc/self/stat, resolução de um tick):
+// inclui carga de bibliotecas e inicialização estática, anteriores ao main
+static double millisSinceExec() {
+    std::ifstream stat("/proc/self/stat");
+    std::string line;
+    std::getline(stat, line);
+    auto end = line.rfind(')');  // o nome do processo pode conter espaços
+    if (end == std::string::npos) return 0.0;
+    std::istringstream fields(line.substr(end + 1));
+    std::string field;
+    for (int i = 3; i <= 22 && fields >> field; ++i) {
+    }
+    std::ifstream uptime("/proc/uptime");
+    double up = 0.0;
+    if (!(uptime >> up)) return 0.0;
+    return std::max(0.0, (up - std::atof(field.c_str()) / sysconf(_SC_CLK_TCK)) * 1000.0);
+}
+
+// Criado logo no início do main (no modo replicado do middleware2, no processo
+// de cada nó); cada mark() fecha uma fase e a primeira mensagem entregue ao
+// destino fecha a partida. Seguro entre threads: no modo por core do
+// middleware3 a fase final e a primeira mensagem podem coincidir.
+class StartupTimer {
+private:
+    const std::string tag;
+    const double processInitMs = millisSinceExec();
+    const std::chrono::steady_clock::time_point mainEntered = std::chrono::steady_clock::now();
+    std::mutex mtx;
+    std::chrono::steady_clock::time_point last = mainEntered;
+    std::ostringstream phases;
+    std::atomic<bool> finished{false};
+
+    explicit StartupTimer(const char* logTag) : tag(logTag) {}
+
+    void closePhase(const char* phase) {
+        auto now = std::chrono::steady_clock::now();
+        phases << " " << phase << "=" << std::chrono::duration<double, std::milli>(now - last).count() << "ms";
+        last = now;
+    }
+
+    double totalMs() const {
+        return processInitMs + std::chrono::duration<double, std::milli>(last - mainEntered).count();
+    }
+
+public:
+    // A primeira chamada (no início do main) cria o timer e fixa a tag
+    static StartupTimer& instance(const char* logTag = "Middleware") {
+        static StartupTimer timer(logTag);
+        return timer;
+    }
+
+    void mark(const char* phase) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!finished.load()) closePhase(phase);
+    }
+
+    bool done() const { return finished.load(std::memory_order_relaxed); }
+
+    // Pronto para consumir (conectado e assinado)
+    void ready() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::cout << "[" << tag << "] Ready after " << totalMs() << "ms: process_init=" << processInitMs << "ms"
+                  << phases.str() << std::endl;
+    }
+
+    // Primeira mensagem entregue: resumo único, lido pelo collector.py.
+    // Depois dela, só uma leitura atômica por mensagem
+    void firstMessage() {
+        if (done()) return;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (finished.load()) return;
+        closePhase("first_message");
+        finished.store(true);
+        std::cout << "[" << tag << "] Startup: process_init=" << processInitMs << "ms" << phases.str()
+                  << " total=" << totalMs() << "ms" << std::endl;
+    }
+};
+
+// Conecta clientes em paralelo: begin() dispara todos os CONNECTs sem esperar,
+// finish() aguarda e repete só os que falharam, com backoff exponencial e
+// jitter, até CONNECT_ATTEMPTS tentativas. Sem broker ao fim, lança exceção e
+// o processo termina com erro para o orquestrador reiniciá-lo.
+class BrokerConnector {
+private:
+    struct Pending {
+        mqtt::async_client* client;
+        std::string name;
+        mqtt::token_ptr token;
+    };
+
+    static long setting(const char* name, long fallback) {
+        const char* v = std::getenv(name);
+        return (v && *v) ? std::atol(v) : fallback;
+    }
+
+    const std::string tag;
+    std::vector<Pending> pending;
+    mqtt::connect_options options;
+    int attempt = 0;
+    const int maxAttempts = std::max(1, static_cast<int>(setting("CONNECT_ATTEMPTS", 10)));
+    std::chrono::milliseconds backoff{setting("CONNECT_BACKOFF_MS", 100)};
+    const std::chrono::milliseconds maxBackoff{setting("CONNECT_BACKOFF_MAX_MS", 5000)};
+    std::mt19937 rng{std::random_device{}()};
+
+public:
+    BrokerConnector(const std::string& logTag,
+                    const std::vector<std::pair<mqtt::async_client*, std::string>>& clients)
+        : tag(logTag) {
+        for (const auto& c : clients) pending.push_back({c.first, c.second, nullptr});
+        options.set_connect_timeout(static_cast<int>(setting("CONNECT_TIMEOUT_S", 5)));
+    }
+
+    void begin() {
+        ++attempt;
+        for (auto& p : pending) {
+            try {
+                p.token = p.client->connect(options);
+            } catch (const std::exception&) {
+                p.token = nullptr;
+            }
+        }
+    }
+
+    void finish() {
+        while (true) {
+            std::vector<Pending> failed;
+            std::string error;
+            for (auto& p : pending) {
+                try {
+                    if (!p.token) throw std::runtime_error("connect rejected");
+                    p.token->wait();
+                } catch (const std::exception& e) {
+                    error = e.what();
+                    failed.push_back({p.client, p.name, nullptr});
+                }
+            }
+            if (failed.empty()) return;
+            pending.swap(failed);
+            std::string names;
+            for (const auto& p : pending) names += (names.empty() ? "" : ",") + p.name;
+            if (attempt >= maxAttempts) {
+                throw std::runtime_error("broker unreachable for '" + names + "' after " +
+                                         std::to_string(attempt) + " attempts: " + error);
+            }
+            // jitter em [backoff/2, backoff]: reinícios simultâneos não batem juntos no broker
+            std::uniform_int_distribution<long> jitter(backoff.count() / 2, backoff.count());
+            std::chrono::milliseconds wait(jitter(rng));
+            std::cout << "[" << tag << "] Broker not reachable for '" << names << "' (attempt "
+                      << attempt << "/" << maxAttempts << ": " << error << "), retrying in " << wait.count() << "ms"
+                      << std::endl;
+            std::this_thread::sleep_for(wait);
+            backoff = std::min(backoff * 2, maxBackoff);
+            begin();
+        }
+    }
+
+    void connect() {
+        begin();
+        finish();
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// Roteamento por tópico: os filtros MQTT das rotas ('+' e '#') são compilados
+// numa trie plana. Os filhos exatos de todos os nós ficam numa única tabela
+// hash (nó, nível); '+' e '#' são ligações diretas do nó. O custo do match
+// depende dos níveis do tópico, não do número de padrões. Comum aos três
+// middlewares; cada um interpreta as opções das próprias rotas.
+// ---------------------------------------------------------------------------
+
+class TopicTrie {
+public:
+    static constexpr int NO_ROUTE = -1;
+    static constexpr size_t MAX_LEVELS = 32;
+
+private:
+    struct Node {
+        int32_t plus = -1;       // filho '+'
+        int32_t rest = NO_ROUTE; // rota de '#' neste nó
+        int32_t route = NO_ROUTE;
+    };
+    struct Edge {
+        uint32_t parent;
+        uint32_t child;
+        uint64_t hash;
+        std::string level;
+    };
+
+    std::vector<Node> nodes{1};
+    std::vector<Edge> edges;
+    std::vector<int32_t> table{std::vector<int32_t>(16, -1)};  // -> índice em edges
+
+    static uint64_t hashLevel(uint32_t parent, std::string_view level) {
+        uint64_t h = 1469598103934665603ull ^ (uint64_t(parent) * 0x9e3779b97f4a7c15ull);
+        for (unsigned char c : level) h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
+
+    int32_t child(uint32_t parent, std::string_view level) const {
+        uint64_t h = hashLevel(parent, level);
+        size_t mask = table.size() - 1;
+        for (size_t i = h & mask; table[i] >= 0; i = (i + 1) & mask) {
+            const Edge& e = edges[table[i]];
+            if (e.hash == h && e.parent == parent && e.level == level) return static_cast<int32_t>(e.child);
+        }
+        return -1;
+    }
+
+    void place(int32_t edge) {
+        size_t mask = table.size() - 1;
+        size_t i = edges[edge].hash & mask;
+        while (table[i] >= 0) i = (i + 1) & mask;
+        table[i] = edge;
+    }
+
+    uint32_t addChild(uint32_t parent, std::string_view level) {
+        int32_t existing = child(parent, level);
+        if (existing >= 0) return static_cast<uint32_t>(existing);
+        nodes.emplace_back();
+        edges.push_back({parent, static_cast<uint32_t>(nodes.size() - 1), hashLevel(parent, level), std::string(level)});
+        if (edges.size() * 2 > table.size()) {
+            table.assign(table.size() * 2, -1);
+            for (size_t e = 0; e < edges.size(); ++e) place(static_cast<int32_t>(e));
+        } else {
+            place(static_cast<int32_t>(edges.size() - 1));
+        }
+        return edges.back().child;
+    }
+
+    // Exato antes de '+', '+' antes de '#': vence o padrão mais específico
+    int walk(uint32_t node, const std::string_view* levels, size_t i, size_t n) const {
+        const Node& current = nodes[node];
+        if (i == n) return current.route != NO_ROUTE ? current.route : current.rest;
+        int32_t exact = child(node, levels[i]);
+        if (exact >= 0) {
+            int r = walk(static_cast<uint32_t>(exact), levels, i + 1, n);
+            if (r != NO_ROUTE) return r;
+        }
+        if (current.plus >= 0) {
+            int r = walk(static_cast<uint32_t>(current.plus), levels, i + 1, n);
+            if (r != NO_ROUTE) return r;
+        }
+        return current.rest;
+    }
+
+    template <typename Fn>
+    static size_t split(std::string_view topic, Fn&& each) {
+        size_t count = 0;
+        size_t start = 0;
+        while (true) {
+            size_t slash = topic.find('/', start);
+            each(count++, topic.substr(start, slash == std::string_view::npos ? std::string_view::npos : slash - start));
+            if (slash == std::string_view::npos) return count;
+            start = slash + 1;
+        }
+    }
+
+public:
+    // Registra um filtro MQTT; a primeira rota registrada para um filtro prevalece
+    void add(std::string_view pattern, int route) {
+        uint32_t node = 0;
+        bool terminal = false;
+        split(pattern, [&](size_t, std::string_view level) {
+            if (terminal) throw std::invalid_argument("'#' must be the last level in '" + std::string(pattern) + "'");
+            if (level == "#") {
+                terminal = true;
+                return;
+            }
+            if (level == "+") {
+                if (nodes[node].plus < 0) {
+                    nodes.emplace_back();
+                    nodes[node].plus = static_cast<int32_t>(nodes.size() - 1);
+                }
+                node = static_cast<uint32_t>(nodes[node].plus);
+            } else {
+                if (level.find_first_of("+#") != std::string_view::npos) {
+                    throw std::invalid_argument("wildcard inside a level in '" + std::string(pattern) + "'");
+                }
+                node = addChild(node, level);
+            }
+        });
+        int32_t& slot = terminal ? nodes[node].rest : nodes[node].route;
+        if (slot == NO_ROUTE) slot = route;
+    }
+
+    int match(std::string_view topic) const {
+        std::string_view levels[MAX_LEVELS];
+        size_t n = 0;
+        bool tooDeep = false;
+        split(topic, [&](size_t i, std::string_view level) {
+            if (i < MAX_LEVELS) levels[n++] = level;
+            else tooDeep = true;
+        });
+        return tooDeep ? NO_ROUTE : walk(0, levels, 0, n);
+    }
+};
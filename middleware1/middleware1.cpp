@@ -1,147 +1,1584 @@
-// middleware1.cpp
-#include <iostream>
-#include <queue>
-#include <chrono>
-#include <thread>
-#include <mqtt/async_client.h>
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
-
-class CircuitBreaker {
-private:
-    int failureCount = 0;
-    int successCount = 0;
-    bool isOpen = false;
-    std::chrono::steady_clock::time_point lastFailureTime;
-    const int failureThreshold = 3;
-    const int successThreshold = 2;
-    const std::chrono::seconds resetTimeout = std::chrono::seconds(10);
-
-public:
-    bool allowRequest() {
-        if (isOpen) {
-            auto now = std::chrono::steady_clock::now();
-            if (now - lastFailureTime > resetTimeout) {
-                isOpen = false;
-                return true;
-            }
-            return false;
-        }
-        return true;
-    }
-
-    void recordFailure() {
-        failureCount++;
-        successCount = 0;
-        lastFailureTime = std::chrono::steady_clock::now();
-        
-        if (failureCount >= failureThreshold) {
-            isOpen = true;
-            std::cout << "Circuit breaker OPENED" << std::endl;
-        }
-    }
-
-    void recordSuccess() {
-        successCount++;
-        if (successCount >= successThreshold) {
-            failureCount = 0;
-            std::cout << "Circuit breaker RESET" << std::endl;
-        }
-    }
-
-    bool isCircuitOpen() const { return isOpen; }
-};
-
-class MQTTMiddleware {
-private:
-    mqtt::async_client client;
-    std::queue<std::string> messageQueue;
-    CircuitBreaker cb;
-    const std::string RECEIVER_TOPIC = "iot/data";
-
-public:
-    MQTTMiddleware(const std::string& brokerAddress) 
-        : client(brokerAddress, "middleware1") {}
-
-    void start() {
-        client.connect()->wait();
-
-        // Ativa o consumo de mensagens
-        client.start_consuming();
-
-        client.subscribe("iot/input", 1)->wait(); // Recebe mensagens do sender
-        
-        while (true) {
-            auto msg = client.consume_message();
-            
-            if (msg) {
-                // Novo log para depuração
-                std::cout << "[Middleware1] Mensagem recebida no tópico 'iot/input': " 
-                          << msg->to_string() << std::endl;
-
-                processMessage(msg->to_string());
-            }
-            
-            retryFailedMessages();
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    }
-
-private:
-    void processMessage(const std::string& payload) {
-        try {
-            if (cb.allowRequest()) {
-                if (forwardToReceiverTopic(payload)) {
-                    cb.recordSuccess();
-                } else {
-                    cb.recordFailure();
-                    messageQueue.push(payload);
-                }
-            } else {
-                messageQueue.push(payload);
-                std::cout << "Circuit open - message queued" << std::endl;
-            }
-        } catch (const std::exception& e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-            messageQueue.push(payload);
-        }
-    }
-
-    bool forwardToReceiverTopic(const std::string& payload) {
-        // Publica a mensagem processada no tópico do receiver
-        mqtt::message_ptr pubmsg = mqtt::make_message(RECEIVER_TOPIC, payload);
-        pubmsg->set_qos(1);
-        client.publish(pubmsg)->wait();
-        
-        // Removida a simulação de falha interna: sempre retorna sucesso
-        return true;
-    }
-
-    void retryFailedMessages() {
-        static auto lastRetry = std::chrono::steady_clock::now();
-        auto now = std::chrono::steady_clock::now();
-        
-        if (now - lastRetry < std::chrono::seconds(5)) return;
-        lastRetry = now;
-        
-        if (messageQueue.empty()) return;
-        
-        std::cout << "Retrying " << messageQueue.size() << " queued messages" << std::endl;
-        
-        while (!messageQueue.empty()) {
-            auto msg = messageQueue.front();
-            if (forwardToReceiverTopic(msg)) {
-                messageQueue.pop();
-            } else {
-                break;
-            }
-        }
-    }
-};
-
-int main() {
-    MQTTMiddleware middleware("tcp://mosquitto:1883");
-    middleware.start();
-    return 0;
-}
+// middleware1.cpp
+#include <iostream>
+#include <queue>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <string_view>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <fstream>
+#include <cerrno>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include <nlohmann/json.hpp>
+#include "device_sketch.h"
+#include "topic_trie.h"
+#include "startup.h"
+#include "latency_tracker.h"
+#include "soak.h"
+
+using json = nlohmann::json;
+
+static double envDouble(const char* name, double fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::atof(v) : fallback;
+}
+
+static long envLong(const char* name, long fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::atol(v) : fallback;
+}
+
+static std::string envString(const char* name, const std::string& fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::string(v) : fallback;
+}
+
+class CircuitBreaker {
+private:
+    int failureCount = 0;
+    int successCount = 0;
+    bool isOpen = false;
+    std::chrono::steady_clock::time_point lastFailureTime;
+    const int failureThreshold = 3;
+    const int successThreshold = 2;
+    const std::chrono::seconds resetTimeout = std::chrono::seconds(10);
+
+public:
+    bool allowRequest() {
+        if (isOpen) {
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastFailureTime > resetTimeout) {
+                isOpen = false;
+                return true;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void recordFailure() {
+        failureCount++;
+        successCount = 0;
+        lastFailureTime = std::chrono::steady_clock::now();
+        
+        if (failureCount >= failureThreshold) {
+            isOpen = true;
+            std::cout << "Circuit breaker OPENED" << std::endl;
+        }
+    }
+
+    void recordSuccess() {
+        successCount++;
+        if (successCount >= successThreshold && failureCount > 0) {
+            failureCount = 0;
+            std::cout << "Circuit breaker RESET" << std::endl;
+        }
+    }
+
+    bool isCircuitOpen() const { return isOpen; }
+};
+
+// Orçamento global de retentativas: cada sucesso de primeira tentativa deposita
+// 'ratio' tokens, cada retentativa consome 1. Um piso de 'minPerSecond' garante
+// que o backlog drene mesmo sem tráfego novo. Contador em milli-tokens, sem lock.
+class RetryBudget {
+private:
+    static constexpr int64_t SCALE = 1000;
+    std::atomic<int64_t> tokens;
+    std::atomic<int64_t> lastRefillNs;
+    const int64_t depositPerSuccess;
+    const int64_t refillPerSecond;
+    const int64_t maxTokens;
+
+    static int64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void add(int64_t amount) {
+        int64_t cur = tokens.load(std::memory_order_relaxed);
+        int64_t next;
+        do {
+            next = std::min(maxTokens, cur + amount);
+        } while (!tokens.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+    }
+
+    void refill() {
+        int64_t now = nowNs();
+        int64_t last = lastRefillNs.load(std::memory_order_relaxed);
+        int64_t elapsed = now - last;
+        if (elapsed < 1000000) return; // no máximo a cada 1 ms
+        if (lastRefillNs.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            add(refillPerSecond * elapsed / 1000000000);
+        }
+    }
+
+public:
+    RetryBudget(double ratio, double minPerSecond, double maxBurst)
+        : tokens(0),
+          lastRefillNs(nowNs()),
+          depositPerSuccess(static_cast<int64_t>(ratio * SCALE)),
+          refillPerSecond(static_cast<int64_t>(minPerSecond * SCALE)),
+          maxTokens(static_cast<int64_t>(maxBurst * SCALE)) {}
+
+    void recordSuccess() { add(depositPerSuccess); }
+
+    bool tryAcquire() {
+        refill();
+        int64_t cur = tokens.load(std::memory_order_relaxed);
+        do {
+            if (cur < SCALE) return false;
+        } while (!tokens.compare_exchange_weak(cur, cur - SCALE, std::memory_order_relaxed));
+        return true;
+    }
+
+    int64_t available() const { return tokens.load(std::memory_order_relaxed) / SCALE; }
+};
+
+// Disputa entre o publish primário e o hedge: o primeiro PUBACK vence.
+// Mantida viva até as duas pernas completarem, pois o Paho guarda o listener.
+class AckRace {
+public:
+    class Leg : public mqtt::iaction_listener {
+    public:
+        AckRace* race = nullptr;
+        int index = 0;
+        void on_success(const mqtt::token&) override { race->complete(index, true); }
+        void on_failure(const mqtt::token&) override { race->complete(index, false); }
+    };
+
+    Leg legs[2];
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    LatencyTracker* primaryAckLatency = nullptr;
+
+    AckRace() {
+        for (int i = 0; i < 2; ++i) { legs[i].race = this; legs[i].index = i; }
+    }
+
+    void launch() {
+        std::lock_guard<std::mutex> lock(mtx);
+        ++issued;
+    }
+
+    void complete(int index, bool ok) {
+        if (ok && index == 0 && primaryAckLatency) {
+            primaryAckLatency->record(std::chrono::steady_clock::now() - started);
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        ++completed;
+        if (ok && winner < 0) winner = index;
+        if (!ok) ++failures;
+        cv.notify_all();
+    }
+
+    // true se alguma perna já confirmou dentro do prazo
+    bool waitFor(std::chrono::microseconds timeout) {
+        std::unique_lock<std::mutex> lock(mtx);
+        return cv.wait_for(lock, timeout, [this] { return winner >= 0 || failures == issued; })
+               && winner >= 0;
+    }
+
+    // índice da perna vencedora, ou -1 se todas falharam
+    int waitFirst() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return winner >= 0 || failures == issued; });
+        return winner;
+    }
+
+    bool finished() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return completed == issued;
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    int issued = 0;
+    int completed = 0;
+    int failures = 0;
+    int winner = -1;
+};
+
+// Lê o valor de "device_id" direto do payload, sem montar o JSON (alimenta o DeviceSketch)
+static bool extractDeviceId(std::string_view payload, std::string_view& out) {
+    static constexpr std::string_view KEY = "\"device_id\"";
+    size_t p = payload.find(KEY);
+    if (p == std::string_view::npos) return false;
+    p += KEY.size();
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != ':') return false;
+    ++p;
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != '"') return false;
+    size_t end = payload.find('"', ++p);
+    if (end == std::string_view::npos) return false;
+    out = payload.substr(p, end - p);
+    return true;
+}
+
+// Opções por rota; o casamento dos filtros fica na TopicTrie (topic_trie.h)
+struct TopicRoute {
+    std::string pattern;
+    std::string breaker = "default";  // rotas com o mesmo nome dividem o breaker
+    bool hedge = false;
+};
+
+// TOPIC_ROUTES="filtro[,breaker=nome][,hedge];..." - os filtros são também as
+// assinaturas; o primeiro filtro idêntico prevalece
+static std::vector<TopicRoute> parseTopicRoutes(const std::string& spec) {
+    std::vector<TopicRoute> routes;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+        std::stringstream fields(item);
+        std::string field;
+        TopicRoute route;
+        while (std::getline(fields, field, ',')) {
+            auto eq = field.find('=');
+            if (route.pattern.empty() && eq == std::string::npos) {
+                route.pattern = field;
+            } else if (field.compare(0, eq, "breaker") == 0 && eq != std::string::npos) {
+                route.breaker = field.substr(eq + 1);
+            } else if (field == "hedge") {
+                route.hedge = true;
+            } else {
+                std::cerr << "[Middleware1] Unknown route option '" << field << "' in '" << item << "'" << std::endl;
+            }
+        }
+        if (!route.pattern.empty()) routes.push_back(std::move(route));
+    }
+    if (routes.empty()) {
+        TopicRoute fallback;
+        fallback.pattern = "iot/input";
+        routes.push_back(fallback);
+    }
+    return routes;
+}
+
+// ---------------------------------------------------------------------------
+// Orçamento global de memória: filas e caches registram seus bytes em contas
+// atômicas e consultam a pressão antes de crescer. O teto (MEMORY_BUDGET_MB,
+// por padrão 80% do limite do cgroup) vale para o maior entre o total
+// contabilizado e o RSS medido, que inclui fragmentação e o que não é
+// contabilizado (fila de consumo do Paho, buffers de rede).
+//   soft (>= MEMORY_SOFT_RATIO): filas com spill vão para disco, backlogs
+//        de destinos descartam as mais antigas;
+//   hard (>= MEMORY_HARD_RATIO): nada novo entra na memória (shed).
+// ---------------------------------------------------------------------------
+
+enum class MemoryPressure { Normal, Soft, Hard };
+
+class MemoryAccount {
+private:
+    const std::string accountName;
+    std::atomic<int64_t> bytes{0};
+    std::atomic<uint64_t> shed{0};
+    std::atomic<uint64_t> spilled{0};
+    std::atomic<uint64_t> evicted{0};
+
+public:
+    explicit MemoryAccount(const std::string& name) : accountName(name) {}
+
+    // Custo aproximado de uma string numa fila: conteúdo + objeto + nó
+    static int64_t cost(const std::string& payload) {
+        return static_cast<int64_t>(payload.size() + sizeof(std::string) + 16);
+    }
+
+    void add(int64_t n) { bytes.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n) { bytes.fetch_sub(n, std::memory_order_relaxed); }
+    void recordShed(uint64_t n = 1) { shed.fetch_add(n, std::memory_order_relaxed); }
+    void recordSpill() { spilled.fetch_add(1, std::memory_order_relaxed); }
+    void recordEviction() { evicted.fetch_add(1, std::memory_order_relaxed); }
+
+    const std::string& name() const { return accountName; }
+    int64_t used() const { return bytes.load(std::memory_order_relaxed); }
+
+    std::string report() const {
+        std::ostringstream out;
+        out << accountName << "=" << used() / 1024 << "KB";
+        if (shed.load()) out << " shed=" << shed.load();
+        if (spilled.load()) out << " spilled=" << spilled.load();
+        if (evicted.load()) out << " evicted=" << evicted.load();
+        return out.str();
+    }
+};
+
+class MemoryBudget {
+private:
+    std::mutex mtx;
+    std::deque<MemoryAccount> accounts;  // deque: referências estáveis
+    int64_t cap = 0;                     // 0 = sem teto
+    double softRatio = 0.8;
+    double hardRatio = 0.95;
+    std::atomic<int64_t> rss{0};
+    std::atomic<int> level{static_cast<int>(MemoryPressure::Normal)};
+    std::chrono::steady_clock::time_point lastTrim;
+
+    // Limite do container: cgroup v2, depois v1 (valores enormes = sem limite)
+    static int64_t containerLimit() {
+        for (const char* path : {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"}) {
+            std::ifstream in(path);
+            std::string value;
+            if (in >> value && value != "max") {
+                long long limit = std::atoll(value.c_str());
+                if (limit > 0 && limit < (1LL << 50)) return limit;
+            }
+        }
+        return 0;
+    }
+
+    static int64_t residentBytes() {
+        std::ifstream in("/proc/self/statm");
+        long long size = 0;
+        long long resident = 0;
+        in >> size >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+public:
+    MemoryBudget() {
+        double budgetMb = envDouble("MEMORY_BUDGET_MB", 0);
+        cap = budgetMb > 0 ? static_cast<int64_t>(budgetMb * 1024 * 1024)
+                           : static_cast<int64_t>(containerLimit() * 0.8);
+        softRatio = envDouble("MEMORY_SOFT_RATIO", 0.8);
+        hardRatio = envDouble("MEMORY_HARD_RATIO", 0.95);
+    }
+
+    static MemoryBudget& instance() {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    MemoryAccount& account(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& account : accounts) {
+            if (account.name() == name) return account;
+        }
+        accounts.emplace_back(name);
+        return accounts.back();
+    }
+
+    int64_t accounted() {
+        std::lock_guard<std::mutex> lock(mtx);
+        int64_t total = 0;
+        for (const auto& account : accounts) total += account.used();
+        return total;
+    }
+
+    // Consulta barata no caminho quente; o nível é recalculado por refresh()
+    MemoryPressure pressure() const { return static_cast<MemoryPressure>(level.load(std::memory_order_relaxed)); }
+
+    // Chamado periodicamente pela thread principal: mede o RSS, recalcula a
+    // pressão e, sob pressão, devolve ao sistema o heap livre (malloc_trim)
+    void refresh() {
+        int64_t resident = residentBytes();
+        rss.store(resident, std::memory_order_relaxed);
+        MemoryPressure next = MemoryPressure::Normal;
+        if (cap > 0) {
+            double usage = static_cast<double>(std::max(resident, accounted())) / cap;
+            if (usage >= hardRatio) next = MemoryPressure::Hard;
+            else if (usage >= softRatio) next = MemoryPressure::Soft;
+        }
+        if (static_cast<int>(next) != level.exchange(static_cast<int>(next))) {
+            static const char* names[] = {"normal", "soft", "hard"};
+            std::cout << "[Middleware1] Memory pressure " << names[static_cast<int>(next)] << " (rss="
+                      << resident / (1024 * 1024) << "MB cap=" << cap / (1024 * 1024) << "MB)" << std::endl;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (next != MemoryPressure::Normal && now - lastTrim >= std::chrono::seconds(1)) {
+            malloc_trim(0);
+            lastTrim = now;
+        }
+    }
+
+    std::string report() {
+        static const char* names[] = {"normal", "soft", "hard"};
+        std::ostringstream out;
+        out << "rss=" << rss.load() / (1024 * 1024) << "MB accounted=" << accounted() / 1024 << "KB cap="
+            << (cap ? std::to_string(cap / (1024 * 1024)) + "MB" : std::string("none"))
+            << " pressure=" << names[level.load()];
+        std::lock_guard<std::mutex> lock(mtx);
+        for (const auto& account : accounts) out << " " << account.report();
+        return out.str();
+    }
+};
+
+// Fila de retentativas com spill: sob pressão os registros vão para um
+// arquivo ([len][bytes]) e voltam em blocos quando a memória esvazia. Com
+// registros no disco, os novos também vão para lá, preservando a ordem. Um
+// spill deixado por uma execução anterior é reenviado (o receiver deduplica
+// por 'seq'); a cauda de uma gravação interrompida é cortada.
+class RetryBacklog {
+private:
+    std::deque<std::string> memory;
+    MemoryAccount& account = MemoryBudget::instance().account("retry");
+    const std::string spillPath = envString("SPILL_DIR", "/tmp") + "/middleware1-retry.spill";
+    const bool spillEnabled = envDouble("RETRY_SPILL", 1) != 0;
+    int spillFd = -1;
+    size_t spilledPending = 0;
+    off_t readOffset = 0;
+
+    // Acima disso o tamanho lido só pode ser lixo de um registro corrompido
+    static constexpr uint32_t MAX_RECORD = 16 * 1024 * 1024;
+
+    bool readRecord(off_t& offset, std::string* payload) const {
+        uint32_t len;
+        if (pread(spillFd, &len, sizeof(len), offset) != static_cast<ssize_t>(sizeof(len))) return false;
+        if (len > MAX_RECORD) return false;
+        if (payload) {
+            payload->resize(len);
+            if (len > 0 && pread(spillFd, &(*payload)[0], len, offset + static_cast<off_t>(sizeof(len))) !=
+                               static_cast<ssize_t>(len)) {
+                return false;
+            }
+        } else {
+            struct stat st;
+            if (fstat(spillFd, &st) != 0 || st.st_size - offset - static_cast<off_t>(sizeof(len)) < len) return false;
+        }
+        offset += static_cast<off_t>(sizeof(len) + len);
+        return true;
+    }
+
+    // Conta os registros íntegros de uma execução anterior e corta o resto
+    void recover() {
+        off_t offset = 0;
+        while (readRecord(offset, nullptr)) ++spilledPending;
+        if (ftruncate(spillFd, offset) != 0) {
+            std::cerr << "[Middleware1] Retry spill: cannot trim " << spillPath << std::endl;
+        }
+        if (spilledPending > 0) {
+            std::cout << "[Middleware1] Retry spill: resending " << spilledPending
+                      << " messages left by the previous run" << std::endl;
+        }
+    }
+
+    bool spill(const std::string& payload) {
+        if (spillFd < 0 || payload.size() > MAX_RECORD) return false;
+        uint32_t len = static_cast<uint32_t>(payload.size());
+        iovec parts[2] = {{&len, sizeof(len)}, {const_cast<char*>(payload.data()), payload.size()}};
+        ssize_t n = writev(spillFd, parts, 2);
+        if (n != static_cast<ssize_t>(sizeof(len) + payload.size())) {
+            // registro parcial: corta de volta para não desalinhar a leitura
+            struct stat st;
+            if (n > 0 && fstat(spillFd, &st) == 0) (void)!ftruncate(spillFd, st.st_size - n);
+            return false;
+        }
+        ++spilledPending;
+        account.recordSpill();
+        return true;
+    }
+
+    void refill() {
+        bool readable = true;
+        for (int i = 0; i < 256 && spilledPending > 0; ++i) {
+            std::string payload;
+            if (!readRecord(readOffset, &payload)) {
+                readable = false;
+                break;
+            }
+            account.add(MemoryAccount::cost(payload));
+            memory.push_back(std::move(payload));
+            --spilledPending;
+        }
+        if (spilledPending == 0 || !readable) {
+            if (spilledPending > 0) {
+                // arquivo ilegível ou truncado: o restante não tem como voltar
+                std::cerr << "[Middleware1] Retry spill unreadable - " << spilledPending
+                          << " queued messages lost" << std::endl;
+                account.recordShed(spilledPending);
+            }
+            // arquivo consumido (ou ilegível): recomeça vazio
+            if (ftruncate(spillFd, 0) != 0) {
+                std::cerr << "[Middleware1] Retry spill: cannot truncate " << spillPath << std::endl;
+            }
+            spilledPending = 0;
+            readOffset = 0;
+        }
+    }
+
+public:
+    RetryBacklog() {
+        if (!spillEnabled) return;
+        spillFd = open(spillPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (spillFd < 0) {
+            std::cerr << "[Middleware1] Retry spill disabled: cannot open " << spillPath << std::endl;
+            return;
+        }
+        recover();
+    }
+
+    ~RetryBacklog() {
+        if (spillFd >= 0) close(spillFd);
+    }
+
+    RetryBacklog(const RetryBacklog&) = delete;
+    RetryBacklog& operator=(const RetryBacklog&) = delete;
+
+    void push(const std::string& payload) {
+        MemoryPressure pressure = MemoryBudget::instance().pressure();
+        if (spillEnabled && (spilledPending > 0 || pressure != MemoryPressure::Normal) && spill(payload)) return;
+        if (pressure == MemoryPressure::Hard) {
+            account.recordShed();
+            return;
+        }
+        account.add(MemoryAccount::cost(payload));
+        memory.push_back(payload);
+    }
+
+    // Traz o próximo trecho do spill para a memória; front() só é válido
+    // depois de empty() retornar false
+    bool empty() {
+        if (memory.empty() && spilledPending > 0) refill();
+        return memory.empty();
+    }
+    size_t size() const { return memory.size() + spilledPending; }
+
+    std::string& front() { return memory.front(); }
+
+    void pop() {
+        if (memory.empty()) return;
+        account.sub(MemoryAccount::cost(memory.front()));
+        memory.pop_front();
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Fan-out: cada destino adicional (arquivo bruto, alertas, agregados) tem
+// thread, conexão, breaker, janela de publishes em voo e backlog próprios.
+// A ingestão só enfileira; um destino lento ou fora do ar não atrasa os demais.
+// ---------------------------------------------------------------------------
+
+enum class SinkFilter { All, Alerts, Summary };
+
+static SinkFilter parseSinkFilter(const std::string& name) {
+    if (name == "alerts") return SinkFilter::Alerts;
+    if (name == "summary") return SinkFilter::Summary;
+    return SinkFilter::All;
+}
+
+// Meio de entrega de um destino. send() recebe um lote, remove dele o que foi
+// entregue e deixa o restante para voltar ao backlog
+class SinkTransport {
+public:
+    virtual ~SinkTransport() = default;
+    virtual std::string describe() const = 0;
+    virtual bool ready() const = 0;
+    virtual bool open() = 0;
+    virtual void send(std::deque<std::string>& batch) = 0;
+};
+
+// Publish MQTT: o lote inteiro sai de uma vez e os PUBACKs são aguardados juntos
+class MqttTransport : public SinkTransport {
+private:
+    mqtt::async_client client;
+    const std::string topic;
+
+public:
+    MqttTransport(const std::string& brokerAddress, const std::string& clientId, const std::string& sinkTopic)
+        : client(brokerAddress, clientId), topic(sinkTopic) {}
+
+    std::string describe() const override { return topic; }
+    bool ready() const override { return client.is_connected(); }
+
+    bool open() override {
+        try {
+            client.connect()->wait();
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    void send(std::deque<std::string>& batch) override {
+        std::vector<mqtt::delivery_token_ptr> tokens;
+        tokens.reserve(batch.size());
+        try {
+            for (const auto& payload : batch) {
+                mqtt::message_ptr msg = mqtt::make_message(topic, payload);
+                msg->set_qos(1);
+                tokens.push_back(client.publish(msg));
+            }
+        } catch (const std::exception&) {
+        }
+        // Mantém no lote só o que não foi confirmado (QoS 1: o receiver deduplica por 'seq')
+        std::deque<std::string> failed;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            bool acked = false;
+            try {
+                acked = i < tokens.size() && tokens[i]->wait_for(std::chrono::seconds(5));
+            } catch (const std::exception&) {
+            }
+            if (!acked) failed.push_back(std::move(batch[i]));
+        }
+        batch.swap(failed);
+    }
+};
+
+// Escrita de um lote de linhas com um único writev/sendmsg por até IOV_MAX
+// mensagens; retorna quantas mensagens foram escritas por inteiro
+static size_t writeLines(int fd, bool socket, const std::deque<std::string>& batch, bool& broken) {
+    static const char NEWLINE = '\n';
+    static constexpr size_t MAX_IOV = 1024;  // IOV_MAX no Linux
+    std::vector<iovec> iov;
+    size_t written = 0;
+    while (written < batch.size()) {
+        size_t count = std::min(batch.size() - written, MAX_IOV / 2);
+        iov.clear();
+        for (size_t i = written; i < written + count; ++i) {
+            iov.push_back({const_cast<char*>(batch[i].data()), batch[i].size()});
+            iov.push_back({const_cast<char*>(&NEWLINE), 1});
+        }
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t n;
+            if (socket) {
+                msghdr msg{};
+                msg.msg_iov = iov.data() + first;
+                msg.msg_iovlen = iov.size() - first;
+                n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+            } else {
+                n = ::writev(fd, iov.data() + first, static_cast<int>(iov.size() - first));
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                broken = true;
+                return written + first / 2;  // pares (payload, '\n') completos
+            }
+            size_t left = static_cast<size_t>(n);
+            while (first < iov.size() && left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                ++first;
+            }
+            if (left > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+        written += count;
+    }
+    return written;
+}
+
+// Stream Unix (uma mensagem por linha); linha parcial corrompe o stream,
+// então a conexão é descartada e refeita
+class UdsTransport : public SinkTransport {
+private:
+    const std::string path;
+    int fd = -1;
+
+public:
+    explicit UdsTransport(const std::string& socketPath) : path(socketPath) {}
+    ~UdsTransport() override {
+        if (fd >= 0) close(fd);
+    }
+
+    std::string describe() const override { return "uds:" + path; }
+    bool ready() const override { return fd >= 0; }
+
+    bool open() override {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un sa{};
+        sa.sun_family = AF_UNIX;
+        std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void send(std::deque<std::string>& batch) override {
+        bool broken = false;
+        size_t written = writeLines(fd, true, batch, broken);
+        if (broken) {
+            close(fd);
+            fd = -1;
+            // a mensagem cortada é reenviada inteira na próxima conexão
+        }
+        batch.erase(batch.begin(), batch.begin() + static_cast<long>(written));
+    }
+};
+
+// Arquivo append-only (JSON Lines), um writev por lote
+class FileTransport : public SinkTransport {
+private:
+    const std::string path;
+    int fd = -1;
+
+public:
+    explicit FileTransport(const std::string& filePath) : path(filePath) {}
+    ~FileTransport() override {
+        if (fd >= 0) close(fd);
+    }
+
+    std::string describe() const override { return "file:" + path; }
+    bool ready() const override { return fd >= 0; }
+
+    bool open() override {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        return fd >= 0;
+    }
+
+    // Falha no meio do lote (disco cheio, EIO) deixa uma linha parcial: o
+    // arquivo volta ao fim da última linha completa e é reaberto, como a
+    // conexão do UdsTransport; o restante do lote volta ao backlog
+    void send(std::deque<std::string>& batch) override {
+        off_t start = lseek(fd, 0, SEEK_END);
+        bool broken = false;
+        size_t written = writeLines(fd, false, batch, broken);
+        if (broken) {
+            off_t complete = start;
+            for (size_t i = 0; i < written; ++i) complete += static_cast<off_t>(batch[i].size() + 1);
+            if (start < 0 || ftruncate(fd, complete) != 0) {
+                std::cerr << "[Middleware1] Sink file:" << path << " cannot trim partial line: "
+                          << std::strerror(errno) << std::endl;
+            }
+            close(fd);
+            fd = -1;
+        }
+        batch.erase(batch.begin(), batch.begin() + static_cast<long>(written));
+    }
+};
+
+// Só conta: mede o teto do middleware sem nenhum destino real
+class NullTransport : public SinkTransport {
+public:
+    std::string describe() const override { return "null"; }
+    bool ready() const override { return true; }
+    bool open() override { return true; }
+    void send(std::deque<std::string>& batch) override { batch.clear(); }
+};
+
+// Destino do modo soak: simula quedas do receiver e mede a latência de
+// entrega pelo campo sent_ns que o gerador embute em cada leitura
+class SoakTransport : public SinkTransport {
+private:
+    std::atomic<bool> down{false};
+    LatencyTracker& latency;
+
+public:
+    explicit SoakTransport(LatencyTracker& tracker) : latency(tracker) {}
+
+    void setDown(bool value) { down.store(value, std::memory_order_relaxed); }
+
+    std::string describe() const override { return "soak"; }
+    bool ready() const override { return true; }
+    bool open() override { return true; }
+
+    void send(std::deque<std::string>& batch) override {
+        if (down.load(std::memory_order_relaxed)) return;  // o lote inteiro volta ao backlog
+        std::chrono::steady_clock::duration since;
+        for (const auto& payload : batch) {
+            if (soak::sinceSent(payload, since)) latency.record(since);
+        }
+        batch.clear();
+    }
+};
+
+// Destino: "uds:/caminho", "file:/caminho", "null" ou um tópico MQTT
+static std::unique_ptr<SinkTransport> makeTransport(const std::string& destination, const std::string& brokerAddress,
+                                                    const std::string& clientId) {
+    if (destination.compare(0, 4, "uds:") == 0) return std::make_unique<UdsTransport>(destination.substr(4));
+    if (destination.compare(0, 5, "file:") == 0) return std::make_unique<FileTransport>(destination.substr(5));
+    if (destination == "null") return std::make_unique<NullTransport>();
+    return std::make_unique<MqttTransport>(brokerAddress, clientId, destination);
+}
+
+class Sink {
+private:
+    const std::string sinkName;
+    const SinkFilter sinkFilter;
+    const size_t window;      // mensagens por lote em voo
+    const size_t backlogCap;
+    MemoryAccount& memory;    // bytes do backlog no orçamento global
+    std::unique_ptr<SinkTransport> transport;
+    CircuitBreaker breaker;   // usado só pela thread do destino
+
+    std::mutex mtx;
+    std::condition_variable ready;
+    std::deque<std::string> backlog;
+    bool stopping = false;
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<bool> circuitOpen{false};
+    std::thread worker;
+
+public:
+    Sink(const std::string& name, std::unique_ptr<SinkTransport> sinkTransport, SinkFilter filter,
+         size_t inflightWindow, size_t maxBacklog)
+        : sinkName(name), sinkFilter(filter),
+          window(std::max<size_t>(1, inflightWindow)), backlogCap(std::max<size_t>(1, maxBacklog)),
+          memory(MemoryBudget::instance().account("sink:" + name)), transport(std::move(sinkTransport)) {}
+
+    ~Sink() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        ready.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    void start() { worker = std::thread([this] { run(); }); }
+
+    const std::string& name() const { return sinkName; }
+    std::string destination() const { return transport->describe(); }
+    SinkFilter filter() const { return sinkFilter; }
+    uint64_t delivered() const { return sent.load(std::memory_order_relaxed); }
+    bool isCircuitOpen() const { return circuitOpen.load(std::memory_order_relaxed); }
+
+    size_t depth() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return backlog.size();
+    }
+
+    // Nunca bloqueia a ingestão: com o backlog cheio, ou sob pressão de
+    // memória, a mais antiga sai para a nova entrar; no teto, a nova é descartada
+    void offer(std::string payload) {
+        MemoryPressure pressure = MemoryBudget::instance().pressure();
+        if (pressure == MemoryPressure::Hard) {
+            memory.recordShed();
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (backlog.size() >= backlogCap || (pressure == MemoryPressure::Soft && !backlog.empty())) {
+                if (pressure == MemoryPressure::Soft) memory.recordEviction();
+                memory.sub(MemoryAccount::cost(backlog.front()));
+                backlog.pop_front();
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            memory.add(MemoryAccount::cost(payload));
+            backlog.push_back(std::move(payload));
+        }
+        ready.notify_one();
+    }
+
+    std::string report() {
+        size_t pending = depth();
+        std::ostringstream out;
+        out << "sink '" << sinkName << "' -> " << transport->describe() << ": sent=" << sent.load()
+            << " backlog=" << pending << " dropped=" << dropped.load() << " failures=" << failures.load()
+            << (circuitOpen.load() ? " circuit=open" : " circuit=closed");
+        return out.str();
+    }
+
+private:
+    // Devolve ao início do backlog, na ordem original, o que não foi entregue
+    void requeue(std::deque<std::string>& batch) {
+        std::lock_guard<std::mutex> lock(mtx);
+        while (!batch.empty()) {
+            if (backlog.size() >= backlogCap) {
+                dropped.fetch_add(batch.size(), std::memory_order_relaxed);
+                batch.clear();
+                return;
+            }
+            memory.add(MemoryAccount::cost(batch.back()));
+            backlog.push_front(std::move(batch.back()));
+            batch.pop_back();
+        }
+    }
+
+    // Aguarda sem consumir CPU; retorna false quando o destino está parando
+    bool pause(std::chrono::milliseconds interval) {
+        std::unique_lock<std::mutex> lock(mtx);
+        return !ready.wait_for(lock, interval, [this] { return stopping; });
+    }
+
+    void run() {
+        std::deque<std::string> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                ready.wait_for(lock, std::chrono::seconds(1), [&] { return stopping || !backlog.empty(); });
+                if (stopping) return;
+                if (backlog.empty()) continue;
+            }
+            if (!transport->ready()) {
+                if (transport->open()) {
+                    std::cout << "[Middleware1] Sink '" << sinkName << "' connected to "
+                              << transport->describe() << std::endl;
+                } else {
+                    failures.fetch_add(1, std::memory_order_relaxed);
+                    if (!pause(std::chrono::seconds(1))) return;
+                    continue;
+                }
+            }
+            bool allowed = breaker.allowRequest();
+            circuitOpen.store(!allowed, std::memory_order_relaxed);
+            if (!allowed) {
+                if (!pause(std::chrono::milliseconds(500))) return;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                while (!backlog.empty() && batch.size() < window) {
+                    memory.sub(MemoryAccount::cost(backlog.front()));
+                    batch.push_back(std::move(backlog.front()));
+                    backlog.pop_front();
+                }
+            }
+            size_t size = batch.size();
+            transport->send(batch);
+            sent.fetch_add(size - batch.size(), std::memory_order_relaxed);
+            if (batch.empty()) {
+                breaker.recordSuccess();
+            } else {
+                breaker.recordFailure();
+                failures.fetch_add(1, std::memory_order_relaxed);
+                requeue(batch);
+            }
+        }
+    }
+};
+
+// Resumo periódico das leituras encaminhadas, publicado nos destinos 'summary'
+class ReadingSummary {
+private:
+    uint64_t count = 0;
+    uint64_t abnormal = 0;
+    uint64_t temperatures = 0;
+    double sum = 0.0;
+    double minTemperature = 0.0;
+    double maxTemperature = 0.0;
+    std::chrono::steady_clock::time_point windowStart = std::chrono::steady_clock::now();
+
+public:
+    void add(const json& reading) {
+        ++count;
+        auto status = reading.find("status");
+        if (status != reading.end() && status->is_string() && *status != "normal") ++abnormal;
+        auto temperature = reading.find("temperature");
+        if (temperature != reading.end() && temperature->is_number()) {
+            double t = temperature->get<double>();
+            minTemperature = temperatures ? std::min(minTemperature, t) : t;
+            maxTemperature = temperatures ? std::max(maxTemperature, t) : t;
+            sum += t;
+            ++temperatures;
+        }
+    }
+
+    bool due(std::chrono::milliseconds interval) const {
+        return count > 0 && std::chrono::steady_clock::now() - windowStart >= interval;
+    }
+
+    std::string take() {
+        auto now = std::chrono::steady_clock::now();
+        json out = {
+            {"window_ms", std::chrono::duration_cast<std::chrono::milliseconds>(now - windowStart).count()},
+            {"count", count},
+            {"abnormal", abnormal}};
+        if (temperatures) {
+            out["temperature"] = {{"min", minTemperature}, {"max", maxTemperature}, {"avg", sum / temperatures}};
+        }
+        *this = ReadingSummary();
+        return out.dump();
+    }
+};
+
+// Teto do caminho de saída sem broker: o produtor alimenta um Sink local
+// (nulo, arquivo ou socket Unix lido por uma thread) com lotes de 1 e de 64
+static void runSinkBench(long messages) {
+    const std::string payload =
+        "{\"seq\": 1, \"device_id\": \"device_7\", \"timestamp\": \"2024-01-01T12:00:00.000000+00:00\", "
+        "\"temperature\": 24.5, \"humidity\": 55.1, \"status\": \"normal\"}";
+    const std::string filePath = "/tmp/middleware1-sink-bench.jsonl";
+    const std::string socketPath = "/tmp/middleware1-sink-bench.sock";
+    constexpr size_t BACKLOG = 65536;
+
+    // Leitor do socket: aceita conexões e descarta os bytes
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    std::strncpy(sa.sun_path, socketPath.c_str(), sizeof(sa.sun_path) - 1);
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 || listen(listener, 4) != 0) {
+        std::cerr << "[Middleware1][sink-bench] cannot listen on " << socketPath << std::endl;
+        close(listener);
+        return;
+    }
+    std::thread reader([listener] {
+        std::vector<char> buffer(1 << 16);
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) return;
+            while (read(fd, buffer.data(), buffer.size()) > 0) {
+            }
+            close(fd);
+        }
+    });
+
+    for (const std::string& destination : std::vector<std::string>{"null", "file:" + filePath, "uds:" + socketPath}) {
+        for (size_t window : {1, 64}) {
+            unlink(filePath.c_str());
+            Sink sink("bench", makeTransport(destination, "", "middleware1_sink_bench"), SinkFilter::All, window,
+                      BACKLOG);
+            sink.start();
+            auto started = std::chrono::steady_clock::now();
+            for (long i = 0; i < messages; ++i) {
+                // contrapressão do próprio benchmark: nada é descartado
+                while (static_cast<uint64_t>(i) - sink.delivered() >= BACKLOG - window) std::this_thread::yield();
+                sink.offer(payload);
+            }
+            while (sink.delivered() < static_cast<uint64_t>(messages)) std::this_thread::yield();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            std::cout << "[Middleware1][sink-bench] " << destination << " batch=" << window << " "
+                      << static_cast<long>(messages / seconds) << " msg/s (" << seconds * 1e9 / messages
+                      << "ns/msg)" << std::endl;
+        }
+    }
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    reader.join();
+    unlink(socketPath.c_str());
+    unlink(filePath.c_str());
+}
+
+class MQTTMiddleware {
+private:
+    mqtt::async_client client;
+    mqtt::async_client hedge_client;  // conexão alternativa para publishes hedged
+    RetryBacklog messageQueue;  // contabilizada no orçamento de memória, com spill
+    // Um breaker por nome de rota: falhas de um grupo de tópicos não abrem os demais
+    std::map<std::string, CircuitBreaker> breakers;
+    std::vector<TopicRoute> routes;
+    std::vector<CircuitBreaker*> routeBreaker;  // breaker de cada rota
+    TopicTrie topicRoutes;
+    RetryBudget& retryBudget;
+    const std::string RECEIVER_TOPIC = "iot/data";
+
+    // Hedging: tópicos de entrada sensíveis à latência (HEDGE_TOPICS, separados por vírgula)
+    std::vector<std::string> hedgeTopics;
+    bool hedgeEnabled = false;  // HEDGE_TOPICS ou alguma rota com 'hedge'
+    LatencyTracker ackLatency;      // PUBACK da conexão primária -> gatilho p95
+    LatencyTracker forwardLatency;  // latência efetiva do forward (primeiro ack)
+    std::deque<std::shared_ptr<AckRace>> pendingRaces;
+    uint64_t forwarded = 0;
+    uint64_t hedgesIssued = 0;
+    uint64_t hedgeWins = 0;
+
+    DeviceSketch deviceSketch{static_cast<size_t>(std::max(1L, envLong("HOT_DEVICES_K", 64)))};
+
+    // Destinos de fan-out além do RECEIVER_TOPIC (SINKS)
+    std::vector<std::unique_ptr<Sink>> sinks;
+    bool sinksNeedFields = false;  // algum destino filtra ou resume leituras
+    ReadingSummary summary;
+    const std::chrono::milliseconds summaryInterval{
+        static_cast<long>(envDouble("SINK_SUMMARY_MS", 10000))};
+    // RECEIVER_SINK=uds:/caminho | file:/caminho | null troca o publish no
+    // RECEIVER_TOPIC por um destino local, sem broker no caminho de saída
+    std::unique_ptr<Sink> receiverSink;
+
+    MemoryBudget& memoryBudget = MemoryBudget::instance();
+    MemoryAccount& ingestMemory = memoryBudget.account("ingest");
+    bool verbose = true;  // logs por mensagem; desligado no soak
+    std::thread hedgeConnector;  // conexão de hedge, fora do caminho da partida
+
+public:
+    MQTTMiddleware(const std::string& brokerAddress, RetryBudget& budget,
+                   const std::string& hedgeBrokerAddress, const std::string& hedgeTopicList,
+                   const std::string& routeSpec)
+        : client(brokerAddress, "middleware1"),
+          hedge_client(hedgeBrokerAddress, "middleware1_hedge"),
+          retryBudget(budget)
+    {
+        std::stringstream ss(hedgeTopicList);
+        std::string topic;
+        while (std::getline(ss, topic, ',')) {
+            if (!topic.empty()) hedgeTopics.push_back(topic);
+        }
+        hedgeEnabled = !hedgeTopics.empty();
+        routes = parseTopicRoutes(routeSpec);
+        for (size_t r = 0; r < routes.size(); ++r) {
+            hedgeEnabled = hedgeEnabled || routes[r].hedge;
+            topicRoutes.add(routes[r].pattern, static_cast<int>(r));
+            routeBreaker.push_back(&breakers[routes[r].breaker]);
+        }
+        buildSinks(envString("SINKS", ""), brokerAddress);
+        std::string receiver = envString("RECEIVER_SINK", "");
+        if (!receiver.empty()) {
+            receiverSink = std::make_unique<Sink>(
+                "receiver", makeTransport(receiver, brokerAddress, "middleware1_receiver"), SinkFilter::All,
+                static_cast<size_t>(envDouble("RECEIVER_SINK_BATCH", 64)), 100000);
+            std::cout << "[Middleware1] Forwarding to " << receiverSink->destination()
+                      << " instead of " << RECEIVER_TOPIC << std::endl;
+        }
+    }
+
+    ~MQTTMiddleware() {
+        if (hedgeConnector.joinable()) hedgeConnector.join();
+    }
+
+    void start() {
+        StartupTimer& startup = StartupTimer::instance();
+        startup.mark("init");
+        BrokerConnector("Middleware1", {{&client, "middleware1"}}).connect();
+        startup.mark("connect");
+
+        // Destinos já conectam sob demanda na própria thread, na primeira mensagem
+        for (auto& sink : sinks) sink->start();
+        if (receiverSink) receiverSink->start();
+
+        // Ativa o consumo de mensagens
+        client.start_consuming();
+
+        // Todos os SUBSCRIBEs saem antes de esperar pelos SUBACKs
+        std::vector<mqtt::token_ptr> subscriptions;
+        for (const auto& r : routes) subscriptions.push_back(client.subscribe(r.pattern, 1)); // Recebe mensagens do sender
+        for (size_t i = 0; i < routes.size(); ++i) {
+            subscriptions[i]->wait();
+            std::cout << "[Middleware1] Subscribed to '" << routes[i].pattern << "' (breaker '" << routes[i].breaker
+                      << "')" << std::endl;
+        }
+        startup.mark("subscribe");
+        startup.ready();
+
+        // A conexão de hedge não é crítica: sobe em segundo plano e, até lá,
+        // os publishes hedged seguem só pela conexão primária
+        if (hedgeEnabled) {
+            hedgeConnector = std::thread([this] {
+                try {
+                    BrokerConnector("Middleware1", {{&hedge_client, "middleware1_hedge"}}).connect();
+                    std::cout << "[Middleware1] Hedged publishes enabled for "
+                              << hedgeTopics.size() << " topic(s) and "
+                              << std::count_if(routes.begin(), routes.end(), [](const TopicRoute& r) { return r.hedge; })
+                              << " route(s)" << std::endl;
+                } catch (const std::exception& e) {
+                    std::cerr << "[Middleware1] Hedged publishes disabled: " << e.what() << std::endl;
+                }
+            });
+        }
+
+        while (true) {
+            // Espera limitada em vez de sleep fixo: o backlog drena na taxa de
+            // chegada e a manutenção ainda roda com a entrada parada
+            mqtt::const_message_ptr msg;
+            client.try_consume_message_for(&msg, std::chrono::milliseconds(100));
+
+            if (msg) {
+                // Novo log para depuração
+                std::cout << "[Middleware1] Mensagem recebida no tópico '" << msg->get_topic() << "': "
+                          << msg->to_string() << std::endl;
+                // descartada ou enfileirada ainda não conta como partida concluída
+                if (handleMessage(msg->get_topic(), msg->to_string())) startup.firstMessage();
+            }
+            housekeeping();
+        }
+    }
+
+    // Soak: reproduz tráfego por horas sem broker, em ciclos de fases
+    //   normal (60%) -> queda do receiver (15%) -> sobrecarga (15%) -> recuperação (10%)
+    // e amostra RSS, estatísticas do alocador, profundidade das filas e p99 de
+    // entrega. Ao fim de cada ciclo guarda uma linha de base; depois do ciclo
+    // de aquecimento, tendências de alta entre ciclos são sinalizadas.
+    // Retorna false se alguma foi (veredito FLAGGED).
+    bool soak(long seconds) {
+        const double rate = envDouble("SOAK_RATE", 50);
+        const double overloadFactor = envDouble("SOAK_OVERLOAD_FACTOR", 4);
+        const double cycleSeconds = envDouble("SOAK_CYCLE_SECONDS", 600);
+        const auto sampleInterval = std::chrono::duration<double>(envDouble("SOAK_SAMPLE_SECONDS", 10));
+        const std::string topic = routes.front().pattern.find_first_of("+#") == std::string::npos
+                                      ? routes.front().pattern : "iot/input";
+        std::vector<std::string> replay = soak::loadReplay("Middleware1", envString("SOAK_REPLAY", ""));
+        std::ofstream csv(envString("SOAK_CSV", "/tmp/middleware1-soak.csv"), std::ios::trunc);
+        csv << "elapsed_s,cycle,phase,rss_mb,heap_arena_mb,heap_inuse_mb,heap_free_mb,heap_mmap_mb,"
+               "fragmentation,retry_queue,receiver_backlog,sink_backlog,delivered,p99_us\n";
+
+        LatencyTracker deliveryLatency(4096);
+        auto transport = std::make_unique<SoakTransport>(deliveryLatency);
+        SoakTransport* receiver = transport.get();
+        receiverSink = std::make_unique<Sink>("receiver", std::move(transport), SinkFilter::All,
+                                              static_cast<size_t>(envDouble("RECEIVER_SINK_BATCH", 64)), 100000);
+        for (auto& sink : sinks) sink->start();
+        receiverSink->start();
+        verbose = false;
+        std::cout << "[Middleware1][soak] " << seconds << "s at " << rate << " msg/s, cycle " << cycleSeconds
+                  << "s, overload x" << overloadFactor << ", "
+                  << (replay.empty() ? std::string("synthetic readings") : std::to_string(replay.size()) + " replayed payloads")
+                  << std::endl;
+
+        std::vector<SoakBaseline> baselines;
+        SoakBaseline current;
+        auto started = std::chrono::steady_clock::now();
+        auto nextSample = started;
+        auto phaseStarted = started;
+        int phase = -1;
+        long cycle = 0;
+        double phaseSent = 0;
+        uint64_t seq = 0;
+        std::string payload;
+
+        while (true) {
+            auto now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - started).count();
+            long nowCycle = static_cast<long>(elapsed / cycleSeconds);
+            double position = elapsed / cycleSeconds - nowCycle;
+            int nowPhase = soak::phaseAt(position);
+
+            if (nowCycle != cycle) {
+                // linha de base do ciclo: memória e filas depois da recuperação
+                HeapStats heap = HeapStats::sample();
+                current.rssMb = heap.rssMb;
+                current.heapInUseMb = heap.inUseMb;
+                current.fragmentation = heap.fragmentation();
+                current.queueDepth = static_cast<double>(messageQueue.size() + receiverSink->depth());
+                baselines.push_back(current);
+                std::cout << "[Middleware1][soak] cycle " << cycle << " baseline: rss=" << current.rssMb
+                          << "MB heap_inuse=" << current.heapInUseMb << "MB frag=" << current.fragmentation
+                          << " queued=" << current.queueDepth << " normal_p99=" << current.p99Micros << "us"
+                          << std::endl;
+                current = SoakBaseline();
+                cycle = nowCycle;
+            }
+            if (elapsed >= seconds) break;
+            if (nowPhase != phase) {
+                if (phase == soak::NORMAL) current.p99Micros = static_cast<double>(deliveryLatency.p99Micros());
+                phase = nowPhase;
+                if (phase == soak::NORMAL) deliveryLatency.reset();
+                phaseStarted = now;
+                phaseSent = 0;
+                receiver->setDown(phase == soak::OUTAGE);
+                std::cout << "[Middleware1][soak] cycle " << cycle << " phase " << soak::phaseName(phase) << std::endl;
+            }
+
+            // Taxa constante dentro da fase, em rajadas de até 1 ms
+            double phaseRate = phase == soak::OVERLOAD ? rate * overloadFactor : rate;
+            double due = std::chrono::duration<double>(now - phaseStarted).count() * phaseRate;
+            while (phaseSent < due) {
+                ++seq;
+                if (replay.empty()) {
+                    payload = soak::syntheticReading(seq);
+                } else {
+                    payload = soak::stamp(replay[seq % replay.size()]);
+                }
+                handleMessage(topic, payload);
+                phaseSent += 1;
+            }
+            housekeeping();
+
+            if (now >= nextSample) {
+                nextSample += std::chrono::duration_cast<std::chrono::steady_clock::duration>(sampleInterval);
+                HeapStats heap = HeapStats::sample();
+                size_t sinkBacklog = 0;
+                for (auto& sink : sinks) sinkBacklog += sink->depth();
+                csv << static_cast<long>(elapsed) << "," << cycle << "," << soak::phaseName(phase) << "," << heap.rssMb
+                    << "," << heap.arenaMb << "," << heap.inUseMb << "," << heap.freeMb << "," << heap.mmapMb << ","
+                    << heap.fragmentation() << "," << messageQueue.size() << "," << receiverSink->depth() << ","
+                    << sinkBacklog << "," << receiverSink->delivered() << "," << deliveryLatency.p99Micros()
+                    << std::endl;
+                std::cout << "[Middleware1][soak] t=" << static_cast<long>(elapsed) << "s " << soak::phaseName(phase)
+                          << " rss=" << heap.rssMb << "MB heap_inuse=" << heap.inUseMb << "MB heap_free="
+                          << heap.freeMb << "MB frag=" << heap.fragmentation() << " retry_queue="
+                          << messageQueue.size() << " receiver_backlog=" << receiverSink->depth()
+                          << " sink_backlog=" << sinkBacklog << " p99=" << deliveryLatency.p99Micros() << "us"
+                          << std::endl;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        receiver->setDown(false);
+
+        bool flagged = soak::reportTrends("Middleware1", baselines);
+        std::cout << "[Middleware1][soak] " << (flagged ? "FLAGGED" : "PASS") << " after " << baselines.size()
+                  << " cycle(s), " << seq << " messages, " << receiverSink->delivered() << " delivered" << std::endl;
+        return !flagged;
+    }
+
+private:
+    // true se a mensagem foi encaminhada ao receiver agora
+    bool handleMessage(const std::string& topic, const std::string& payload) {
+        if (memoryBudget.pressure() == MemoryPressure::Hard) {
+            // no teto de memória a entrada é descartada: a fila do Paho segue drenada
+            ingestMemory.recordShed();
+            return false;
+        }
+        std::string_view deviceId;
+        if (extractDeviceId(payload, deviceId)) deviceSketch.observe(deviceId, hashDeviceId(deviceId));
+        int r = topicRoutes.match(topic);
+        CircuitBreaker& cb = r != TopicTrie::NO_ROUTE ? *routeBreaker[r] : breakers["default"];
+        bool hedge = (r != TopicTrie::NO_ROUTE && routes[r].hedge) || isLatencyCritical(topic);
+        bool forwarded = processMessage(payload, cb, hedge);
+        fanOut(payload);
+        return forwarded;
+    }
+
+    // Tarefas periódicas da thread principal; cada uma controla o próprio intervalo
+    void housekeeping() {
+        publishSummary();
+        refreshMemory();
+
+        retryFailedMessages();
+        reportHedgeStats();
+        reportDeviceStats();
+        reportSinkStats();
+        reportMemory();
+    }
+
+    // SINKS="nome=destino:filtro[:janela[:backlog]],..." com filtro all | alerts | summary;
+    // destino é um tópico MQTT, "uds:/caminho", "file:/caminho" ou "null"
+    void buildSinks(const std::string& spec, const std::string& brokerAddress) {
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            auto eq = item.find('=');
+            if (eq == std::string::npos) continue;
+            std::vector<std::string> parts;
+            std::stringstream fields(item.substr(eq + 1));
+            std::string field;
+            while (std::getline(fields, field, ':')) parts.push_back(field);
+            if (parts.size() > 1 && (parts[0] == "uds" || parts[0] == "file")) {
+                parts[0] += ":" + parts[1];
+                parts.erase(parts.begin() + 1);
+            }
+            if (parts.empty() || parts[0].empty()) continue;
+            SinkFilter filter = parseSinkFilter(parts.size() > 1 ? parts[1] : "all");
+            size_t window = parts.size() > 2 ? static_cast<size_t>(std::atol(parts[2].c_str())) : 32;
+            size_t backlog = parts.size() > 3 ? static_cast<size_t>(std::atol(parts[3].c_str())) : 10000;
+            std::string name = item.substr(0, eq);
+            sinks.push_back(std::make_unique<Sink>(
+                name, makeTransport(parts[0], brokerAddress, "middleware1_sink_" + name), filter, window, backlog));
+            sinksNeedFields = sinksNeedFields || filter != SinkFilter::All;
+            std::cout << "[Middleware1] Fan-out sink '" << name << "' -> " << parts[0]
+                      << " (window " << window << ", backlog " << backlog << ")" << std::endl;
+        }
+    }
+
+    // Entrega a cada destino o que lhe cabe; o parse só acontece se algum filtrar
+    void fanOut(const std::string& payload) {
+        if (sinks.empty()) return;
+        json reading;
+        bool parsed = false;
+        if (sinksNeedFields) {
+            reading = json::parse(payload, nullptr, false);
+            parsed = !reading.is_discarded() && reading.is_object();
+        }
+        bool alert = false;
+        if (parsed) {
+            auto status = reading.find("status");
+            alert = status != reading.end() && status->is_string() && *status != "normal";
+            summary.add(reading);
+        }
+        for (auto& sink : sinks) {
+            if (sink->filter() == SinkFilter::All || (sink->filter() == SinkFilter::Alerts && alert)) {
+                sink->offer(payload);
+            }
+        }
+    }
+
+    void publishSummary() {
+        if (!summary.due(summaryInterval)) return;
+        std::string payload = summary.take();
+        for (auto& sink : sinks) {
+            if (sink->filter() == SinkFilter::Summary) sink->offer(payload);
+        }
+    }
+
+    void refreshMemory() {
+        static auto lastRefresh = std::chrono::steady_clock::time_point();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastRefresh < std::chrono::milliseconds(100)) return;
+        lastRefresh = now;
+        memoryBudget.refresh();
+    }
+
+    void reportMemory() {
+        static auto lastReport = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(10)) return;
+        lastReport = now;
+        std::cout << "[Middleware1] Memory: " << memoryBudget.report() << std::endl;
+    }
+
+    void reportSinkStats() {
+        if (sinks.empty() && !receiverSink) return;
+        static auto lastReport = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(10)) return;
+        lastReport = now;
+        for (auto& sink : sinks) std::cout << "[Middleware1] " << sink->report() << std::endl;
+        if (receiverSink) std::cout << "[Middleware1] " << receiverSink->report() << std::endl;
+    }
+
+    bool isLatencyCritical(const std::string& topic) const {
+        return std::find(hedgeTopics.begin(), hedgeTopics.end(), topic) != hedgeTopics.end();
+    }
+
+    bool processMessage(const std::string& payload, CircuitBreaker& cb, bool hedge = false) {
+        try {
+            if (cb.allowRequest()) {
+                if (forwardToReceiverTopic(payload, hedge)) {
+                    cb.recordSuccess();
+                    retryBudget.recordSuccess();
+                    return true;
+                } else {
+                    cb.recordFailure();
+                    messageQueue.push(payload);
+                }
+            } else {
+                messageQueue.push(payload);
+                if (verbose) std::cout << "Circuit open - message queued" << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            messageQueue.push(payload);
+        }
+        return false;
+    }
+
+    bool forwardToReceiverTopic(const std::string& payload, bool hedge = false) {
+        if (receiverSink) {
+            // destino fora do ar: a mensagem vai para a fila de retentativas (com spill)
+            if (receiverSink->isCircuitOpen()) return false;
+            receiverSink->offer(payload);
+            ++forwarded;
+            return true;
+        }
+
+        // Publica a mensagem processada no tópico do receiver
+        mqtt::message_ptr pubmsg = mqtt::make_message(RECEIVER_TOPIC, payload);
+        pubmsg->set_qos(1);
+
+        if (!hedge || ackLatency.p95Micros() < 0 || !hedge_client.is_connected()) {
+            auto started = std::chrono::steady_clock::now();
+            client.publish(pubmsg)->wait();
+            ackLatency.record(std::chrono::steady_clock::now() - started);
+            forwardLatency.record(std::chrono::steady_clock::now() - started);
+            ++forwarded;
+            return true;
+        }
+
+        // Publish hedged: se o PUBACK não chegar dentro do p95 medido, publica a
+        // mesma mensagem pela conexão alternativa; o receiver deduplica por 'seq'
+        auto race = std::make_shared<AckRace>();
+        race->primaryAckLatency = &ackLatency;
+        pendingRaces.push_back(race);
+
+        race->launch();
+        client.publish(pubmsg, nullptr, race->legs[0]);
+        if (!race->waitFor(std::chrono::microseconds(ackLatency.p95Micros()))) {
+            race->launch();
+            hedge_client.publish(pubmsg, nullptr, race->legs[1]);
+            ++hedgesIssued;
+        }
+
+        int winner = race->waitFirst();
+        forwardLatency.record(std::chrono::steady_clock::now() - race->started);
+        while (!pendingRaces.empty() && pendingRaces.front()->finished()) {
+            pendingRaces.pop_front();
+        }
+        if (winner < 0) {
+            throw std::runtime_error("Hedged publish failed on all connections");
+        }
+        if (winner == 1) ++hedgeWins;
+        ++forwarded;
+        return true;
+    }
+
+    void reportHedgeStats() {
+        if (!hedgeEnabled) return;
+        static auto lastReport = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(10)) return;
+        lastReport = now;
+
+        double extraLoad = forwarded ? 100.0 * hedgesIssued / forwarded : 0.0;
+        std::cout << "[Middleware1] Hedge stats: ack_p95=" << ackLatency.p95Micros() << "us"
+                  << " forward_p99=" << forwardLatency.p99Micros() << "us"
+                  << " forwarded=" << forwarded
+                  << " hedged=" << hedgesIssued << " (" << extraLoad << "% extra load)"
+                  << " hedge_wins=" << hedgeWins << std::endl;
+    }
+
+    void reportDeviceStats() {
+        static auto lastReport = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(10)) return;
+        lastReport = now;
+        std::cout << "[Middleware1] Device stats: " << deviceSketch.report(5) << std::endl;
+    }
+
+    void retryFailedMessages() {
+        static auto lastRetry = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        
+        if (now - lastRetry < std::chrono::seconds(5)) return;
+        lastRetry = now;
+        
+        if (messageQueue.empty()) return;
+        
+        std::cout << "Retrying " << messageQueue.size() << " queued messages"
+                  << " (budget: " << retryBudget.available() << ")" << std::endl;
+        
+        while (!messageQueue.empty()) {
+            if (!retryBudget.tryAcquire()) {
+                std::cout << "Retry budget exhausted - " << messageQueue.size()
+                          << " messages deferred" << std::endl;
+                break;
+            }
+            auto msg = messageQueue.front();
+            if (forwardToReceiverTopic(msg)) {
+                messageQueue.pop();
+            } else {
+                break;
+            }
+        }
+    }
+};
+
+int main() {
+    StartupTimer::instance("Middleware1");
+
+    // Retentativas limitadas a uma fração da vazão recente de sucessos
+    static RetryBudget retryBudget(
+        envDouble("RETRY_BUDGET_RATIO", 0.2),
+        envDouble("RETRY_BUDGET_MIN_PER_SEC", 1.0),
+        envDouble("RETRY_BUDGET_MAX_TOKENS", 100.0));
+
+    long sinkBenchMessages = static_cast<long>(envDouble("SINK_BENCH_MESSAGES", 0));
+    if (sinkBenchMessages > 0) {
+        runSinkBench(sinkBenchMessages);
+    }
+
+    // Hedging desativado por padrão; HEDGE_BROKER permite um broker alternativo
+    MQTTMiddleware middleware("tcp://mosquitto:1883", retryBudget,
+                              envString("HEDGE_BROKER", "tcp://mosquitto:1883"),
+                              envString("HEDGE_TOPICS", ""),
+                              envString("TOPIC_ROUTES", "iot/input"));
+
+    // SOAK_SECONDS > 0: execução longa sem broker no lugar do serviço;
+    // o código de saída reflete o veredito (2 = tendência sinalizada)
+    long soakSeconds = static_cast<long>(envDouble("SOAK_SECONDS", 0));
+    if (soakSeconds > 0) {
+        return middleware.soak(soakSeconds) ? 0 : 2;
+    }
+    try {
+        middleware.start();
+    } catch (const std::exception& e) {
+        std::cerr << "[Middleware1] Startup failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
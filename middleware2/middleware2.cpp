@@ -1,139 +1,1527 @@
-// middleware3.cpp  (pipeline supervisionado - conectividade igual ao middleware1)
-#include <iostream>
-#include <vector>
-#include <functional>
-#include <memory>
-#include <string>
-#include <chrono>
-#include <ctime>
-#include <mqtt/async_client.h>
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
-
-class PipelineStage {
-public:
-    virtual ~PipelineStage() = default;
-    virtual std::string process(const std::string& input) = 0;
-    virtual bool isHealthy() const { return true; }
-};
-
-class ValidationStage : public PipelineStage {
-public:
-    std::string process(const std::string& input) override {
-        auto j = json::parse(input);
-        if (!j.contains("device_id") || !j.contains("temperature")) {
-            throw std::runtime_error("Invalid message format");
-        }
-        return input;
-    }
-};
-
-class TransformationStage : public PipelineStage {
-private:
-    bool simulatedFailure = false;
-public:
-    std::string process(const std::string& input) override {
-        if (simulatedFailure) {
-            throw std::runtime_error("Simulated transformation failure");
-        }
-        auto j = json::parse(input);
-        j["processed"] = true;
-        j["server_timestamp"] = static_cast<long>(std::time(nullptr));
-        return j.dump();
-    }
-
-    bool isHealthy() const override {
-        static int counter = 0;
-        if (++counter % 5 == 0) {
-            return false;
-        }
-        return true;
-    }
-};
-
-class Supervisor {
-public:
-    std::unique_ptr<PipelineStage> restartStage(std::unique_ptr<PipelineStage> stage) {
-        std::cout << "[Middleware3] Restarting failed stage..." << std::endl;
-        // neste protótipo, apenas registra e retorna o mesmo estágio
-        return std::move(stage);
-    }
-};
-
-class MQTTMiddleware {
-private:
-    mqtt::async_client client;        // consumidor
-    mqtt::async_client sender_client; // publicador
-    std::vector<std::unique_ptr<PipelineStage>> pipeline;
-    Supervisor supervisor;
-
-    const std::string INPUT_TOPIC    = "iot/input";
-    const std::string RECEIVER_TOPIC = "iot/data";
-
-public:
-    MQTTMiddleware(const std::string& brokerAddress)
-        : client(brokerAddress, "middleware3"),
-          sender_client(brokerAddress, "middleware3_sender")
-    {
-        pipeline.push_back(std::make_unique<ValidationStage>());
-        pipeline.push_back(std::make_unique<TransformationStage>());
-    }
-
-    void start() {
-        client.connect()->wait();
-        sender_client.connect()->wait();
-
-        // Alinha com middleware1: consumir por fila interna
-        client.start_consuming();
-
-        client.subscribe(INPUT_TOPIC, 1)->wait();
-        std::cout << "[Middleware3] Subscribed to topic: " << INPUT_TOPIC << std::endl;
-
-        while (true) {
-            auto msg = client.consume_message();
-            if (msg) {
-                std::cout << "[Middleware3] Message received on topic '"
-                          << msg->get_topic() << "': " << msg->to_string() << std::endl;
-                processMessage(msg->to_string());
-            }
-            checkPipelineHealth();
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    }
-
-private:
-    void processMessage(const std::string& payload) {
-        try {
-            std::string processed = payload;
-            for (auto& stage : pipeline) {
-                processed = stage->process(processed);
-            }
-
-            // Publish em iot/data com QoS 1 e wait() (igual ao middleware1)
-            mqtt::message_ptr pubmsg = mqtt::make_message(RECEIVER_TOPIC, processed);
-            pubmsg->set_qos(1);
-            sender_client.publish(pubmsg)->wait();
-
-            std::cout << "[Middleware3] Forwarded processed message to receiver" << std::endl;
-        }
-        catch (const std::exception& e) {
-            std::cerr << "[Middleware3] Pipeline error: " << e.what() << std::endl;
-        }
-    }
-
-    void checkPipelineHealth() {
-        for (auto& stage : pipeline) {
-            if (!stage->isHealthy()) {
-                std::cout << "[Middleware3] Stage failed, restarting..." << std::endl;
-                stage = supervisor.restartStage(std::move(stage));
-            }
-        }
-    }
-};
-
-int main() {
-    MQTTMiddleware middleware("tcp://mosquitto:1883");
-    middleware.start();
-    return 0;
-}
+// middleware3.cpp  (pipeline supervisionado - conectividade igual ao middleware1)
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cctype>
+#include <cmath>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include <nlohmann/json.hpp>
+#include "device_sketch.h"
+#include "topic_trie.h"
+#include "deadline.h"
+#include "startup.h"
+
+using json = nlohmann::json;
+
+class PipelineStage {
+private:
+    std::chrono::microseconds maxDuration = Deadline::NO_BUDGET;
+
+public:
+    virtual ~PipelineStage() = default;
+    virtual const char* name() const = 0;
+    virtual std::string process(const std::string& input) = 0;
+    // Estágios que verificam o prazo cooperativamente sobrescrevem esta variante
+    virtual std::string process(const std::string& input, const Deadline& deadline) {
+        (void)deadline;
+        return process(input);
+    }
+    virtual bool isHealthy() const { return true; }
+
+    // Tempo máximo configurado para uma chamada de process()
+    std::chrono::microseconds budget() const { return maxDuration; }
+    void setBudget(std::chrono::microseconds limit) { maxDuration = limit; }
+};
+
+class ValidationStage : public PipelineStage {
+public:
+    const char* name() const override { return "validation"; }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        auto j = json::parse(input);
+        deadline.check(name());
+        if (!j.contains("device_id") || !j.contains("temperature")) {
+            throw std::runtime_error("Invalid message format");
+        }
+        return input;
+    }
+};
+
+class TransformationStage : public PipelineStage {
+private:
+    bool simulatedFailure = false;
+public:
+    const char* name() const override { return "transformation"; }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        if (simulatedFailure) {
+            throw std::runtime_error("Simulated transformation failure");
+        }
+        auto j = json::parse(input);
+        deadline.check(name());
+        j["processed"] = true;
+        j["server_timestamp"] = static_cast<long>(std::time(nullptr));
+        return j.dump();
+    }
+
+    bool isHealthy() const override {
+        static int counter = 0;
+        if (++counter % 5 == 0) {
+            return false;
+        }
+        return true;
+    }
+};
+
+class Supervisor {
+public:
+    std::unique_ptr<PipelineStage> restartStage(std::unique_ptr<PipelineStage> stage) {
+        std::cout << "[Middleware3] Restarting failed stage..." << std::endl;
+        // neste protótipo, apenas registra e retorna o mesmo estágio
+        return std::move(stage);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Replicação Raft (REPLICATION_MODE=raft): processos no mesmo host replicam o
+// log ordenado de mensagens aceitas via UDS (ou TCP local). Apenas o líder
+// consome iot/input e apenas entradas commitadas são encaminhadas ao receiver.
+// Termo, voto e log persistidos com fsync antes de qualquer confirmação, de
+// modo que um nó reiniciado não esquece entradas que já reconheceu.
+// O líder grava no próprio log marcas de encaminhamento ("até o índice N já
+// saiu para o receiver"); um novo líder reencaminha tudo acima da última
+// marca. A janela entre o publish e a marca pode sair duplicada (o receiver
+// deduplica por 'seq'), mas nada commitado deixa de ser encaminhado.
+// ---------------------------------------------------------------------------
+
+static std::string envString(const char* name, const std::string& fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::string(v) : fallback;
+}
+
+static long envLong(const char* name, long fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::atol(v) : fallback;
+}
+
+struct RaftEntry {
+    uint64_t term;
+    std::string payload;
+};
+
+class RaftNode {
+public:
+    enum class Role { Follower, Candidate, Leader };
+    // index, payload, true se este nó é o líder no momento do apply
+    using ApplyFn = std::function<void(uint64_t, const std::string&, bool)>;
+
+    RaftNode(int nodeId, std::vector<std::string> nodeAddresses,
+             const std::string& stateDir, ApplyFn onApply)
+        : id(nodeId), addresses(std::move(nodeAddresses)),
+          statePath(stateDir + "/raft-" + std::to_string(nodeId) + ".state"),
+          logPath(stateDir + "/raft-" + std::to_string(nodeId) + ".log"),
+          apply(std::move(onApply)), rng(std::random_device{}() + nodeId)
+    {
+        peers.resize(addresses.size());
+        loadState();
+        loadLog();
+    }
+
+    ~RaftNode() {
+        running = false;
+        if (loop.joinable()) loop.join();
+        if (logFd >= 0) close(logFd);
+    }
+
+    void start() {
+        listenFd = listenOn(addresses[id]);
+        if (pipe(wakeFds) != 0) throw std::runtime_error("raft: pipe failed");
+        fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+        resetElectionTimer();
+        loop = std::thread([this] { run(); });
+    }
+
+    bool isLeader() const { return role.load() == Role::Leader; }
+
+    // Enfileira uma mensagem para replicação; false se este nó não é líder
+    bool propose(const std::string& payload) {
+        if (!isLeader()) return false;
+        {
+            std::lock_guard<std::mutex> lock(proposalMtx);
+            proposals.push_back({payload, std::chrono::steady_clock::now()});
+            proposalBytes += payload.size();
+        }
+        char b = 1;
+        (void)!write(wakeFds[1], &b, 1);
+        return true;
+    }
+
+    // Informa que a entrada 'index' (e as anteriores) já foi encaminhada; o
+    // líder registra o progresso no log a cada FORWARD_MARK_INTERVAL
+    void markForwarded(uint64_t index) {
+        uint64_t prev = forwardedLocal.load();
+        while (prev < index && !forwardedLocal.compare_exchange_weak(prev, index)) {}
+    }
+
+    // Propostas que não chegaram a ser commitadas por este nó: recusadas após a
+    // perda da liderança ou descartadas do log por conflito com o novo líder
+    std::deque<std::string> takeOrphaned() {
+        std::lock_guard<std::mutex> lock(proposalMtx);
+        std::deque<std::string> out;
+        out.swap(orphaned);
+        return out;
+    }
+
+    // Há um líder (outro nó) ativo há pelo menos 'settled'; usado para saber
+    // quando ele já teve tempo de assinar as rotas
+    bool hasSettledLeader(std::chrono::milliseconds settled) const {
+        int64_t since = leaderSince.load();
+        int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+        return role.load() == Role::Follower && since != 0 &&
+               now - since >= std::chrono::steady_clock::duration(settled).count() &&
+               now - leaderContact.load() < std::chrono::steady_clock::duration(2 * HEARTBEAT).count();
+    }
+
+    // Propostas pendentes e log em memória passaram de RAFT_MAX_MB: o
+    // middleware para de consumir até o commit e a compactação liberarem espaço
+    bool saturated() const { return proposalBytes.load() + logBytes.load() >= maxBytes; }
+
+    // Máximo de entradas por AppendEntries
+    void setMaxBatch(size_t n) { maxBatch = std::max<size_t>(1, n); }
+
+    size_t pendingProposals() {
+        std::lock_guard<std::mutex> lock(proposalMtx);
+        return proposals.size() + uncommitted.load();
+    }
+
+    uint64_t committedCount() const { return committed.load(); }
+
+    // Latências de commit (µs) das entradas propostas neste nó desde a última chamada
+    std::vector<int64_t> takeCommitLatencies() {
+        std::lock_guard<std::mutex> lock(statsMtx);
+        std::vector<int64_t> out;
+        out.swap(commitLatencies);
+        return out;
+    }
+
+    // Duração (µs) de cada write + fdatasync do log desde a última chamada
+    std::vector<int64_t> takeSyncLatencies() {
+        std::lock_guard<std::mutex> lock(statsMtx);
+        std::vector<int64_t> out;
+        out.swap(syncLatencies);
+        return out;
+    }
+
+private:
+    struct Peer {
+        int fd = -1;
+        uint64_t nextIndex = 1;
+        uint64_t matchIndex = 0;
+        bool inflight = false;
+        std::chrono::steady_clock::time_point lastSent{};
+        std::chrono::steady_clock::time_point lastConnect{};
+    };
+    struct Inbound {
+        int fd;
+        std::string buffer;
+    };
+    struct Proposal {
+        std::string payload;
+        std::chrono::steady_clock::time_point at;
+    };
+
+    const int id;
+    const std::vector<std::string> addresses;
+    const std::string statePath;
+    const std::string logPath;
+    ApplyFn apply;
+    std::mt19937 rng;
+
+    std::atomic<Role> role{Role::Follower};
+    std::atomic<bool> running{true};
+    std::atomic<size_t> maxBatch{64};
+    std::atomic<uint64_t> committed{0};
+    std::atomic<size_t> uncommitted{0};
+    std::atomic<uint64_t> forwardedLocal{0};  // informado pelo middleware
+    std::atomic<size_t> proposalBytes{0};
+    std::atomic<size_t> logBytes{0};          // escrito só pela thread do loop
+    std::atomic<int64_t> leaderSince{0};      // steady_clock; 0: sem líder conhecido
+    std::atomic<int64_t> leaderContact{0};    // último AppendEntries do líder
+    std::thread loop;
+
+    int listenFd = -1;
+    int wakeFds[2] = {-1, -1};
+    std::vector<Peer> peers;
+    std::vector<Inbound> inbound;
+
+    // Estado Raft (acessado apenas pela thread do loop)
+    uint64_t currentTerm = 0;
+    int votedFor = -1;
+    int votes = 0;
+    std::deque<RaftEntry> log;   // índices (base, base + log.size()]
+    uint64_t base = 0;           // último índice compactado
+    uint64_t baseTerm = 0;
+    uint64_t commitIndex = 0;
+    uint64_t lastApplied = 0;
+    uint64_t forwarded = 0;      // maior índice sabidamente encaminhado (marcas no log)
+    std::chrono::steady_clock::time_point lastMark{};
+    std::set<uint64_t> ledTerms; // termos em que este nó foi líder desde o início
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> proposedAt;
+    std::chrono::steady_clock::time_point electionDeadline;
+
+    std::mutex proposalMtx;
+    std::deque<Proposal> proposals;
+    std::deque<std::string> orphaned;
+    std::mutex statsMtx;
+    std::vector<int64_t> commitLatencies;
+    std::vector<int64_t> syncLatencies;
+
+    int logFd = -1;
+    std::string unsynced;  // registros acrescentados ainda não gravados
+
+    const std::chrono::milliseconds HEARTBEAT = std::chrono::milliseconds(50);
+    const size_t MAX_LOG = 100000;
+    const size_t maxBytes = static_cast<size_t>(std::max(1L, envLong("RAFT_MAX_MB", 256))) * 1024 * 1024;
+    const std::chrono::milliseconds FORWARD_MARK_INTERVAL = std::chrono::milliseconds(100);
+
+    // --- log ---------------------------------------------------------------
+    uint64_t lastIndex() const { return base + log.size(); }
+    uint64_t termAt(uint64_t index) const {
+        if (index <= base) return baseTerm;
+        return log[index - base - 1].term;
+    }
+    size_t majority() const { return addresses.size() / 2 + 1; }
+
+    // Entradas especiais: payload vazio é o no-op de início de mandato e
+    // '\0' + índice é uma marca de encaminhamento. Uma marca vale assim que
+    // entra no log, commitada ou não: quem a gravou já tinha encaminhado
+    // entradas commitadas até aquele índice, e o log deste nó coincide com o
+    // do autor até a marca.
+    static std::string forwardMark(uint64_t index) { return std::string(1, '\0') + std::to_string(index); }
+    static bool isForwardMark(const std::string& payload) { return !payload.empty() && payload[0] == '\0'; }
+
+    void noteEntry(const std::string& payload) {
+        if (isForwardMark(payload)) {
+            forwarded = std::max<uint64_t>(forwarded, std::strtoull(payload.c_str() + 1, nullptr, 10));
+        }
+    }
+
+    // Mudanças do log em memória passam por aqui para manter logBytes
+    void pushEntry(RaftEntry entry) {
+        logBytes += entry.payload.size() + sizeof(RaftEntry);
+        log.push_back(std::move(entry));
+    }
+    // Descarta o sufixo a partir de 'index'
+    void dropFrom(uint64_t index) {
+        for (uint64_t i = index; i <= lastIndex(); ++i) logBytes -= log[i - base - 1].payload.size() + sizeof(RaftEntry);
+        log.resize(index - base - 1);
+    }
+    // Descarta o prefixo até 'index' (inclusive); o chamador move a base
+    void dropThrough(uint64_t index) {
+        if (index >= lastIndex()) {
+            log.clear();
+            logBytes = 0;
+            return;
+        }
+        for (uint64_t i = base + 1; i <= index; ++i) logBytes -= log[i - base - 1].payload.size() + sizeof(RaftEntry);
+        log.erase(log.begin(), log.begin() + static_cast<long>(index - base));
+    }
+
+    // --- persistência ---------------------------------------------------------
+    // Falha de disco é fatal (fail-stop): seguir sem persistir quebraria a
+    // segurança. O supervisor do cluster recria o nó.
+    [[noreturn]] void diskFailure(const char* what) {
+        std::cerr << "[Middleware2][raft] Node " << id << " " << what << ": " << std::strerror(errno) << std::endl;
+        std::abort();
+    }
+
+    static bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Substitui o arquivo de forma atômica: temporário + fsync + rename
+    void replaceFile(const std::string& path, const std::string& contents) {
+        std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !writeAll(fd, contents.data(), contents.size()) || fsync(fd) != 0) {
+            diskFailure("cannot write state");
+        }
+        close(fd);
+        if (rename(tmp.c_str(), path.c_str()) != 0) diskFailure("cannot replace state");
+    }
+
+    void loadState() {
+        std::ifstream in(statePath);
+        if (in) in >> currentTerm >> votedFor;
+    }
+    void saveState() {
+        replaceFile(statePath, std::to_string(currentTerm) + " " + std::to_string(votedFor) + "\n");
+    }
+
+    // Log em arquivo só de acréscimo: registros [tipo][índice][termo][len][payload].
+    // 'E' é uma entrada (um índice já existente trunca o sufixo na releitura,
+    // como no conflito em memória) e 'B' marca a base compactada.
+    static constexpr size_t RECORD_HEADER = 1 + 8 + 8 + 4;
+
+    void appendRecord(char type, uint64_t index, uint64_t term, const std::string& payload) {
+        uint32_t len = static_cast<uint32_t>(payload.size());
+        unsynced.push_back(type);
+        unsynced.append(reinterpret_cast<const char*>(&index), sizeof(index));
+        unsynced.append(reinterpret_cast<const char*>(&term), sizeof(term));
+        unsynced.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        unsynced += payload;
+    }
+
+    // Grava e sincroniza os registros pendentes; chamado antes de o líder se
+    // contar na maioria e antes de o follower responder ao AppendEntries
+    void syncLog() {
+        if (unsynced.empty()) return;
+        auto started = std::chrono::steady_clock::now();
+        if (!writeAll(logFd, unsynced.data(), unsynced.size())) diskFailure("cannot append to log");
+        if (fdatasync(logFd) != 0) diskFailure("cannot sync log");
+        unsynced.clear();
+        std::lock_guard<std::mutex> lock(statsMtx);
+        syncLatencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count());
+    }
+
+    void loadLog() {
+        std::ifstream in(logPath, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t off = 0;
+        while (data.size() - off >= RECORD_HEADER) {
+            char type = data[off];
+            uint64_t index;
+            uint64_t term;
+            uint32_t len;
+            std::memcpy(&index, data.data() + off + 1, sizeof(index));
+            std::memcpy(&term, data.data() + off + 9, sizeof(term));
+            std::memcpy(&len, data.data() + off + 17, sizeof(len));
+            if (data.size() - off - RECORD_HEADER < len) break;  // cauda de uma gravação interrompida
+            if (type == 'B') {
+                if (index > base) {
+                    dropThrough(index);
+                    base = index;
+                    baseTerm = term;
+                }
+            } else if (type == 'E' && index > base) {
+                if (index > lastIndex() + 1) break;  // lacuna: registro inválido
+                if (index <= lastIndex()) dropFrom(index);
+                pushEntry({term, data.substr(off + RECORD_HEADER, len)});
+                noteEntry(log.back().payload);
+            } else if (type != 'E') {
+                break;
+            }
+            off += RECORD_HEADER + len;
+        }
+        // O commit volta a ser conhecido pelo líder; a compactação nunca passa
+        // do encaminhado, então tudo até a base já saiu para o receiver, e as
+        // entradas até a última marca lida não são reencaminhadas
+        commitIndex = lastApplied = base;
+        forwarded = std::max(forwarded, base);
+        logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (logFd < 0) diskFailure("cannot open log");
+        if (off < data.size() && ftruncate(logFd, static_cast<off_t>(off)) != 0) diskFailure("cannot trim log");
+        if (!log.empty() || base > 0) {
+            std::cout << "[Middleware2][raft] Node " << id << " recovered log up to index " << lastIndex()
+                      << " (base " << base << ", term " << currentTerm << ")" << std::endl;
+        }
+    }
+
+    // Depois da compactação o arquivo é reescrito só com a base e o sufixo vivo
+    void rewriteLog() {
+        syncLog();
+        appendRecord('B', base, baseTerm, "");
+        for (uint64_t i = base + 1; i <= lastIndex(); ++i) appendRecord('E', i, termAt(i), log[i - base - 1].payload);
+        replaceFile(logPath, unsynced);
+        unsynced.clear();
+        close(logFd);
+        logFd = open(logPath.c_str(), O_WRONLY | O_APPEND);
+        if (logFd < 0) diskFailure("cannot reopen log");
+    }
+
+    // --- sockets -------------------------------------------------------------
+    static bool isUnixAddress(const std::string& addr) { return !addr.empty() && addr[0] == '/'; }
+
+    static int listenOn(const std::string& addr) {
+        int fd;
+        if (isUnixAddress(addr)) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un sa{};
+            sa.sun_family = AF_UNIX;
+            std::strncpy(sa.sun_path, addr.c_str(), sizeof(sa.sun_path) - 1);
+            unlink(addr.c_str());
+            if (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0)
+                throw std::runtime_error("raft: bind failed on " + addr);
+        } else {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in sa = inetAddress(addr);
+            if (bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0)
+                throw std::runtime_error("raft: bind failed on " + addr);
+        }
+        listen(fd, 16);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        return fd;
+    }
+
+    static sockaddr_in inetAddress(const std::string& addr) {
+        sockaddr_in sa{};
+        auto colon = addr.rfind(':');
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(static_cast<uint16_t>(std::atoi(addr.c_str() + colon + 1)));
+        inet_pton(AF_INET, addr.substr(0, colon).c_str(), &sa.sin_addr);
+        return sa;
+    }
+
+    static int connectTo(const std::string& addr) {
+        int fd;
+        int rc;
+        if (isUnixAddress(addr)) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un sa{};
+            sa.sun_family = AF_UNIX;
+            std::strncpy(sa.sun_path, addr.c_str(), sizeof(sa.sun_path) - 1);
+            rc = connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+        } else {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            sockaddr_in sa = inetAddress(addr);
+            rc = connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+        }
+        if (rc != 0) {
+            close(fd);
+            return -1;
+        }
+        // Envio com timeout: um peer travado não bloqueia o loop
+        timeval tv{0, 50000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        return fd;
+    }
+
+    void send(int to, const json& msg) {
+        Peer& p = peers[to];
+        auto now = std::chrono::steady_clock::now();
+        if (p.fd < 0) {
+            if (now - p.lastConnect < HEARTBEAT) return;
+            p.lastConnect = now;
+            p.fd = connectTo(addresses[to]);
+            if (p.fd < 0) return;
+        }
+        std::string body = msg.dump();
+        uint32_t len = static_cast<uint32_t>(body.size());
+        std::string frame(reinterpret_cast<const char*>(&len), sizeof(len));
+        frame += body;
+        size_t off = 0;
+        while (off < frame.size()) {
+            ssize_t n = ::send(p.fd, frame.data() + off, frame.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                // frame parcial corromperia o stream: descarta a conexão
+                close(p.fd);
+                p.fd = -1;
+                p.inflight = false;
+                return;
+            }
+            off += static_cast<size_t>(n);
+        }
+    }
+
+    void broadcast(const json& msg) {
+        for (size_t i = 0; i < peers.size(); ++i) {
+            if (static_cast<int>(i) != id) send(static_cast<int>(i), msg);
+        }
+    }
+
+    // --- loop principal ------------------------------------------------------
+    void run() {
+        std::vector<pollfd> fds;
+        while (running) {
+            fds.clear();
+            fds.push_back({listenFd, POLLIN, 0});
+            fds.push_back({wakeFds[0], POLLIN, 0});
+            for (auto& c : inbound) fds.push_back({c.fd, POLLIN, 0});
+
+            poll(fds.data(), fds.size(), 5);
+
+            if (fds[0].revents & POLLIN) {
+                int fd;
+                while ((fd = accept(listenFd, nullptr, nullptr)) >= 0) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    inbound.push_back({fd, {}});
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                char drain[64];
+                while (read(wakeFds[0], drain, sizeof(drain)) > 0) {}
+            }
+            for (size_t i = 2; i < fds.size(); ++i) {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) readFrom(inbound[i - 2]);
+            }
+            inbound.erase(std::remove_if(inbound.begin(), inbound.end(),
+                                         [](const Inbound& c) { return c.fd < 0; }),
+                          inbound.end());
+
+            drainProposals();
+            tick();
+        }
+    }
+
+    void readFrom(Inbound& c) {
+        char buf[65536];
+        while (true) {
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n > 0) {
+                c.buffer.append(buf, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                close(c.fd);
+                c.fd = -1;
+            }
+            break;
+        }
+        size_t off = 0;
+        while (c.buffer.size() - off >= sizeof(uint32_t)) {
+            uint32_t len;
+            std::memcpy(&len, c.buffer.data() + off, sizeof(len));
+            if (c.buffer.size() - off - sizeof(len) < len) break;
+            json msg = json::parse(c.buffer.begin() + off + sizeof(len),
+                                   c.buffer.begin() + off + sizeof(len) + len, nullptr, false);
+            off += sizeof(len) + len;
+            // Frame inválido é descartado: uma exceção aqui derrubaria a thread do Raft
+            if (msg.is_discarded() || !msg.is_object()) {
+                std::cerr << "[Middleware2][raft] Dropped malformed frame" << std::endl;
+                continue;
+            }
+            try {
+                handle(msg);
+            } catch (const json::exception& e) {
+                std::cerr << "[Middleware2][raft] Dropped invalid message: " << e.what() << std::endl;
+            }
+        }
+        c.buffer.erase(0, off);
+    }
+
+    void drainProposals() {
+        std::deque<Proposal> batch;
+        {
+            std::lock_guard<std::mutex> lock(proposalMtx);
+            batch.swap(proposals);
+            proposalBytes = 0;
+        }
+        if (role != Role::Leader) {
+            if (batch.empty()) return;
+            // o middleware republica as propostas para o novo líder
+            std::cerr << "[Middleware2][raft] Returned " << batch.size()
+                      << " proposals after losing leadership" << std::endl;
+            std::lock_guard<std::mutex> lock(proposalMtx);
+            for (auto& p : batch) orphaned.push_back(std::move(p.payload));
+            return;
+        }
+        for (auto& p : batch) {
+            pushEntry({currentTerm, std::move(p.payload)});
+            appendRecord('E', lastIndex(), currentTerm, log.back().payload);
+            proposedAt.emplace_back(lastIndex(), p.at);
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint64_t done = forwardedLocal.load();
+        if (done > forwarded && now - lastMark >= FORWARD_MARK_INTERVAL) {
+            pushEntry({currentTerm, forwardMark(done)});
+            appendRecord('E', lastIndex(), currentTerm, log.back().payload);
+            noteEntry(log.back().payload);
+            lastMark = now;
+        } else if (batch.empty()) {
+            return;
+        }
+        syncLog();  // o líder só conta a si mesmo na maioria com as entradas em disco
+        uncommitted = lastIndex() - commitIndex;
+        advanceCommit();
+    }
+
+    void tick() {
+        auto now = std::chrono::steady_clock::now();
+        if (role == Role::Leader) {
+            for (size_t i = 0; i < peers.size(); ++i) {
+                if (static_cast<int>(i) == id) continue;
+                Peer& p = peers[i];
+                bool stale = now - p.lastSent >= HEARTBEAT;
+                if ((!p.inflight && p.nextIndex <= lastIndex()) || stale) {
+                    replicateTo(static_cast<int>(i));
+                }
+            }
+        } else if (now >= electionDeadline) {
+            startElection();
+        }
+    }
+
+    void resetElectionTimer() {
+        std::uniform_int_distribution<int> jitter(150, 300);
+        electionDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(jitter(rng));
+    }
+
+    void becomeFollower(uint64_t term) {
+        if (term > currentTerm) {
+            currentTerm = term;
+            votedFor = -1;
+            saveState();
+            leaderSince = 0;  // o líder do novo termo ainda não se apresentou
+        }
+        if (role != Role::Follower) {
+            std::cout << "[Middleware2][raft] Node " << id << " is follower (term "
+                      << currentTerm << ")" << std::endl;
+        }
+        role = Role::Follower;
+    }
+
+    void startElection() {
+        role = Role::Candidate;
+        leaderSince = 0;
+        ++currentTerm;
+        votedFor = id;
+        votes = 1;
+        saveState();
+        resetElectionTimer();
+        broadcast({{"type", "vote"}, {"term", currentTerm}, {"from", id},
+                   {"lastIndex", lastIndex()}, {"lastTerm", termAt(lastIndex())}});
+        if (static_cast<size_t>(votes) >= majority()) becomeLeader();
+    }
+
+    void becomeLeader() {
+        role = Role::Leader;
+        ledTerms.insert(currentTerm);
+        // Entradas aplicadas como follower não foram encaminhadas: volta o apply
+        // para a última marca e elas saem de novo como líder
+        lastApplied = std::min(lastApplied, std::max(base, forwarded));
+        for (auto& p : peers) {
+            p.nextIndex = lastIndex() + 1;
+            p.matchIndex = 0;
+            p.inflight = false;
+            p.lastSent = {};
+        }
+        // No-op do termo atual (payload vazio): entradas de termos anteriores só
+        // podem ser commitadas junto com uma do termo corrente, sem esperar tráfego
+        pushEntry({currentTerm, ""});
+        appendRecord('E', lastIndex(), currentTerm, "");
+        syncLog();
+        std::cout << "[Middleware2][raft] Node " << id << " is LEADER (term "
+                  << currentTerm << ")" << std::endl;
+        advanceCommit();
+    }
+
+    void replicateTo(int to) {
+        Peer& p = peers[to];
+        p.lastSent = std::chrono::steady_clock::now();
+        if (p.nextIndex <= base) {
+            // entradas já compactadas: adianta o follower para o ponto compactado
+            p.inflight = true;
+            send(to, {{"type", "snapshot"}, {"term", currentTerm}, {"from", id},
+                      {"lastIndex", base}, {"lastTerm", baseTerm}});
+            return;
+        }
+        uint64_t prev = p.nextIndex - 1;
+        uint64_t last = std::min(lastIndex(), prev + maxBatch.load());
+        json entries = json::array();
+        for (uint64_t i = prev + 1; i <= last; ++i) {
+            const RaftEntry& e = log[i - base - 1];
+            entries.push_back({e.term, e.payload});
+        }
+        p.inflight = true;
+        send(to, {{"type", "append"}, {"term", currentTerm}, {"from", id},
+                  {"prevIndex", prev}, {"prevTerm", termAt(prev)},
+                  {"commit", commitIndex}, {"entries", std::move(entries)}});
+    }
+
+    // Campos ausentes ou de tipo errado lançam json::exception (o frame é
+    // descartado em readFrom); 'from' fora do cluster é ignorado antes de
+    // indexar peers
+    void handle(const json& msg) {
+        const std::string type = msg.at("type").get<std::string>();
+        uint64_t term = msg.at("term").get<uint64_t>();
+        int from = msg.at("from").get<int>();
+        if (from < 0 || static_cast<size_t>(from) >= peers.size() || from == id) {
+            std::cerr << "[Middleware2][raft] Dropped message from unknown node " << from << std::endl;
+            return;
+        }
+        if (term > currentTerm) becomeFollower(term);
+
+        if (type == "vote") {
+            uint64_t lastIdx = msg.at("lastIndex").get<uint64_t>();
+            uint64_t lastTrm = msg.at("lastTerm").get<uint64_t>();
+            bool upToDate = lastTrm > termAt(lastIndex()) ||
+                            (lastTrm == termAt(lastIndex()) && lastIdx >= lastIndex());
+            bool granted = term == currentTerm && (votedFor < 0 || votedFor == from) && upToDate;
+            if (granted) {
+                votedFor = from;
+                saveState();
+                resetElectionTimer();
+            }
+            send(from, {{"type", "voteReply"}, {"term", currentTerm}, {"from", id},
+                        {"granted", granted}});
+        } else if (type == "voteReply") {
+            if (role == Role::Candidate && term == currentTerm && msg.at("granted").get<bool>()) {
+                if (static_cast<size_t>(++votes) >= majority()) becomeLeader();
+            }
+        } else if (type == "append") {
+            handleAppend(msg, term, from);
+        } else if (type == "snapshot") {
+            handleSnapshot(msg, term, from);
+        } else if (type == "appendReply") {
+            if (role != Role::Leader || term != currentTerm) return;
+            Peer& p = peers[from];
+            p.inflight = false;
+            uint64_t match = msg.at("match").get<uint64_t>();
+            if (msg.at("success").get<bool>()) {
+                p.matchIndex = std::max(p.matchIndex, match);
+                p.nextIndex = p.matchIndex + 1;
+                advanceCommit();
+            } else {
+                // 'match' carrega o último índice do follower como dica
+                p.nextIndex = std::max<uint64_t>(1, std::min(p.nextIndex - 1, match + 1));
+            }
+        }
+    }
+
+    void handleAppend(const json& msg, uint64_t term, int from) {
+        // Lê a mensagem inteira antes de mexer no log: um frame inválido não
+        // pode deixar entradas pela metade
+        uint64_t prev = msg.at("prevIndex").get<uint64_t>();
+        uint64_t prevTerm = msg.at("prevTerm").get<uint64_t>();
+        uint64_t leaderCommit = msg.at("commit").get<uint64_t>();
+        std::vector<RaftEntry> entries;
+        for (const auto& e : msg.at("entries")) {
+            entries.push_back({e.at(0).get<uint64_t>(), e.at(1).get<std::string>()});
+        }
+        if (term < currentTerm) {
+            send(from, {{"type", "appendReply"}, {"term", currentTerm}, {"from", id},
+                        {"success", false}, {"match", lastIndex()}});
+            return;
+        }
+        becomeFollower(term);
+        resetElectionTimer();
+        int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+        if (leaderSince == 0) leaderSince = now;
+        leaderContact = now;
+
+        size_t skip = 0;
+        if (prev < base) {
+            // prefixo já commitado e compactado aqui
+            skip = static_cast<size_t>(base - prev);
+            prev = base;
+            prevTerm = baseTerm;
+        }
+        if (prev > lastIndex() || termAt(prev) != prevTerm) {
+            send(from, {{"type", "appendReply"}, {"term", currentTerm}, {"from", id},
+                        {"success", false}, {"match", std::min(lastIndex(), prev - 1)}});
+            return;
+        }
+        uint64_t index = prev;
+        for (size_t i = skip; i < entries.size(); ++i) {
+            ++index;
+            if (index <= lastIndex()) {
+                if (termAt(index) == entries[i].term) continue;
+                orphanFrom(index);
+                dropFrom(index);  // conflito: descarta o sufixo
+            }
+            pushEntry(std::move(entries[i]));
+            appendRecord('E', index, log.back().term, log.back().payload);
+            noteEntry(log.back().payload);
+        }
+        syncLog();  // confirma só o que já está em disco
+        if (leaderCommit > commitIndex) {
+            commitIndex = std::min(leaderCommit, index);
+            applyCommitted();
+        }
+        send(from, {{"type", "appendReply"}, {"term", currentTerm}, {"from", id},
+                    {"success", true}, {"match", index}});
+    }
+
+    // Entradas que este nó propôs como líder e que o novo líder descartou nunca
+    // foram commitadas: voltam ao middleware para serem republicadas
+    void orphanFrom(uint64_t index) {
+        std::lock_guard<std::mutex> lock(proposalMtx);
+        for (uint64_t i = index; i <= lastIndex(); ++i) {
+            const RaftEntry& e = log[i - base - 1];
+            if (ledTerms.count(e.term) && !e.payload.empty() && !isForwardMark(e.payload)) {
+                orphaned.push_back(e.payload);
+            }
+        }
+    }
+
+    void handleSnapshot(const json& msg, uint64_t term, int from) {
+        uint64_t snapIndex = msg.at("lastIndex").get<uint64_t>();
+        uint64_t snapTerm = msg.at("lastTerm").get<uint64_t>();
+        if (term < currentTerm) return;
+        becomeFollower(term);
+        resetElectionTimer();
+        if (snapIndex > commitIndex) {
+            // followers não encaminham: basta saltar o prefixo compactado
+            if (snapIndex < lastIndex() && termAt(snapIndex) == snapTerm) {
+                dropThrough(snapIndex);
+            } else {
+                dropThrough(lastIndex());
+            }
+            base = snapIndex;
+            baseTerm = snapTerm;
+            commitIndex = lastApplied = snapIndex;
+            forwarded = std::max(forwarded, snapIndex);  // o líder só compacta o encaminhado
+            appendRecord('B', base, baseTerm, "");
+            syncLog();
+        }
+        send(from, {{"type", "appendReply"}, {"term", currentTerm}, {"from", id},
+                    {"success", true}, {"match", commitIndex}});
+    }
+
+    void advanceCommit() {
+        for (uint64_t n = lastIndex(); n > commitIndex; --n) {
+            if (termAt(n) != currentTerm) break;
+            size_t replicas = 1;
+            for (size_t i = 0; i < peers.size(); ++i) {
+                if (static_cast<int>(i) != id && peers[i].matchIndex >= n) ++replicas;
+            }
+            if (replicas >= majority()) {
+                commitIndex = n;
+                break;
+            }
+        }
+        applyCommitted();
+    }
+
+    void applyCommitted() {
+        bool leader = role == Role::Leader;
+        auto now = std::chrono::steady_clock::now();
+        while (lastApplied < commitIndex) {
+            ++lastApplied;
+            const std::string& payload = log[lastApplied - base - 1].payload;
+            if (payload.empty() || isForwardMark(payload)) continue;
+            if (lastApplied <= forwarded) continue;  // já encaminhada por algum líder
+            apply(lastApplied, payload, leader);
+            committed.fetch_add(1);
+        }
+        {
+            std::lock_guard<std::mutex> lock(statsMtx);
+            while (!proposedAt.empty() && proposedAt.front().first <= commitIndex) {
+                commitLatencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - proposedAt.front().second).count());
+                proposedAt.pop_front();
+            }
+        }
+        if (!leader) proposedAt.clear();
+        uncommitted = lastIndex() - commitIndex;
+        compact();
+    }
+
+    void compact() {
+        bool overBytes = logBytes > maxBytes / 2;
+        if (log.size() <= MAX_LOG && !overBytes) return;
+        // Nada acima da última marca é compactado: um novo líder ainda precisa
+        // reencaminhar essas entradas. O líder também preserva o que os
+        // followers ainda não confirmaram, exceto se um follower parado fizer o
+        // log passar de 4x o limite ou de metade de RAFT_MAX_BYTES
+        uint64_t upTo = std::min(lastApplied, forwarded);
+        if (role == Role::Leader && log.size() <= 4 * MAX_LOG && !overBytes) {
+            for (size_t i = 0; i < peers.size(); ++i) {
+                if (static_cast<int>(i) != id) upTo = std::min(upTo, peers[i].matchIndex);
+            }
+        }
+        if (upTo <= base) return;
+        baseTerm = termAt(upTo);
+        dropThrough(upTo);
+        base = upTo;
+        rewriteLog();
+    }
+};
+
+static int64_t percentileOf(std::vector<int64_t> v, double q) {
+    if (v.empty()) return 0;
+    size_t k = static_cast<size_t>(q * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// STAGE_BUDGETS_MS="validation:5,transformation:20"; demais estágios usam STAGE_BUDGET_MS
+static void applyStageBudgets(std::vector<std::unique_ptr<PipelineStage>>& stages) {
+    auto fallback = Deadline::budgetFromMillis(envLong("STAGE_BUDGET_MS", 0));
+    std::map<std::string, long> configured;
+    std::stringstream ss(envString("STAGE_BUDGETS_MS", ""));
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        auto colon = item.find(':');
+        if (colon != std::string::npos) configured[item.substr(0, colon)] = std::atol(item.c_str() + colon + 1);
+    }
+    for (auto& stage : stages) {
+        auto it = configured.find(stage->name());
+        stage->setBudget(it != configured.end() ? Deadline::budgetFromMillis(it->second) : fallback);
+    }
+    // Sem isolamento por processo aqui: nenhum estágio pode ser interrompido
+    if (envLong("MESSAGE_BUDGET_MS", 0) > 0 || envLong("STAGE_BUDGET_MS", 0) > 0 || !configured.empty()) {
+        std::cout << "[Middleware2] Budgets are cooperative: a blocking stage call is only caught when it "
+                     "returns and then routed to the fallback topic" << std::endl;
+    }
+}
+
+// Lê o valor de "device_id" direto do payload, sem montar o JSON (alimenta o DeviceSketch)
+static bool extractDeviceId(std::string_view payload, std::string_view& out) {
+    static constexpr std::string_view KEY = "\"device_id\"";
+    size_t p = payload.find(KEY);
+    if (p == std::string_view::npos) return false;
+    p += KEY.size();
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != ':') return false;
+    ++p;
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != '"') return false;
+    size_t end = payload.find('"', ++p);
+    if (end == std::string_view::npos) return false;
+    out = payload.substr(p, end - p);
+    return true;
+}
+
+// Opções por rota; o casamento dos filtros fica na TopicTrie (topic_trie.h)
+struct TopicRoute {
+    std::string pattern;
+    std::vector<std::string> stages;  // vazio: pipeline inteiro
+};
+
+// TOPIC_ROUTES="filtro[,stages=a+b];..." - os filtros são também as
+// assinaturas; o primeiro filtro idêntico prevalece
+static std::vector<TopicRoute> parseTopicRoutes(const std::string& spec) {
+    std::vector<TopicRoute> routes;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+        std::stringstream fields(item);
+        std::string field;
+        TopicRoute route;
+        while (std::getline(fields, field, ',')) {
+            auto eq = field.find('=');
+            if (route.pattern.empty() && eq == std::string::npos) {
+                route.pattern = field;
+            } else if (field.compare(0, eq, "stages") == 0 && eq != std::string::npos) {
+                std::stringstream names(field.substr(eq + 1));
+                std::string name;
+                while (std::getline(names, name, '+')) {
+                    if (!name.empty()) route.stages.push_back(name);
+                }
+            } else {
+                std::cerr << "[Middleware2] Unknown route option '" << field << "' in '" << item << "'" << std::endl;
+            }
+        }
+        if (!route.pattern.empty()) routes.push_back(std::move(route));
+    }
+    if (routes.empty()) {
+        TopicRoute fallback;
+        fallback.pattern = "iot/input";
+        routes.push_back(fallback);
+    }
+    return routes;
+}
+
+class MQTTMiddleware {
+private:
+    mqtt::async_client client;        // consumidor
+    mqtt::async_client sender_client; // publicador
+    std::vector<std::unique_ptr<PipelineStage>> pipeline;
+    Supervisor supervisor;
+
+    // Orçamento total por mensagem; estouros seguem para o tópico de fallback
+    const std::chrono::microseconds messageBudget =
+        Deadline::budgetFromMillis(envLong("MESSAGE_BUDGET_MS", 0));
+    const std::string FALLBACK_TOPIC = envString("FALLBACK_TOPIC", "iot/fallback");
+    std::map<std::string, uint64_t> overruns;
+
+    const std::string RECEIVER_TOPIC = "iot/data";
+    const std::string BENCH_TOPIC    = "iot/bench";
+
+    // Entradas commitadas pelo Raft aguardando o pipeline (apenas no líder),
+    // com o índice para a marca de encaminhamento
+    std::mutex committedMtx;
+    std::deque<std::pair<uint64_t, std::string>> committedQueue;
+    std::atomic<bool> benchRunning{false};
+    RaftNode* raftNode = nullptr;
+
+    // Mensagens consumidas que ainda não estão no log do Raft (proposta recusada
+    // ou descartada na troca de líder); o líder volta a propô-las e um follower
+    // as republica no tópico de origem quando o novo líder já assinou as rotas
+    std::deque<std::string> held;
+    const std::chrono::milliseconds LEADER_SETTLE = std::chrono::milliseconds(500);
+
+    DeviceSketch deviceSketch{static_cast<size_t>(std::max(1L, envLong("HOT_DEVICES_K", 64)))};
+
+    // Rotas por filtro de tópico (assinaturas com '+' e '#'); cada uma pode
+    // restringir os estágios do pipeline
+    std::vector<TopicRoute> routes = parseTopicRoutes(envString("TOPIC_ROUTES", "iot/input"));
+    std::vector<std::vector<bool>> routeStages;  // paralelo a 'routes'; vazio: todos
+    TopicTrie topicRoutes;
+
+public:
+    MQTTMiddleware(const std::string& brokerAddress, const std::string& clientId = "middleware3")
+        : client(brokerAddress, clientId),
+          sender_client(brokerAddress, clientId + "_sender")
+    {
+        pipeline.push_back(std::make_unique<ValidationStage>());
+        pipeline.push_back(std::make_unique<TransformationStage>());
+        applyStageBudgets(pipeline);
+        buildRoutes();
+    }
+
+    void start() {
+        StartupTimer& startup = StartupTimer::instance();
+        startup.mark("init");
+        // Consumidor e publicador conectam em paralelo
+        BrokerConnector("Middleware2", {{&client, "consumer"}, {&sender_client, "publisher"}}).connect();
+        startup.mark("connect");
+
+        // Alinha com middleware1: consumir por fila interna
+        client.start_consuming();
+
+        subscribeRoutes();
+        startup.mark("subscribe");
+        startup.ready();
+
+        while (true) {
+            auto msg = client.consume_message();
+            if (msg) {
+                std::cout << "[Middleware3] Message received on topic '"
+                          << msg->get_topic() << "': " << msg->to_string() << std::endl;
+                processMessage(msg->to_string(), topicRoutes.match(msg->get_topic()));
+            }
+            checkPipelineHealth();
+            reportDeviceStats();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // Chamado pela thread do Raft para cada entrada commitada ("tópico\npayload")
+    void onCommitted(uint64_t index, const std::string& payload, bool leader) {
+        if (!leader) return;
+        if (benchRunning) {
+            raftNode->markForwarded(index);  // carga sintética: nada a encaminhar
+            return;
+        }
+        std::lock_guard<std::mutex> lock(committedMtx);
+        committedQueue.emplace_back(index, payload);
+    }
+
+    // Modo replicado: só o líder assina as rotas; cada mensagem é proposta ao
+    // Raft com o tópico de origem e encaminhada somente depois de commitada
+    // pela maioria, com a rota resolvida de novo na aplicação
+    void startReplicated(RaftNode& raft, long benchMessages, const std::string& benchBatches) {
+        raftNode = &raft;
+        StartupTimer& startup = StartupTimer::instance();
+        startup.mark("init");
+        BrokerConnector("Middleware2", {{&client, "consumer"}, {&sender_client, "publisher"}}).connect();
+        startup.mark("connect");
+        client.start_consuming();
+        raft.start();
+
+        bool subscribed = false;
+        bool benchDone = benchMessages <= 0;
+        auto lastHealthCheck = std::chrono::steady_clock::now();
+        auto lastReport = lastHealthCheck;
+        uint64_t lastCommitted = 0;
+
+        while (true) {
+            bool leader = raft.isLeader();
+            if (leader && !benchDone) {
+                runBench(raft, benchMessages, benchBatches);
+                benchDone = true;
+            }
+            if (leader && !subscribed) {
+                subscribeRoutes();
+                subscribed = true;
+                // inclui a eleição: um follower só fica pronto ao virar líder
+                startup.mark("subscribe");
+                startup.ready();
+            } else if (!leader && subscribed) {
+                std::vector<mqtt::token_ptr> tokens;
+                for (const auto& r : routes) tokens.push_back(client.unsubscribe(r.pattern));
+                for (auto& token : tokens) token->wait();
+                subscribed = false;
+                // o que já estava na fila do cliente não foi proposto
+                mqtt::const_message_ptr pending;
+                while (client.try_consume_message(&pending)) {
+                    if (pending) held.push_back(pending->get_topic() + "\n" + pending->to_string());
+                }
+                std::cout << "[Middleware2] Lost leadership, unsubscribed" << std::endl;
+            }
+
+            for (auto& entry : raft.takeOrphaned()) held.push_back(std::move(entry));
+            if (!held.empty()) resubmitHeld(raft);
+
+            // Com o Raft saturado o consumo pausa até o commit e a compactação
+            // liberarem memória
+            mqtt::const_message_ptr msg;
+            bool accepting = subscribed && !raft.saturated();
+            if (accepting && client.try_consume_message_for(&msg, std::chrono::milliseconds(10)) && msg) {
+                std::string entry = msg->get_topic() + "\n" + msg->to_string();
+                if (!raft.propose(entry)) held.push_back(std::move(entry));
+            } else if (!accepting) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            std::deque<std::pair<uint64_t, std::string>> ready;
+            {
+                std::lock_guard<std::mutex> lock(committedMtx);
+                ready.swap(committedQueue);
+            }
+            while (!ready.empty()) {
+                const std::string& entry = ready.front().second;
+                // entradas sem tópico (gravadas antes das rotas) seguem o pipeline inteiro
+                size_t split = entry.find('\n');
+                bool done = split == std::string::npos
+                    ? processMessage(entry, TopicTrie::NO_ROUTE)
+                    : processMessage(entry.substr(split + 1), topicRoutes.match(std::string_view(entry).substr(0, split)));
+                if (!done) {
+                    // broker indisponível: a entrada e as seguintes voltam para a
+                    // fila e a marca de encaminhamento não avança além delas
+                    std::lock_guard<std::mutex> lock(committedMtx);
+                    committedQueue.insert(committedQueue.begin(), std::make_move_iterator(ready.begin()),
+                                          std::make_move_iterator(ready.end()));
+                    break;
+                }
+                raft.markForwarded(ready.front().first);
+                ready.pop_front();
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastHealthCheck >= std::chrono::milliseconds(100)) {
+                checkPipelineHealth();
+                lastHealthCheck = now;
+            }
+            reportDeviceStats();
+            if (now - lastReport >= std::chrono::seconds(10)) {
+                auto lat = raft.takeCommitLatencies();
+                uint64_t total = raft.committedCount();
+                std::cout << "[Middleware2][raft] committed=" << total
+                          << " rate=" << (total - lastCommitted) / 10.0 << "/s";
+                if (!lat.empty()) {
+                    std::cout << " commit_p50=" << percentileOf(lat, 0.50) << "us"
+                              << " commit_p99=" << percentileOf(lat, 0.99) << "us";
+                }
+                std::cout << std::endl;
+                lastCommitted = total;
+                lastReport = now;
+            }
+        }
+    }
+
+private:
+    // Líder: propõe de novo. Follower: republica no tópico de origem (QoS 1)
+    // assim que houver um líder estável, que a esta altura já assinou as rotas.
+    // Sem líder, as mensagens ficam retidas aqui.
+    void resubmitHeld(RaftNode& raft) {
+        if (raft.isLeader()) {
+            while (!held.empty() && raft.propose(held.front())) held.pop_front();
+            return;
+        }
+        if (!raft.hasSettledLeader(LEADER_SETTLE)) return;
+        size_t republished = 0;
+        while (!held.empty()) {
+            const std::string& entry = held.front();
+            size_t split = entry.find('\n');
+            if (split == std::string::npos) {  // carga do benchmark, sem tópico de origem
+                held.pop_front();
+                continue;
+            }
+            try {
+                mqtt::message_ptr pubmsg = mqtt::make_message(entry.substr(0, split), entry.substr(split + 1));
+                pubmsg->set_qos(1);
+                sender_client.publish(pubmsg)->wait();
+            } catch (const std::exception& e) {
+                std::cerr << "[Middleware2] Republish error: " << e.what() << std::endl;
+                break;
+            }
+            held.pop_front();
+            ++republished;
+        }
+        if (republished > 0) {
+            std::cout << "[Middleware2] Republished " << republished
+                      << " unreplicated messages for the new leader" << std::endl;
+        }
+    }
+
+    // Benchmark de custo da consistência forte: compara o caminho não
+    // replicado do middleware1 (publish QoS 1 + wait) com a latência de
+    // commit e a vazão do Raft para cada tamanho de batch
+    void runBench(RaftNode& raft, long messages, const std::string& batchList) {
+        benchRunning = true;
+        const std::string payload =
+            R"({"seq":0,"device_id":"device_1","timestamp":"2025-01-01T00:00:00+00:00",)"
+            R"("temperature":25.0,"humidity":60.0,"status":"normal"})";
+
+        std::vector<int64_t> lat;
+        auto started = std::chrono::steady_clock::now();
+        for (long i = 0; i < messages; ++i) {
+            auto t0 = std::chrono::steady_clock::now();
+            sender_client.publish(BENCH_TOPIC, payload, 1, false)->wait();
+            lat.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - t0).count());
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "[Middleware2][raft-bench] unreplicated (middleware1 path) msgs=" << messages
+                  << " throughput=" << messages / secs << "/s"
+                  << " p50=" << percentileOf(lat, 0.50) << "us"
+                  << " p99=" << percentileOf(lat, 0.99) << "us" << std::endl;
+
+        std::stringstream ss(batchList);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            size_t batch = static_cast<size_t>(std::atol(item.c_str()));
+            if (batch == 0) continue;
+            raft.setMaxBatch(batch);
+            raft.takeCommitLatencies();
+            raft.takeSyncLatencies();
+            uint64_t target = raft.committedCount() + static_cast<uint64_t>(messages);
+            started = std::chrono::steady_clock::now();
+            for (long i = 0; i < messages && raft.isLeader(); ++i) {
+                while (raft.pendingProposals() > 8192) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                raft.propose(payload);
+            }
+            while (raft.committedCount() < target && raft.isLeader() &&
+                   std::chrono::steady_clock::now() - started < std::chrono::seconds(120)) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            lat = raft.takeCommitLatencies();
+            // O commit já inclui o fdatasync do líder e o dos followers antes do ack;
+            // as syncs do líder aparecem separadas para mostrar o peso do disco
+            std::vector<int64_t> syncs = raft.takeSyncLatencies();
+            std::cout << "[Middleware2][raft-bench] batch=" << batch << " msgs=" << lat.size()
+                      << " throughput=" << lat.size() / secs << "/s"
+                      << " commit_p50=" << percentileOf(lat, 0.50) << "us"
+                      << " commit_p99=" << percentileOf(lat, 0.99) << "us"
+                      << " leader_fsyncs=" << syncs.size()
+                      << " fsync_p50=" << percentileOf(syncs, 0.50) << "us"
+                      << " fsync_p99=" << percentileOf(syncs, 0.99) << "us" << std::endl;
+        }
+        raft.setMaxBatch(static_cast<size_t>(envLong("RAFT_BATCH", 64)));
+        benchRunning = false;
+    }
+
+    void reportDeviceStats() {
+        static auto lastReport = std::chrono::steady_clock::now();
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(10)) return;
+        lastReport = now;
+        std::cout << "[Middleware2] Device stats: " << deviceSketch.report(5) << std::endl;
+    }
+
+    // Filtros compilados na trie e estágios permitidos por rota
+    void buildRoutes() {
+        for (size_t r = 0; r < routes.size(); ++r) {
+            topicRoutes.add(routes[r].pattern, static_cast<int>(r));
+            std::vector<bool> allowed;
+            if (!routes[r].stages.empty()) {
+                allowed.assign(pipeline.size(), false);
+                for (const auto& name : routes[r].stages) {
+                    bool found = false;
+                    for (size_t i = 0; i < pipeline.size(); ++i) {
+                        if (pipeline[i]->name() == name) allowed[i] = found = true;
+                    }
+                    if (!found) {
+                        std::cerr << "[Middleware2] Route '" << routes[r].pattern << "' names unknown stage '"
+                                  << name << "'" << std::endl;
+                    }
+                }
+            }
+            routeStages.push_back(std::move(allowed));
+        }
+    }
+
+    // Todos os SUBSCRIBEs saem antes de esperar pelos SUBACKs
+    void subscribeRoutes() {
+        std::vector<mqtt::token_ptr> tokens;
+        for (const auto& r : routes) tokens.push_back(client.subscribe(r.pattern, 1));
+        for (size_t i = 0; i < routes.size(); ++i) {
+            tokens[i]->wait();
+            std::cout << "[Middleware2] Subscribed to topic: " << routes[i].pattern << std::endl;
+        }
+    }
+
+    // false só quando o publish no receiver falhou (broker indisponível): a
+    // mensagem pode ser tentada de novo; rejeição e fallback contam como tratadas
+    bool processMessage(const std::string& payload, int route) {
+        const std::vector<bool>* allowed = route != TopicTrie::NO_ROUTE ? &routeStages[route] : nullptr;
+        std::string_view deviceId;
+        if (extractDeviceId(payload, deviceId)) deviceSketch.observe(deviceId, hashDeviceId(deviceId));
+        Deadline deadline = Deadline::within(messageBudget);
+        std::string processed = payload;
+        try {
+            for (size_t i = 0; i < pipeline.size(); ++i) {
+                if (allowed && !allowed->empty() && !(*allowed)[i]) continue;
+                auto& stage = pipeline[i];
+                Deadline stageDeadline = deadline.narrowedTo(stage->budget());
+                std::string output = stage->process(processed, stageDeadline);
+                if (stageDeadline.expired()) throw DeadlineExceeded(stage->name());
+                processed = std::move(output);
+            }
+
+            // Publish em iot/data com QoS 1 e wait() (igual ao middleware1)
+            mqtt::message_ptr pubmsg = mqtt::make_message(RECEIVER_TOPIC, processed);
+            pubmsg->set_qos(1);
+            sender_client.publish(pubmsg)->wait();
+            StartupTimer::instance().firstMessage();
+
+            std::cout << "[Middleware3] Forwarded processed message to receiver" << std::endl;
+        }
+        catch (const DeadlineExceeded& e) {
+            routeToFallback(processed, e.what());
+        }
+        catch (const mqtt::exception& e) {
+            std::cerr << "[Middleware2] Publish error: " << e.what() << std::endl;
+            return false;
+        }
+        catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Pipeline error: " << e.what() << std::endl;
+        }
+        return true;
+    }
+
+    // Encaminha o último resultado completo (antes do estágio que estourou)
+    void routeToFallback(const std::string& partial, const std::string& reason) {
+        uint64_t count = ++overruns[reason];
+        std::cerr << "[Middleware2] " << reason << " (" << count << " overruns) - routing to "
+                  << FALLBACK_TOPIC << std::endl;
+        try {
+            mqtt::message_ptr pubmsg = mqtt::make_message(FALLBACK_TOPIC, partial);
+            pubmsg->set_qos(1);
+            sender_client.publish(pubmsg)->wait();
+        }
+        catch (const std::exception& e) {
+            std::cerr << "[Middleware2] Fallback publish error: " << e.what() << std::endl;
+        }
+    }
+
+    void checkPipelineHealth() {
+        for (auto& stage : pipeline) {
+            if (!stage->isHealthy()) {
+                std::cout << "[Middleware3] Stage failed, restarting..." << std::endl;
+                stage = supervisor.restartStage(std::move(stage));
+            }
+        }
+    }
+};
+
+static int runRaftNode(int nodeId, const std::vector<std::string>& addresses,
+                       const std::string& brokerAddress) {
+    // Primeiro uso no nó: os tempos contam a partir do fork, não do processo inicial
+    StartupTimer::instance("Middleware2");
+    MQTTMiddleware middleware(brokerAddress, "middleware2-raft-" + std::to_string(nodeId));
+    RaftNode raft(nodeId, addresses, envString("RAFT_STATE_DIR", "/tmp"),
+                  [&middleware](uint64_t index, const std::string& payload, bool leader) {
+                      middleware.onCommitted(index, payload, leader);
+                  });
+    raft.setMaxBatch(static_cast<size_t>(envLong("RAFT_BATCH", 64)));
+    try {
+        middleware.startReplicated(raft, envLong("RAFT_BENCH_MESSAGES", 0),
+                                   envString("RAFT_BENCH_BATCHES", "1,8,32,128"));
+    } catch (const std::exception& e) {
+        std::cerr << "[Middleware2] Node " << nodeId << " startup failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Sem RAFT_NODE_ID, o processo inicial cria um processo por nó no mesmo host
+// e recria qualquer nó que termine (o nó volta como follower e se atualiza)
+static int runRaftCluster(const std::vector<std::string>& addresses,
+                          const std::string& brokerAddress) {
+    std::vector<pid_t> pids(addresses.size(), -1);
+    auto spawn = [&](int nodeId) {
+        pid_t pid = fork();
+        if (pid == 0) _exit(runRaftNode(nodeId, addresses, brokerAddress));
+        pids[nodeId] = pid;
+        std::cout << "[Middleware2] Started raft node " << nodeId << " (pid " << pid << ")" << std::endl;
+    };
+    for (size_t i = 0; i < addresses.size(); ++i) spawn(static_cast<int>(i));
+
+    while (true) {
+        int status = 0;
+        pid_t dead = wait(&status);
+        if (dead < 0) return 1;
+        for (size_t i = 0; i < pids.size(); ++i) {
+            if (pids[i] == dead) {
+                std::cerr << "[Middleware2] Raft node " << i << " exited, restarting" << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                spawn(static_cast<int>(i));
+            }
+        }
+    }
+}
+
+int main() {
+    const std::string broker = "tcp://mosquitto:1883";
+
+    if (envString("REPLICATION_MODE", "") == "raft") {
+        // RAFT_PEERS: endereços separados por vírgula, UDS (/caminho) ou host:porta
+        std::vector<std::string> addresses;
+        std::stringstream ss(envString("RAFT_PEERS", ""));
+        std::string addr;
+        while (std::getline(ss, addr, ',')) {
+            if (!addr.empty()) addresses.push_back(addr);
+        }
+        if (addresses.empty()) {
+            for (long i = 0; i < envLong("RAFT_NODES", 3); ++i) {
+                addresses.push_back("/tmp/middleware2-raft-" + std::to_string(i) + ".sock");
+            }
+        }
+        long nodeId = envLong("RAFT_NODE_ID", -1);
+        if (nodeId < 0) return runRaftCluster(addresses, broker);
+        return runRaftNode(static_cast<int>(nodeId), addresses, broker);
+    }
+
+    StartupTimer::instance("Middleware2");
+    MQTTMiddleware middleware(broker);
+    try {
+        middleware.start();
+    } catch (const std::exception& e) {
+        std::cerr << "[Middleware2] Startup failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
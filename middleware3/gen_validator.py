@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# gen_validator.py
+#
+# Compila um JSON schema (objeto plano: type, required, minimum/maximum,
+# minLength/maxLength, enum, additionalProperties) num validador C++
+# especializado que percorre os bytes crus uma única vez, sem montar DOM.
+# Qualquer outra palavra-chave (pattern, format, multipleOf, exclusive*,
+# objetos/arrays aninhados, type em lista...) falha o build: ignorá-la
+# deixaria passar mensagens que o schema rejeita.
+# Chamado pelo CMake: gen_validator.py <schema.json> <saida.h> <namespace>
+
+import json
+import sys
+
+def cpp_str(s):
+    return json.dumps(s)
+
+# Anotações sem efeito na validação, aceitas em qualquer nível
+ANNOTATIONS = {"$schema", "$id", "$comment", "title", "description", "default", "examples"}
+
+# Palavras-chave que o gerador implementa, por tipo de propriedade
+KEYWORDS = {
+    "string": {"type", "minLength", "maxLength", "enum"},
+    "number": {"type", "minimum", "maximum"},
+    "integer": {"type", "minimum", "maximum"},
+    "boolean": {"type"},
+    "any": set(),
+}
+
+TOP_LEVEL = {"type", "properties", "required", "additionalProperties"}
+
+def unsupported(where, keys):
+    raise SystemExit(f"gen_validator: {where}: unsupported keyword(s) {', '.join(sorted(keys))}")
+
+def check_property(name, spec):
+    if not isinstance(spec, dict):
+        raise SystemExit(f"gen_validator: property '{name}': schema must be an object")
+    t = spec.get("type", "any")
+    if isinstance(t, list):
+        raise SystemExit(f"gen_validator: property '{name}': type lists like {json.dumps(t)} are not supported")
+    if t in ("object", "array"):
+        raise SystemExit(f"gen_validator: property '{name}': nested {t} is not supported")
+    if t not in KEYWORDS:
+        raise SystemExit(f"gen_validator: property '{name}': type '{t}' is not supported")
+    extra = set(spec) - KEYWORDS[t] - ANNOTATIONS
+    if extra:
+        unsupported(f"property '{name}' ({t})", extra)
+    for k in ("minLength", "maxLength"):
+        if k in spec and (not isinstance(spec[k], int) or isinstance(spec[k], bool) or spec[k] < 0):
+            raise SystemExit(f"gen_validator: property '{name}': {k} must be a non-negative integer")
+    for k in ("minimum", "maximum"):
+        if k in spec and (not isinstance(spec[k], (int, float)) or isinstance(spec[k], bool)):
+            raise SystemExit(f"gen_validator: property '{name}': {k} must be a number")
+    if "enum" in spec and (not isinstance(spec["enum"], list) or not spec["enum"] or
+                           not all(isinstance(e, str) for e in spec["enum"])):
+        raise SystemExit(f"gen_validator: property '{name}': enum must be a non-empty list of strings")
+
+def gen_property(name, spec, bit, out):
+    check_property(name, spec)
+    t = spec.get("type", "any")
+    pad = " " * 16
+    if t == "string":
+        out.append(f"{pad}std::string_view v;")
+        out.append(f"{pad}if (!detail::str(c, v)) return detail::fail(error, {cpp_str(name + ': expected string')});")
+        if "minLength" in spec or "maxLength" in spec:
+            out.append(f"{pad}size_t len = detail::codePoints(v);")
+        if "minLength" in spec:
+            out.append(f"{pad}if (len < {spec['minLength']}) return detail::fail(error, {cpp_str(name + ': too short')});")
+        if "maxLength" in spec:
+            out.append(f"{pad}if (len > {spec['maxLength']}) return detail::fail(error, {cpp_str(name + ': too long')});")
+        if "enum" in spec:
+            cond = " || ".join(f"v == {cpp_str(e)}" for e in spec["enum"])
+            out.append(f"{pad}if (!({cond})) return detail::fail(error, {cpp_str(name + ': not in enum')});")
+    elif t in ("number", "integer"):
+        out.append(f"{pad}double v;")
+        out.append(f"{pad}bool integral;")
+        out.append(f"{pad}if (!detail::num(c, v, integral)) return detail::fail(error, {cpp_str(name + ': expected number')});")
+        if t == "integer":
+            out.append(f"{pad}if (!integral) return detail::fail(error, {cpp_str(name + ': expected integer')});")
+        if "minimum" in spec:
+            out.append(f"{pad}if (v < {float(spec['minimum'])!r}) return detail::fail(error, {cpp_str(name + ': below minimum')});")
+        if "maximum" in spec:
+            out.append(f"{pad}if (v > {float(spec['maximum'])!r}) return detail::fail(error, {cpp_str(name + ': above maximum')});")
+    elif t == "boolean":
+        out.append(f"{pad}if (!detail::boolean(c)) return detail::fail(error, {cpp_str(name + ': expected boolean')});")
+    else:
+        out.append(f"{pad}if (!detail::skipValue(c, 0)) return detail::fail(error, {cpp_str(name + ': malformed value')});")
+    out.append(f"{pad}seen |= {1 << bit}u;")
+    out.append(f"{pad}known = true;")
+
+def generate(schema, namespace):
+    if schema.get("type") != "object":
+        raise SystemExit("gen_validator: only object schemas are supported")
+    extra = set(schema) - TOP_LEVEL - ANNOTATIONS
+    if extra:
+        unsupported("schema", extra)
+    props = schema.get("properties", {})
+    if len(props) > 32:
+        raise SystemExit("gen_validator: at most 32 properties")
+    names = list(props)
+    bits = {n: i for i, n in enumerate(names)}
+    required = schema.get("required", [])
+    missing = [r for r in required if r not in props]
+    if missing:
+        raise SystemExit(f"gen_validator: required field(s) {', '.join(missing)} not declared in properties")
+    additional = schema.get("additionalProperties", True)
+    if not isinstance(additional, bool):
+        raise SystemExit("gen_validator: additionalProperties must be true or false (schemas are not supported)")
+
+    by_len = {}
+    for n in names:
+        by_len.setdefault(len(n.encode()), []).append(n)
+
+    body = []
+    body.append("            switch (key.size()) {")
+    for length in sorted(by_len):
+        body.append(f"            case {length}:")
+        for i, n in enumerate(by_len[length]):
+            kw = "if" if i == 0 else "} else if"
+            body.append(f"                {kw} (key == {cpp_str(n)}) {{")
+            prop = []
+            gen_property(n, props[n], bits[n], prop)
+            body.extend("    " + line for line in prop)
+        body.append("                }")
+        body.append("                break;")
+    body.append("            }")
+
+    unknown = ("if (!detail::skipValue(c, 0)) return detail::fail(error, \"malformed value\");"
+               if additional is not False else
+               "return detail::fail(error, \"unexpected property\");")
+
+    required_checks = "\n".join(
+        f"    if (!(seen & {1 << bits[r]}u)) return detail::fail(error, {cpp_str('missing required field ' + r)});"
+        for r in required)
+
+    return HEADER.format(namespace=namespace, title=schema.get("title", namespace),
+                         dispatch="\n".join(body), unknown=unknown,
+                         required_checks=required_checks)
+
+HEADER = """// Gerado por gen_validator.py a partir do schema '{title}'. Não editar.
+#pragma once
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace {namespace} {{
+namespace detail {{
+
+struct Cursor {{
+    const char* p;
+    const char* end;
+}};
+
+inline bool fail(const char** error, const char* message) {{
+    if (error) *error = message;
+    return false;
+}}
+
+inline void ws(Cursor& c) {{
+    while (c.p < c.end && (*c.p == ' ' || *c.p == '\\t' || *c.p == '\\n' || *c.p == '\\r')) ++c.p;
+}}
+
+inline bool lit(Cursor& c, char ch) {{
+    ws(c);
+    if (c.p < c.end && *c.p == ch) {{
+        ++c.p;
+        return true;
+    }}
+    return false;
+}}
+
+// Conteúdo cru da string (escapes não são decodificados)
+inline bool str(Cursor& c, std::string_view& out) {{
+    if (!lit(c, '"')) return false;
+    const char* start = c.p;
+    while (c.p < c.end) {{
+        char ch = *c.p;
+        if (ch == '"') {{
+            out = std::string_view(start, static_cast<size_t>(c.p - start));
+            ++c.p;
+            return true;
+        }}
+        if (static_cast<unsigned char>(ch) < 0x20) return false;
+        c.p += (ch == '\\\\') ? 2 : 1;
+    }}
+    return false;
+}}
+
+// Comprimento em code points, como o JSON Schema conta minLength/maxLength:
+// bytes de continuação UTF-8 não contam, um escape conta como um caractere
+// e um par de surrogates escapado (high + low) como um só
+inline size_t codePoints(std::string_view s) {{
+    size_t n = 0;
+    for (size_t i = 0; i < s.size(); ++n) {{
+        unsigned char ch = static_cast<unsigned char>(s[i]);
+        if (ch != '\\\\') {{
+            ++i;
+            while (i < s.size() && (static_cast<unsigned char>(s[i]) & 0xC0) == 0x80) ++i;
+        }} else if (i + 1 < s.size() && s[i + 1] == 'u') {{
+            bool high = i + 3 < s.size() && (s[i + 2] == 'd' || s[i + 2] == 'D') &&
+                        std::string_view("89abAB").find(s[i + 3]) != std::string_view::npos;
+            i += 6;
+            if (high && i + 1 < s.size() && s[i] == '\\\\' && s[i + 1] == 'u') i += 6;
+        }} else {{
+            i += 2;
+        }}
+    }}
+    return n;
+}}
+
+inline bool num(Cursor& c, double& out, bool& integral) {{
+    ws(c);
+    const char* start = c.p;
+    if (c.p < c.end && *c.p == '-') ++c.p;
+    if (c.p >= c.end || *c.p < '0' || *c.p > '9') return false;
+    integral = true;
+    while (c.p < c.end) {{
+        char ch = *c.p;
+        if (ch >= '0' && ch <= '9') {{
+            ++c.p;
+        }} else if (ch == '.' || ch == 'e' || ch == 'E' || ch == '+' || ch == '-') {{
+            integral = false;
+            ++c.p;
+        }} else {{
+            break;
+        }}
+    }}
+    auto result = std::from_chars(start, c.p, out);
+    return result.ec == std::errc() && result.ptr == c.p;
+}}
+
+inline bool word(Cursor& c, std::string_view w) {{
+    ws(c);
+    if (static_cast<size_t>(c.end - c.p) < w.size() || std::string_view(c.p, w.size()) != w) return false;
+    c.p += w.size();
+    return true;
+}}
+
+inline bool boolean(Cursor& c) {{
+    return word(c, "true") || word(c, "false");
+}}
+
+inline bool skipValue(Cursor& c, int depth) {{
+    if (depth > 32) return false;
+    ws(c);
+    if (c.p >= c.end) return false;
+    std::string_view s;
+    double d;
+    bool integral;
+    switch (*c.p) {{
+    case '"':
+        return str(c, s);
+    case '{{':
+        ++c.p;
+        if (lit(c, '}}')) return true;
+        do {{
+            if (!str(c, s) || !lit(c, ':') || !skipValue(c, depth + 1)) return false;
+        }} while (lit(c, ','));
+        return lit(c, '}}');
+    case '[':
+        ++c.p;
+        if (lit(c, ']')) return true;
+        do {{
+            if (!skipValue(c, depth + 1)) return false;
+        }} while (lit(c, ','));
+        return lit(c, ']');
+    case 't':
+    case 'f':
+        return boolean(c);
+    case 'n':
+        return word(c, "null");
+    default:
+        return num(c, d, integral);
+    }}
+}}
+
+}}  // namespace detail
+
+// Valida a mensagem numa única passada; em caso de falha 'error' aponta
+// para uma mensagem estática (sem alocação)
+inline bool validate(std::string_view json, const char** error = nullptr) {{
+    detail::Cursor c{{json.data(), json.data() + json.size()}};
+    uint32_t seen = 0;
+    if (!detail::lit(c, '{{')) return detail::fail(error, "expected object");
+    if (!detail::lit(c, '}}')) {{
+        do {{
+            std::string_view key;
+            if (!detail::str(c, key)) return detail::fail(error, "expected key");
+            if (!detail::lit(c, ':')) return detail::fail(error, "expected ':'");
+            bool known = false;
+{dispatch}
+            if (!known) {{
+                {unknown}
+            }}
+        }} while (detail::lit(c, ','));
+        if (!detail::lit(c, '}}')) return detail::fail(error, "expected '}}'");
+    }}
+    detail::ws(c);
+    if (c.p != c.end) return detail::fail(error, "trailing data");
+{required_checks}
+    return true;
+}}
+
+}}  // namespace {namespace}
+"""
+
+def main():
+    if len(sys.argv) != 4:
+        raise SystemExit("uso: gen_validator.py <schema.json> <saida.h> <namespace>")
+    with open(sys.argv[1]) as f:
+        schema = json.load(f)
+    code = generate(schema, sys.argv[3])
+    with open(sys.argv[2], "w") as f:
+        f.write(code)
+
+if __name__ == "__main__":
+    main()
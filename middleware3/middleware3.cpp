@@ -1,123 +1,3771 @@
-// middleware3_pipeline.cpp
-#include <iostream>
-#include <vector>
-#include <functional>
-#include <memory>
-#include <mqtt/async_client.h>
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
-
-class PipelineStage {
-public:
-    virtual ~PipelineStage() = default;
-    virtual std::string process(const std::string& input) = 0;
-    virtual bool isHealthy() const { return true; }
-};
-
-class ValidationStage : public PipelineStage {
-public:
-    std::string process(const std::string& input) override {
-        auto j = json::parse(input);
-        if (!j.contains("device_id") || !j.contains("temperature")) {
-            throw std::runtime_error("Invalid message format");
-        }
-        return input;
-    }
-};
-
-class TransformationStage : public PipelineStage {
-private:
-    bool simulatedFailure = false;
-public:
-    std::string process(const std::string& input) override {
-        if (simulatedFailure) {
-            throw std::runtime_error("Simulated transformation failure");
-        }
-        auto j = json::parse(input);
-        j["processed"] = true;
-        j["server_timestamp"] = time(nullptr);
-        return j.dump();
-    }
-
-    bool isHealthy() const override {
-        static int counter = 0;
-        if (++counter % 5 == 0) {
-            return false;
-        }
-        return true;
-    }
-};
-
-class Supervisor {
-public:
-    std::unique_ptr<PipelineStage> restartStage(std::unique_ptr<PipelineStage> stage) {
-        std::cout << "[Middleware3] Restarting failed stage..." << std::endl;
-        return std::move(stage);
-    }
-};
-
-class MQTTMiddleware {
-private:
-    mqtt::async_client client;
-    mqtt::async_client sender_client;
-    std::vector<std::unique_ptr<PipelineStage>> pipeline;
-    Supervisor supervisor;
-
-public:
-    MQTTMiddleware(const std::string& brokerAddress) 
-        : client(brokerAddress, "middleware3"),
-          sender_client(brokerAddress, "middleware3_sender") 
-    {
-        pipeline.push_back(std::make_unique<ValidationStage>());
-        pipeline.push_back(std::make_unique<TransformationStage>());
-    }
-
-    void start() {
-        client.connect()->wait();
-        sender_client.connect()->wait();
-
-        client.subscribe("iot/input", 1)->wait(); // Igual middleware1
-        std::cout << "[Middleware3] Subscribed to topic: iot/input" << std::endl;
-
-        while (true) {
-            auto msg = client.consume_message();
-            if (msg) {
-                std::cout << "[Middleware3] Message received on topic '" 
-                          << msg->get_topic() << "': " << msg->to_string() << std::endl;
-                processMessage(msg->to_string());
-            }
-            checkPipelineHealth();
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    }
-
-private:
-    void processMessage(const std::string& payload) {
-        try {
-            std::string processed = payload;
-            for (auto& stage : pipeline) {
-                processed = stage->process(processed);
-            }
-            sender_client.publish("iot/data", processed, 1, false)->wait();
-            std::cout << "[Middleware3] Forwarded processed message to receiver" << std::endl;
-        } catch (const std::exception& e) {
-            std::cerr << "[Middleware3] Pipeline error: " << e.what() << std::endl;
-        }
-    }
-
-    void checkPipelineHealth() {
-        for (auto& stage : pipeline) {
-            if (!stage->isHealthy()) {
-                std::cout << "[Middleware3] Stage failed, restarting..." << std::endl;
-                stage = supervisor.restartStage(std::move(stage));
-            }
-        }
-    }
-};
-
-int main() {
-    MQTTMiddleware middleware("tcp://mosquitto:1883");
-    middleware.start();
-    return 0;
-}
+// middleware3_pipeline.cpp
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <linux/futex.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include <nlohmann/json.hpp>
+#include "device_sketch.h"
+#include "topic_trie.h"
+#include "deadline.h"
+#include "startup.h"
+#include "latency_tracker.h"
+#include "soak.h"
+#include "reading_validator.h"  // gerado pelo CMake a partir de schema/reading.schema.json
+
+using json = nlohmann::json;
+
+static long envLong(const char* name, long fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::atol(v) : fallback;
+}
+
+static std::string envString(const char* name, const std::string& fallback) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? std::string(v) : fallback;
+}
+
+// ---------------------------------------------------------------------------
+// Transporte em memória compartilhada entre processos do mesmo host: ring
+// SPSC de registros [len][bytes] com índices monotônicos e notificação por
+// futex (sem FUTEX_PRIVATE, pois produtor e consumidor são processos
+// distintos). Criado anônimo antes do fork ou nomeado via shm_open.
+// ---------------------------------------------------------------------------
+
+class ShmRing {
+private:
+    struct alignas(64) Header {
+        alignas(64) std::atomic<uint64_t> head;         // próximo byte a escrever
+        alignas(64) std::atomic<uint64_t> tail;         // próximo byte a ler
+        alignas(64) std::atomic<uint32_t> dataSignal;   // palavra futex do consumidor
+        std::atomic<uint32_t> consumerWaiting;
+        alignas(64) std::atomic<uint32_t> spaceSignal;  // palavra futex do produtor
+        std::atomic<uint32_t> producerWaiting;
+        uint64_t capacity;
+    };
+
+    static constexpr uint32_t WRAP = 0xFFFFFFFFu;
+    static constexpr int SPIN_ITERATIONS = 256;
+
+    Header* hdr = nullptr;
+    char* data = nullptr;
+    size_t mappedBytes = 0;
+    // Cópias locais do índice do outro lado: evitam tocar a linha de cache
+    // compartilhada enquanto houver espaço/dados conhecidos
+    uint64_t cachedTail = 0;
+    uint64_t cachedHead = 0;
+
+    static size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+    static void futexWait(std::atomic<uint32_t>* word, uint32_t expected, int timeoutMs) {
+        timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+                timeoutMs >= 0 ? &ts : nullptr, nullptr, 0);
+    }
+
+    static void futexWake(std::atomic<uint32_t>* word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX,
+                nullptr, nullptr, 0);
+    }
+
+    void map(int fd, size_t capacity, bool init) {
+        mappedBytes = sizeof(Header) + capacity;
+        void* mem = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE,
+                         fd < 0 ? (MAP_SHARED | MAP_ANONYMOUS) : MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) throw std::runtime_error("ShmRing: mmap failed");
+        hdr = static_cast<Header*>(mem);
+        data = static_cast<char*>(mem) + sizeof(Header);
+        if (init) {
+            new (hdr) Header();
+            hdr->capacity = capacity;
+        }
+    }
+
+public:
+    // capacity em bytes, potência de 2
+    explicit ShmRing(size_t capacity = 1 << 20) { map(-1, capacity, true); }
+
+    // Ring nomeado para processos sem parentesco; 'create' inicializa o header
+    ShmRing(const std::string& name, size_t capacity, bool create) {
+        int fd = shm_open(name.c_str(), create ? (O_CREAT | O_RDWR) : O_RDWR, 0600);
+        if (fd < 0) throw std::runtime_error("ShmRing: shm_open failed for " + name);
+        if (create && ftruncate(fd, static_cast<off_t>(sizeof(Header) + capacity)) != 0) {
+            close(fd);
+            throw std::runtime_error("ShmRing: ftruncate failed for " + name);
+        }
+        map(fd, capacity, create);
+        close(fd);
+    }
+
+    ~ShmRing() {
+        if (hdr) munmap(hdr, mappedBytes);
+    }
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+private:
+    bool waitForSpace(uint64_t head, size_t total, int timeoutMs) {
+        const uint64_t cap = hdr->capacity;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        for (int spins = 0;; ++spins) {
+            cachedTail = hdr->tail.load(std::memory_order_acquire);
+            if (cap - (head - cachedTail) >= total) return true;
+            if (spins < SPIN_ITERATIONS) continue;
+            if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline) return false;
+            uint32_t seq = hdr->spaceSignal.load(std::memory_order_acquire);
+            hdr->producerWaiting.store(1, std::memory_order_seq_cst);
+            if (cap - (head - hdr->tail.load(std::memory_order_seq_cst)) < total) {
+                futexWait(&hdr->spaceSignal, seq, timeoutMs < 0 ? 100 : std::min(timeoutMs, 100));
+            }
+            hdr->producerWaiting.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    bool waitForData(uint64_t tail, int timeoutMs) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        for (int spins = 0;; ++spins) {
+            cachedHead = hdr->head.load(std::memory_order_acquire);
+            if (cachedHead > tail) return true;
+            if (spins < SPIN_ITERATIONS) continue;
+            if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline) return false;
+            uint32_t seq = hdr->dataSignal.load(std::memory_order_acquire);
+            hdr->consumerWaiting.store(1, std::memory_order_seq_cst);
+            if (hdr->head.load(std::memory_order_seq_cst) == tail) {
+                futexWait(&hdr->dataSignal, seq, timeoutMs < 0 ? 100 : std::min(timeoutMs, 100));
+            }
+            hdr->consumerWaiting.store(0, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    // Produtor: copia o registro para o ring; espera por espaço até timeoutMs
+    // (-1 = indefinidamente). false se o registro não coube a tempo.
+    bool push(const char* bytes, size_t len, int timeoutMs = -1) {
+        const uint64_t cap = hdr->capacity;
+        const size_t need = align8(sizeof(uint32_t) + len);
+        if (need + sizeof(uint32_t) > cap / 2) throw std::runtime_error("ShmRing: record too large");
+
+        uint64_t head = hdr->head.load(std::memory_order_relaxed);
+        size_t offset = head & (cap - 1);
+        size_t contiguous = cap - offset;
+        size_t total = need <= contiguous ? need : contiguous + need;  // inclui salto do wrap
+
+        if (cap - (head - cachedTail) < total && !waitForSpace(head, total, timeoutMs)) return false;
+
+        if (need > contiguous) {
+            std::memcpy(data + offset, &WRAP, sizeof(uint32_t));
+            head += contiguous;
+            offset = 0;
+        }
+        uint32_t len32 = static_cast<uint32_t>(len);
+        std::memcpy(data + offset, &len32, sizeof(len32));
+        std::memcpy(data + offset + sizeof(len32), bytes, len);
+        hdr->head.store(head + need, std::memory_order_seq_cst);
+
+        if (hdr->consumerWaiting.load(std::memory_order_seq_cst)) {
+            hdr->dataSignal.fetch_add(1, std::memory_order_release);
+            futexWake(&hdr->dataSignal);
+        }
+        return true;
+    }
+
+    bool push(const std::string& record, int timeoutMs = -1) {
+        return push(record.data(), record.size(), timeoutMs);
+    }
+
+    // Consumidor: retira o próximo registro; espera até timeoutMs (-1 = sempre)
+    bool pop(std::string& out, int timeoutMs = -1) {
+        const uint64_t cap = hdr->capacity;
+        uint64_t tail = hdr->tail.load(std::memory_order_relaxed);
+        if (cachedHead <= tail && !waitForData(tail, timeoutMs)) return false;
+
+        size_t offset = tail & (cap - 1);
+        uint32_t len;
+        std::memcpy(&len, data + offset, sizeof(len));
+        if (len == WRAP) {
+            tail += cap - offset;
+            offset = 0;
+            std::memcpy(&len, data, sizeof(len));
+        }
+        out.assign(data + offset + sizeof(len), len);
+        hdr->tail.store(tail + align8(sizeof(len) + len), std::memory_order_seq_cst);
+
+        if (hdr->producerWaiting.load(std::memory_order_seq_cst)) {
+            hdr->spaceSignal.fetch_add(1, std::memory_order_release);
+            futexWake(&hdr->spaceSignal);
+        }
+        return true;
+    }
+
+    // Toca as páginas de dados a partir da thread atual (first-touch: ficam no
+    // nó NUMA dela); só antes do primeiro push
+    void prefault() { std::memset(data, 0, hdr->capacity); }
+
+    bool empty() const {
+        return hdr->head.load(std::memory_order_acquire) == hdr->tail.load(std::memory_order_acquire);
+    }
+
+    // Descarta registros pendentes (usado ao trocar o processo consumidor)
+    void reset() {
+        hdr->tail.store(hdr->head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+};
+
+// Mede a vazão do ring entre dois processos contra memcpy puro no mesmo buffer
+static void runShmRingBench(long messages, size_t payloadSize) {
+    ShmRing ring(1 << 22);
+    std::string payload(payloadSize, 'x');
+
+    pid_t child = fork();
+    if (child == 0) {
+        std::string out;
+        for (long i = 0; i < messages; ++i) ring.pop(out);
+        _exit(0);
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    for (long i = 0; i < messages; ++i) ring.push(payload);
+    waitpid(child, nullptr, 0);
+    double ringSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::vector<char> dst(payloadSize);
+    started = std::chrono::steady_clock::now();
+    for (long i = 0; i < messages; ++i) {
+        std::memcpy(dst.data(), payload.data(), payloadSize);
+        asm volatile("" : : "r"(dst.data()) : "memory");
+    }
+    double copySecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    double bytes = static_cast<double>(messages) * payloadSize;
+    std::cout << "[Middleware3][shm-bench] msgs=" << messages << " size=" << payloadSize
+              << " ring=" << messages / ringSecs << " msg/s (" << bytes / ringSecs / 1e9 << " GB/s)"
+              << " memcpy=" << bytes / copySecs / 1e9 << " GB/s" << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+// Internação de device_id: cada dispositivo recebe um inteiro denso na
+// entrada e as tabelas por dispositivo dos estágios viram arrays indexados
+// por ele. Consultas não bloqueiam; a inserção reserva o slot com CAS e
+// publica o id depois de gravar o nome (device_id tem no máximo 31 bytes).
+// ---------------------------------------------------------------------------
+
+static constexpr std::string_view DEVICE_ID_KEY = "\"device_id\"";
+
+// Posição do token "device_id" (com aspas). Com SSE2 testa 16 posições por
+// vez: aspas no início e '_' no deslocamento 7; só os candidatos vão ao memcmp
+static size_t findDeviceIdKey(std::string_view payload) {
+    const char* data = payload.data();
+    const size_t n = payload.size();
+    const size_t len = DEVICE_ID_KEY.size();
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i underscore = _mm_set1_epi8('_');
+    for (; i + 7 + 16 <= n; i += 16) {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i mid = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 7));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, quote), _mm_cmpeq_epi8(mid, underscore))));
+        while (mask) {
+            size_t pos = i + static_cast<size_t>(__builtin_ctz(mask));
+            if (pos + len <= n && std::memcmp(data + pos, DEVICE_ID_KEY.data(), len) == 0) return pos;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + len <= n; ++i) {
+        if (data[i] == '"' && std::memcmp(data + i, DEVICE_ID_KEY.data(), len) == 0) return i;
+    }
+    return std::string_view::npos;
+}
+
+// Lê o valor de "device_id" direto do payload, sem montar o JSON
+static bool extractDeviceId(std::string_view payload, std::string_view& out) {
+    size_t p = findDeviceIdKey(payload);
+    if (p == std::string_view::npos) return false;
+    p += DEVICE_ID_KEY.size();
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != ':') return false;
+    ++p;
+    while (p < payload.size() && std::isspace(static_cast<unsigned char>(payload[p]))) ++p;
+    if (p >= payload.size() || payload[p] != '"') return false;
+    size_t end = payload.find('"', ++p);
+    if (end == std::string_view::npos) return false;
+    out = payload.substr(p, end - p);
+    return true;
+}
+
+// Chave de partição sem parse: o nível do tópico em iot/<device_id>/input ou,
+// nos demais tópicos, o device_id lido direto do payload
+static bool partitionKey(std::string_view topic, std::string_view payload, std::string_view& out) {
+    static constexpr std::string_view PREFIX = "iot/";
+    static constexpr std::string_view SUFFIX = "/input";
+    if (topic.size() > PREFIX.size() + SUFFIX.size() && topic.compare(0, PREFIX.size(), PREFIX) == 0 &&
+        topic.compare(topic.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX) == 0) {
+        std::string_view level = topic.substr(PREFIX.size(), topic.size() - PREFIX.size() - SUFFIX.size());
+        if (level.find('/') == std::string_view::npos) {
+            out = level;
+            return true;
+        }
+    }
+    return extractDeviceId(payload, out);
+}
+
+class DeviceInterner {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+private:
+    static constexpr uint32_t EMPTY = 0;
+    static constexpr uint32_t BUSY = UINT32_MAX;  // slot reservado, id ainda não publicado
+    struct Name {
+        char bytes[32];
+        uint8_t length;
+    };
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<std::atomic<uint32_t>[]> slots;  // id + 1; tabela com o dobro da capacidade
+    std::unique_ptr<uint64_t[]> hashes;              // por id
+    std::unique_ptr<Name[]> names;                   // por id
+    std::atomic<uint32_t> count{0};
+
+    static size_t tableSize(size_t maxDevices) {
+        size_t size = 2;
+        while (size < maxDevices * 2) size <<= 1;
+        return size;
+    }
+
+public:
+    explicit DeviceInterner(size_t maxDevices)
+        : capacity(std::max<size_t>(maxDevices, 1)), mask(tableSize(capacity) - 1),
+          slots(new std::atomic<uint32_t>[mask + 1]), hashes(new uint64_t[capacity]), names(new Name[capacity]) {
+        for (size_t i = 0; i <= mask; ++i) slots[i].store(EMPTY, std::memory_order_relaxed);
+    }
+
+    // Id denso do dispositivo, criado no primeiro uso; NONE se a tabela encheu
+    uint32_t intern(std::string_view id, uint64_t hash) {
+        if (id.empty() || id.size() >= sizeof(Name::bytes)) return NONE;
+        size_t i = hash & mask;
+        while (true) {
+            uint32_t v = slots[i].load(std::memory_order_acquire);
+            if (v == EMPTY) {
+                if (!slots[i].compare_exchange_strong(v, BUSY, std::memory_order_acq_rel)) continue;
+                uint32_t index = count.fetch_add(1, std::memory_order_relaxed);
+                if (index >= capacity) {
+                    count.fetch_sub(1, std::memory_order_relaxed);
+                    slots[i].store(EMPTY, std::memory_order_release);
+                    return NONE;
+                }
+                hashes[index] = hash;
+                std::memcpy(names[index].bytes, id.data(), id.size());
+                names[index].length = static_cast<uint8_t>(id.size());
+                slots[i].store(index + 1, std::memory_order_release);
+                return index;
+            }
+            if (v == BUSY) {
+                std::this_thread::yield();
+                continue;
+            }
+            uint32_t index = v - 1;
+            if (hashes[index] == hash && name(index) == id) return index;
+            i = (i + 1) & mask;
+        }
+    }
+
+    uint32_t intern(std::string_view id) { return intern(id, hashDeviceId(id)); }
+
+    // Atalho para estágios chamados sem o id da entrada
+    uint32_t internPayload(std::string_view payload) {
+        std::string_view id;
+        return extractDeviceId(payload, id) ? intern(id) : NONE;
+    }
+
+    std::string_view name(uint32_t index) const {
+        return std::string_view(names[index].bytes, names[index].length);
+    }
+
+    size_t size() const { return std::min<size_t>(count.load(std::memory_order_relaxed), capacity); }
+};
+
+// Custo por mensagem de três tabelas por dispositivo: cada estágio extraindo
+// o device_id e consultando seu mapa por string (caminho anterior) vs o id
+// internado uma vez na entrada indexando arrays planos
+static void runInternBench(long messages) {
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 4096; ++i) {
+        payloads.push_back("{\"seq\": " + std::to_string(i) + ", \"device_id\": \"device_" +
+                           std::to_string(i * 7919 % 1000) + "\", \"temperature\": 24.5, \"status\": \"normal\"}");
+    }
+    constexpr int TABLES = 3;
+    uint64_t checksum = 0;
+
+    std::unordered_map<std::string, uint64_t> maps[TABLES];
+    auto started = std::chrono::steady_clock::now();
+    for (long i = 0; i < messages; ++i) {
+        const std::string& payload = payloads[i % payloads.size()];
+        for (auto& table : maps) {
+            std::string_view id;
+            if (extractDeviceId(payload, id)) checksum += ++table[std::string(id)];
+        }
+    }
+    double stringNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+
+    DeviceInterner interner(4096);
+    std::vector<uint64_t> arrays[TABLES];
+    started = std::chrono::steady_clock::now();
+    for (long i = 0; i < messages; ++i) {
+        uint32_t device = interner.internPayload(payloads[i % payloads.size()]);
+        if (device == DeviceInterner::NONE) continue;
+        for (auto& table : arrays) {
+            if (device >= table.size()) table.resize(device + 1);
+            checksum -= ++table[device];
+        }
+    }
+    double internNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+
+    std::cout << "[Middleware3][intern-bench] devices=" << interner.size() << " tables=" << TABLES
+              << " string=" << stringNanos / messages << "ns/msg interned=" << internNanos / messages
+              << "ns/msg speedup=" << stringNanos / internNanos << "x" << (checksum ? " MISMATCH" : "") << std::endl;
+}
+
+// Custo de obter a chave de partição: nível do tópico, varredura SIMD do
+// payload, busca escalar e parse completo com o nlohmann
+static void runPartitionBench(long messages) {
+    std::vector<std::string> payloads;
+    std::vector<std::string> topics;
+    for (int i = 0; i < 1024; ++i) {
+        std::string device = "device_" + std::to_string(i % 100);
+        payloads.push_back("{\"seq\": " + std::to_string(i) + ", \"timestamp\": \"2024-01-01T12:00:00.000000+00:00\", "
+                           "\"temperature\": 24.5, \"humidity\": 55.1, \"status\": \"normal\", \"device_id\": \"" +
+                           device + "\"}");
+        topics.push_back("iot/" + device + "/input");
+    }
+    size_t checksum = 0;
+    auto measure = [&](const char* label, auto&& key) {
+        auto started = std::chrono::steady_clock::now();
+        for (long i = 0; i < messages; ++i) checksum += key(static_cast<size_t>(i) % payloads.size());
+        double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "[Middleware3][partition-bench] " << label << "=" << nanos / messages << "ns/msg" << std::endl;
+    };
+    measure("topic", [&](size_t i) {
+        std::string_view id;
+        return partitionKey(topics[i], payloads[i], id) ? id.size() : 0;
+    });
+    measure("payload_scan", [&](size_t i) {
+        std::string_view id;
+        return partitionKey("iot/input", payloads[i], id) ? id.size() : 0;
+    });
+    measure("string_find", [&](size_t i) {
+        return std::string_view(payloads[i]).find(DEVICE_ID_KEY);
+    });
+    measure("full_parse", [&](size_t i) {
+        return json::parse(payloads[i])["device_id"].get_ref<const std::string&>().size();
+    });
+    if (checksum == 0) std::cout << "[Middleware3][partition-bench] no keys found" << std::endl;
+}
+
+// Nível 'n' (base 0) do tópico, sem alocar
+static bool topicLevel(std::string_view topic, size_t n, std::string_view& out) {
+    size_t start = 0;
+    for (size_t i = 0; i < n; ++i) {
+        start = topic.find('/', start);
+        if (start == std::string_view::npos) return false;
+        ++start;
+    }
+    size_t end = topic.find('/', start);
+    out = topic.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+    return !out.empty();
+}
+
+// Opções por rota; o casamento dos filtros fica na TopicTrie (topic_trie.h)
+struct TopicRoute {
+    std::string pattern;
+    long keyLevel = -1;               // nível do tópico com o device_id; -1: partitionKey()
+    std::vector<std::string> stages;  // vazio: pipeline inteiro
+    long lane = -1;                   // lane fixa; -1: escolhida pela chave
+};
+
+// TOPIC_ROUTES="filtro[,key=N][,stages=a+b][,lane=N];..." - os filtros são
+// também as assinaturas; o primeiro filtro idêntico prevalece
+static std::vector<TopicRoute> parseTopicRoutes(const std::string& spec) {
+    std::vector<TopicRoute> routes;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+        std::stringstream fields(item);
+        std::string field;
+        TopicRoute route;
+        while (std::getline(fields, field, ',')) {
+            auto eq = field.find('=');
+            if (route.pattern.empty() && eq == std::string::npos) {
+                route.pattern = field;
+                continue;
+            }
+            std::string key = field.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : field.substr(eq + 1);
+            if (key == "key") {
+                route.keyLevel = std::atol(value.c_str());
+            } else if (key == "lane") {
+                route.lane = std::atol(value.c_str());
+            } else if (key == "stages") {
+                std::stringstream names(value);
+                std::string name;
+                while (std::getline(names, name, '+')) {
+                    if (!name.empty()) route.stages.push_back(name);
+                }
+            } else {
+                std::cerr << "[Middleware3] Unknown route option '" << key << "' in '" << item << "'" << std::endl;
+            }
+        }
+        if (!route.pattern.empty()) routes.push_back(std::move(route));
+    }
+    if (routes.empty()) {
+        TopicRoute fallback;
+        fallback.pattern = "iot/input";
+        routes.push_back(fallback);
+    }
+    return routes;
+}
+
+// Filtro MQTT avaliado nível a nível; base de comparação da trie
+static bool topicMatchesFilter(std::string_view filter, std::string_view topic) {
+    while (true) {
+        size_t fs = filter.find('/');
+        size_t ts = topic.find('/');
+        std::string_view f = filter.substr(0, fs);
+        if (f == "#") return true;
+        if (f != "+" && f != topic.substr(0, ts)) return false;
+        if (fs == std::string_view::npos || ts == std::string_view::npos) {
+            return fs == ts || filter.substr(fs + 1) == "#";
+        }
+        filter.remove_prefix(fs + 1);
+        topic.remove_prefix(ts + 1);
+    }
+}
+
+// Custo do match com a quantidade de padrões: a trie deve ficar constante e a
+// varredura linear dos filtros crescer junto
+static void runTopicMatchBench(long matches) {
+    for (size_t patterns : {16, 1024, 16384}) {
+        TopicTrie trie;
+        std::vector<std::string> filters;
+        for (size_t i = 0; i < patterns; ++i) {
+            std::string site = "iot/site_" + std::to_string(i / 4);
+            switch (i % 4) {
+                case 0: filters.push_back(site + "/device_" + std::to_string(i) + "/input"); break;
+                case 1: filters.push_back(site + "/+/input"); break;
+                case 2: filters.push_back(site + "/+/status"); break;
+                default: filters.push_back(site + "/#"); break;
+            }
+            trie.add(filters.back(), static_cast<int>(i));
+        }
+        std::vector<std::string> topics;
+        for (size_t i = 0; i < 1024; ++i) {
+            size_t site = (i * 7919) % (patterns / 4);
+            topics.push_back("iot/site_" + std::to_string(site) + "/device_" + std::to_string(i % 97) +
+                             (i % 3 ? "/input" : "/config"));
+        }
+        long checksum = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (long i = 0; i < matches; ++i) checksum += trie.match(topics[static_cast<size_t>(i) % topics.size()]);
+        double trieNanos =
+            std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / matches;
+
+        long linearMatches = std::max<long>(1000, matches / static_cast<long>(patterns));
+        started = std::chrono::steady_clock::now();
+        for (long i = 0; i < linearMatches; ++i) {
+            const std::string& topic = topics[static_cast<size_t>(i) % topics.size()];
+            for (size_t p = 0; p < filters.size(); ++p) {
+                if (topicMatchesFilter(filters[p], topic)) {
+                    checksum += static_cast<long>(p);
+                    break;
+                }
+            }
+        }
+        double linearNanos =
+            std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() / linearMatches;
+        std::cout << "[Middleware3][topic-bench] patterns=" << patterns << " trie=" << trieNanos
+                  << "ns/match linear=" << linearNanos << "ns/match" << (checksum ? "" : " (no matches)") << std::endl;
+    }
+}
+
+class PipelineStage {
+private:
+    std::chrono::microseconds maxDuration = Deadline::NO_BUDGET;
+
+public:
+    virtual ~PipelineStage() = default;
+    virtual const char* name() const = 0;
+    // Saída vazia significa que o estágio reteve a mensagem (filtro/agregação)
+    virtual std::string process(const std::string& input) = 0;
+    // Estágios que verificam o prazo cooperativamente sobrescrevem esta variante
+    virtual std::string process(const std::string& input, const Deadline& deadline) {
+        (void)deadline;
+        return process(input);
+    }
+    // Variante com o dispositivo internado na entrada (DeviceInterner::NONE se ausente);
+    // estágios com estado por dispositivo indexam arrays por ele
+    virtual std::string process(const std::string& input, const Deadline& deadline, uint32_t device) {
+        (void)device;
+        return process(input, deadline);
+    }
+    virtual bool isHealthy() const { return true; }
+
+    // Tempo máximo configurado para uma chamada de process()
+    std::chrono::microseconds budget() const { return maxDuration; }
+    void setBudget(std::chrono::microseconds limit) { maxDuration = limit; }
+    // Chamado pelo Supervisor ao reiniciar o estágio
+    virtual void restart() {}
+    // Restrições de ordem: nomes dos estágios que precisam rodar antes deste.
+    // Os demais pares são considerados comutativos e podem ser reordenados.
+    virtual std::vector<std::string> runsAfter() const { return {}; }
+    // Chamado periodicamente pela thread principal (recarga, timers)
+    virtual void onTick(std::chrono::steady_clock::time_point now) { (void)now; }
+    // Chamado uma vez depois da partida (primeira mensagem ou 1 s sem tráfego):
+    // preparação que a primeira mensagem não precisa esperar
+    virtual void warmUp() {}
+};
+
+class ValidationStage : public PipelineStage {
+public:
+    const char* name() const override { return "validation"; }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    // Validador compilado do schema: uma passada sobre os bytes, sem DOM
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        const char* error = nullptr;
+        if (!reading_schema::validate(input, &error)) {
+            throw std::runtime_error(std::string("Invalid message format: ") + error);
+        }
+        deadline.check(name());
+        return input;
+    }
+};
+
+// Mesma regra do schema aplicada sobre o DOM do nlohmann; referência do benchmark
+static bool validateWithDom(const std::string& input) {
+    json j = json::parse(input, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) return false;
+    auto seq = j.find("seq");
+    if (seq == j.end() || !seq->is_number_integer() || seq->get<long long>() < 0) return false;
+    auto device = j.find("device_id");
+    if (device == j.end() || !device->is_string()) return false;
+    size_t deviceLen = device->get_ref<const std::string&>().size();
+    if (deviceLen < 1 || deviceLen > 31) return false;
+    auto timestamp = j.find("timestamp");
+    if (timestamp == j.end() || !timestamp->is_string()) return false;
+    size_t timestampLen = timestamp->get_ref<const std::string&>().size();
+    if (timestampLen < 10 || timestampLen > 40) return false;
+    auto temperature = j.find("temperature");
+    if (temperature == j.end() || !temperature->is_number()) return false;
+    double t = temperature->get<double>();
+    if (t < -40.0 || t > 125.0) return false;
+    auto humidity = j.find("humidity");
+    if (humidity != j.end()) {
+        if (!humidity->is_number()) return false;
+        double h = humidity->get<double>();
+        if (h < 0.0 || h > 100.0) return false;
+    }
+    auto status = j.find("status");
+    if (status == j.end() || !status->is_string()) return false;
+    const auto& s = status->get_ref<const std::string&>();
+    return s == "normal" || s == "warning" || s == "error" || s == "forced_error";
+}
+
+// Compara o validador gerado com a validação via DOM, separando o caminho
+// aceito do caminho de rejeição (campo ausente, fora de faixa, enum inválido)
+static void runValidatorBench(long messages) {
+    const std::vector<std::pair<const char*, std::string>> cases = {
+        {"valid", R"({"seq": 42, "device_id": "device_17", "timestamp": "2024-01-01T12:00:00.000000", "temperature": 24.37, "humidity": 55.1, "status": "normal"})"},
+        {"missing", R"({"seq": 42, "device_id": "device_17", "timestamp": "2024-01-01T12:00:00.000000", "humidity": 55.1, "status": "normal"})"},
+        {"range", R"({"seq": 42, "device_id": "device_17", "timestamp": "2024-01-01T12:00:00.000000", "temperature": 240.5, "humidity": 55.1, "status": "normal"})"},
+        {"enum", R"({"seq": 42, "device_id": "device_17", "timestamp": "2024-01-01T12:00:00.000000", "temperature": 24.37, "humidity": 55.1, "status": "broken"})"},
+    };
+    for (const auto& [label, payload] : cases) {
+        long compiledOk = 0;
+        long domOk = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (long i = 0; i < messages; ++i) compiledOk += reading_schema::validate(payload);
+        double compiledNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+        started = std::chrono::steady_clock::now();
+        for (long i = 0; i < messages; ++i) domOk += validateWithDom(payload);
+        double domNanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "[Middleware3][validator-bench] case=" << label
+                  << " compiled=" << compiledNanos / messages << "ns"
+                  << " dom=" << domNanos / messages << "ns"
+                  << " speedup=" << domNanos / compiledNanos << "x"
+                  << " accepted=" << compiledOk << "/" << domOk << std::endl;
+    }
+}
+
+class TransformationStage : public PipelineStage {
+private:
+    bool simulatedFailure = false;
+public:
+    const char* name() const override { return "transformation"; }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        if (simulatedFailure) {
+            throw std::runtime_error("Simulated transformation failure");
+        }
+        auto j = json::parse(input);
+        deadline.check(name());
+        j["processed"] = true;
+        j["server_timestamp"] = time(nullptr);
+        return j.dump();
+    }
+
+    bool isHealthy() const override {
+        static int counter = 0;
+        if (++counter % 5 == 0) {
+            return false;
+        }
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Enriquecimento por metadados do dispositivo. O registro é um arquivo
+// binário mapeado com mmap: header + registros de 64 bytes ordenados por
+// device_id (busca binária). Um cache LRU por thread guarda os mais quentes;
+// o recarregamento troca o registro inteiro atomicamente.
+// ---------------------------------------------------------------------------
+
+struct DeviceRecord {
+    char deviceId[32];
+    char site[20];
+    char unit[8];
+    float calibrationOffset;
+};
+static_assert(sizeof(DeviceRecord) == 64, "registro do arquivo tem 64 bytes");
+
+struct DeviceInfo {
+    char site[sizeof(DeviceRecord::site) + 1];
+    char unit[sizeof(DeviceRecord::unit) + 1];
+    float calibrationOffset;
+};
+
+class DeviceRegistry {
+private:
+    struct FileHeader {
+        char magic[4];  // "DREG"
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    void* mapping = nullptr;
+    size_t mappedBytes = 0;
+    const DeviceRecord* records = nullptr;
+    uint32_t count = 0;
+
+    static std::string_view field(const char* bytes, size_t max) {
+        return std::string_view(bytes, strnlen(bytes, max));
+    }
+
+public:
+    const uint64_t generation;
+
+    DeviceRegistry(const std::string& path, uint64_t gen) : generation(gen) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("DeviceRegistry: cannot open " + path);
+        struct stat st{};
+        fstat(fd, &st);
+        mappedBytes = static_cast<size_t>(st.st_size);
+        if (mappedBytes < sizeof(FileHeader)) {
+            close(fd);
+            throw std::runtime_error("DeviceRegistry: truncated file " + path);
+        }
+        mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) throw std::runtime_error("DeviceRegistry: mmap failed for " + path);
+
+        const auto* header = static_cast<const FileHeader*>(mapping);
+        if (std::memcmp(header->magic, "DREG", 4) != 0 || header->version != 1 ||
+            sizeof(FileHeader) + size_t(header->count) * sizeof(DeviceRecord) > mappedBytes) {
+            munmap(mapping, mappedBytes);
+            throw std::runtime_error("DeviceRegistry: invalid registry " + path);
+        }
+        count = header->count;
+        records = reinterpret_cast<const DeviceRecord*>(static_cast<const char*>(mapping) + sizeof(FileHeader));
+        madvise(mapping, mappedBytes, MADV_WILLNEED);
+    }
+
+    ~DeviceRegistry() {
+        if (mapping) munmap(mapping, mappedBytes);
+    }
+
+    DeviceRegistry(const DeviceRegistry&) = delete;
+    DeviceRegistry& operator=(const DeviceRegistry&) = delete;
+
+    uint32_t size() const { return count; }
+
+    const DeviceRecord* find(std::string_view deviceId) const {
+        const DeviceRecord* first = records;
+        const DeviceRecord* last = records + count;
+        while (first < last) {
+            const DeviceRecord* mid = first + (last - first) / 2;
+            if (field(mid->deviceId, sizeof(mid->deviceId)) < deviceId) first = mid + 1;
+            else last = mid;
+        }
+        if (first != records + count && field(first->deviceId, sizeof(first->deviceId)) == deviceId) {
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+class EnrichmentStage : public PipelineStage {
+private:
+    // Cache associativo por thread (16 conjuntos x 4 vias), LRU dentro do conjunto
+    struct HotCache {
+        static constexpr size_t SETS = 16;
+        static constexpr size_t WAYS = 4;
+        struct Slot {
+            uint64_t hash;
+            const DeviceRecord* record;
+            uint32_t lastUse;
+        };
+        uint64_t generation = 0;
+        uint32_t clock = 0;
+        Slot slots[SETS][WAYS] = {};
+    };
+
+    const std::string path;
+    std::shared_ptr<const DeviceRegistry> registry;
+    // Global ao processo: o cache por thread é indexado só pela geração, então
+    // dois estágios (ou o bench) nunca podem repetir o mesmo número
+    static inline std::atomic<uint64_t> nextGeneration{1};
+    int64_t loadedMtimeNs = 0;
+    std::chrono::steady_clock::time_point lastReloadCheck{};
+
+    static uint64_t hashOf(std::string_view id) {
+        uint64_t h = 1469598103934665603ull;  // FNV-1a
+        for (unsigned char c : id) h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
+
+    static const DeviceRecord* cachedFind(const DeviceRegistry& reg, std::string_view id) {
+        static thread_local HotCache cache;
+        if (cache.generation != reg.generation) {
+            cache = HotCache();
+            cache.generation = reg.generation;
+        }
+        uint64_t h = hashOf(id);
+        auto& set = cache.slots[h % HotCache::SETS];
+        ++cache.clock;
+        size_t victim = 0;
+        for (size_t w = 0; w < HotCache::WAYS; ++w) {
+            auto& slot = set[w];
+            if (slot.record && slot.hash == h &&
+                std::string_view(slot.record->deviceId, strnlen(slot.record->deviceId, 32)) == id) {
+                slot.lastUse = cache.clock;
+                return slot.record;
+            }
+            if (slot.lastUse < set[victim].lastUse) victim = w;
+        }
+        const DeviceRecord* found = reg.find(id);
+        if (found) set[victim] = {h, found, cache.clock};
+        return found;
+    }
+
+public:
+    explicit EnrichmentStage(const std::string& registryPath) : path(registryPath) {
+        reload();
+    }
+
+    const char* name() const override { return "enrichment"; }
+
+    std::vector<std::string> runsAfter() const override { return {"validation"}; }
+
+    // Sem alocação: copia os campos para 'out' enquanto mantém o registro vivo
+    bool lookup(std::string_view deviceId, DeviceInfo& out) const {
+        auto reg = std::atomic_load(&registry);
+        if (!reg) return false;
+        const DeviceRecord* rec = cachedFind(*reg, deviceId);
+        if (!rec) return false;
+        std::memcpy(out.site, rec->site, sizeof(rec->site));
+        out.site[sizeof(rec->site)] = '\0';
+        std::memcpy(out.unit, rec->unit, sizeof(rec->unit));
+        out.unit[sizeof(rec->unit)] = '\0';
+        out.calibrationOffset = rec->calibrationOffset;
+        return true;
+    }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        auto j = json::parse(input);
+        deadline.check(name());
+        DeviceInfo info;
+        if (!j.contains("device_id") || !j["device_id"].is_string() ||
+            !lookup(j["device_id"].get_ref<const std::string&>(), info)) {
+            return input;  // dispositivo desconhecido segue sem enriquecimento
+        }
+        j["site"] = info.site;
+        j["unit"] = info.unit;
+        if (j.contains("temperature") && j["temperature"].is_number()) {
+            j["temperature_raw"] = j["temperature"];
+            double calibrated = j["temperature"].get<double>() + info.calibrationOffset;
+            j["temperature"] = std::round(calibrated * 1000.0) / 1000.0;
+        }
+        return j.dump();
+    }
+
+    // Recarrega se o arquivo mudou; a troca é atômica para leitores em voo
+    void reload() {
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0) return;
+        int64_t mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        if (mtimeNs == loadedMtimeNs) return;
+        try {
+            auto fresh = std::make_shared<const DeviceRegistry>(path, nextGeneration++);
+            std::atomic_store(&registry, fresh);
+            loadedMtimeNs = mtimeNs;
+            std::cout << "[Middleware3] Device registry loaded: " << fresh->size()
+                      << " devices from " << path << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Device registry reload failed: " << e.what() << std::endl;
+        }
+    }
+
+    void onTick(std::chrono::steady_clock::time_point now) override {
+        if (now - lastReloadCheck < std::chrono::seconds(5)) return;
+        lastReloadCheck = now;
+        reload();
+    }
+};
+
+// Custo médio de lookup (cache quente e frio) para validar o orçamento de < 1 µs
+static void runRegistryBench(const std::string& path, long lookups) {
+    EnrichmentStage stage(path);
+    std::vector<std::string> ids;
+    for (int i = 1; i <= 100; ++i) ids.push_back("device_" + std::to_string(i));
+    DeviceInfo info;
+    long hits = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (long i = 0; i < lookups; ++i) hits += stage.lookup(ids[i % ids.size()], info);
+    double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "[Middleware3][registry-bench] lookups=" << lookups << " hits=" << hits
+              << " avg=" << nanos / lookups << "ns" << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+// Motor de regras (RULES_PATH): uma regra por linha, "nome: expressão -> tópico".
+// As expressões são compiladas numa árvore de closures que avalia um lote
+// inteiro por nó, coluna a coluna; os campos citados por todas as regras são
+// extraídos uma única vez por mensagem. O arquivo é recarregado sem restart.
+// ---------------------------------------------------------------------------
+
+enum FieldKind : uint8_t { FieldMissing = 0, FieldNumber, FieldString };
+
+// Valores extraídos de um lote, em colunas [slot * rows + row]
+struct RuleBatch {
+    size_t rows = 0;
+    std::vector<uint8_t> kinds;
+    std::vector<double> numbers;
+    std::vector<std::string_view> strings;  // apontam para os payloads do lote
+    std::vector<uint8_t> scratch;           // resultados intermediários, um por profundidade
+    std::vector<uint8_t> column;
+    std::vector<uint64_t> masks;            // bit i = regra i satisfeita
+
+    uint8_t* scratchAt(size_t depth) { return scratch.data() + depth * rows; }
+};
+
+class RuleSet {
+public:
+    struct Rule {
+        std::string name;
+        std::string topic;
+    };
+    using Node = std::function<void(RuleBatch&, uint8_t*)>;
+    static constexpr size_t MAX_RULES = 64;
+
+    static std::shared_ptr<const RuleSet> compile(std::istream& in) {
+        auto set = std::make_shared<RuleSet>();
+        std::string line;
+        size_t lineNo = 0;
+        while (std::getline(in, line)) {
+            ++lineNo;
+            std::string text = trim(line);
+            if (text.empty() || text[0] == '#') continue;
+            try {
+                auto colon = text.find(':');
+                if (colon == std::string::npos) throw std::runtime_error("expected 'name: expression'");
+                Rule rule;
+                rule.name = trim(text.substr(0, colon));
+                if (rule.name.empty() || !std::all_of(rule.name.begin(), rule.name.end(), [](char c) {
+                        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+                    })) {
+                    throw std::runtime_error("invalid rule name '" + rule.name + "'");
+                }
+                std::string expression = text.substr(colon + 1);
+                auto arrow = expression.rfind("->");
+                if (arrow != std::string::npos) {
+                    rule.topic = trim(expression.substr(arrow + 2));
+                    expression = expression.substr(0, arrow);
+                }
+                if (rule.topic.empty()) rule.topic = "iot/rules/" + rule.name;
+                if (set->rules.size() == MAX_RULES) throw std::runtime_error("too many rules");
+                set->roots.push_back(Parser(expression, *set).parse());
+                set->rules.push_back(std::move(rule));
+            } catch (const std::exception& e) {
+                throw std::runtime_error("rules line " + std::to_string(lineNo) + ": " + e.what());
+            }
+        }
+        return set;
+    }
+
+    size_t size() const { return rules.size(); }
+    const Rule& rule(size_t i) const { return rules[i]; }
+
+    // Dimensiona o lote; reaproveita a capacidade, sem alocar no regime
+    void prepare(RuleBatch& batch, size_t rows) const {
+        batch.rows = rows;
+        batch.kinds.assign(fields.size() * rows, FieldMissing);
+        batch.numbers.resize(fields.size() * rows);
+        batch.strings.resize(fields.size() * rows);
+        batch.scratch.resize(maxDepth * rows);
+        batch.column.resize(rows);
+        batch.masks.assign(rows, 0);
+    }
+
+    // Uma passada sobre o JSON cru; só os campos usados por alguma regra são lidos
+    void extract(std::string_view payload, RuleBatch& batch, size_t row) const {
+        namespace scan = reading_schema::detail;
+        scan::Cursor c{payload.data(), payload.data() + payload.size()};
+        if (!scan::lit(c, '{') || scan::lit(c, '}')) return;
+        do {
+            std::string_view key;
+            if (!scan::str(c, key) || !scan::lit(c, ':')) return;
+            scan::ws(c);
+            size_t slot = slotOf(key);
+            if (slot == fields.size() || c.p == c.end) {
+                if (!scan::skipValue(c, 0)) return;
+                continue;
+            }
+            size_t at = slot * batch.rows + row;
+            char ch = *c.p;
+            if (ch == '"') {
+                if (!scan::str(c, batch.strings[at])) return;
+                batch.kinds[at] = FieldString;
+            } else if (ch == 't' || ch == 'f') {
+                if (!scan::boolean(c)) return;
+                batch.numbers[at] = ch == 't' ? 1.0 : 0.0;
+                batch.kinds[at] = FieldNumber;
+            } else if (ch == '-' || (ch >= '0' && ch <= '9')) {
+                bool integral;
+                if (!scan::num(c, batch.numbers[at], integral)) return;
+                batch.kinds[at] = FieldNumber;
+            } else if (!scan::skipValue(c, 0)) {
+                return;
+            }
+        } while (scan::lit(c, ','));
+    }
+
+    void evaluate(RuleBatch& batch) const {
+        uint8_t* column = batch.column.data();
+        for (size_t i = 0; i < roots.size(); ++i) {
+            roots[i](batch, column);
+            for (size_t r = 0; r < batch.rows; ++r) batch.masks[r] |= uint64_t(column[r]) << i;
+        }
+    }
+
+private:
+    std::vector<Rule> rules;
+    std::vector<Node> roots;
+    std::vector<std::string> fields;  // slot -> nome do campo, compartilhado entre regras
+    size_t maxDepth = 0;
+
+    static std::string trim(const std::string& s) {
+        auto first = s.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) return "";
+        return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+    }
+
+    size_t slotOf(std::string_view key) const {
+        size_t slot = 0;
+        while (slot < fields.size() && fields[slot] != key) ++slot;
+        return slot;
+    }
+
+    size_t internField(const std::string& name) {
+        size_t slot = slotOf(name);
+        if (slot == fields.size()) fields.push_back(name);
+        return slot;
+    }
+
+    template <typename Cmp>
+    static Node numberLeaf(size_t slot, double constant, Cmp cmp) {
+        return [slot, constant, cmp](RuleBatch& b, uint8_t* out) {
+            const uint8_t* kinds = b.kinds.data() + slot * b.rows;
+            const double* values = b.numbers.data() + slot * b.rows;
+            for (size_t r = 0; r < b.rows; ++r) {
+                out[r] = static_cast<uint8_t>((kinds[r] == FieldNumber) & cmp(values[r], constant));
+            }
+        };
+    }
+
+    static Node stringLeaf(size_t slot, std::string constant, bool equal) {
+        return [slot, constant = std::move(constant), equal](RuleBatch& b, uint8_t* out) {
+            const uint8_t* kinds = b.kinds.data() + slot * b.rows;
+            const std::string_view* values = b.strings.data() + slot * b.rows;
+            for (size_t r = 0; r < b.rows; ++r) {
+                out[r] = static_cast<uint8_t>(kinds[r] == FieldString && (values[r] == constant) == equal);
+            }
+        };
+    }
+
+    // Descida recursiva: or -> and -> unário -> comparação. Cada combinador
+    // usa a área temporária da sua profundidade para o operando da direita.
+    class Parser {
+    public:
+        Parser(const std::string& text, RuleSet& set) : text(text), set(set) {}
+
+        Node parse() {
+            Node root = parseOr(0);
+            skipWs();
+            if (pos != text.size()) throw std::runtime_error("unexpected '" + text.substr(pos) + "'");
+            return root;
+        }
+
+    private:
+        const std::string& text;
+        RuleSet& set;
+        size_t pos = 0;
+
+        void skipWs() {
+            while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+        }
+
+        bool accept(const char* token) {
+            skipWs();
+            size_t len = std::strlen(token);
+            if (text.compare(pos, len, token) != 0) return false;
+            pos += len;
+            return true;
+        }
+
+        Node parseOr(size_t depth) {
+            Node left = parseAnd(depth);
+            while (accept("||")) {
+                Node right = parseAnd(depth + 1);
+                set.maxDepth = std::max(set.maxDepth, depth + 1);
+                left = [left = std::move(left), right = std::move(right), depth](RuleBatch& b, uint8_t* out) {
+                    left(b, out);
+                    if (std::all_of(out, out + b.rows, [](uint8_t v) { return v != 0; })) return;
+                    uint8_t* rhs = b.scratchAt(depth);
+                    right(b, rhs);
+                    for (size_t r = 0; r < b.rows; ++r) out[r] |= rhs[r];
+                };
+            }
+            return left;
+        }
+
+        Node parseAnd(size_t depth) {
+            Node left = parseUnary(depth);
+            while (accept("&&")) {
+                Node right = parseUnary(depth + 1);
+                set.maxDepth = std::max(set.maxDepth, depth + 1);
+                left = [left = std::move(left), right = std::move(right), depth](RuleBatch& b, uint8_t* out) {
+                    left(b, out);
+                    if (std::none_of(out, out + b.rows, [](uint8_t v) { return v != 0; })) return;
+                    uint8_t* rhs = b.scratchAt(depth);
+                    right(b, rhs);
+                    for (size_t r = 0; r < b.rows; ++r) out[r] &= rhs[r];
+                };
+            }
+            return left;
+        }
+
+        Node parseUnary(size_t depth) {
+            if (accept("!")) {
+                Node inner = parseUnary(depth);
+                return [inner = std::move(inner)](RuleBatch& b, uint8_t* out) {
+                    inner(b, out);
+                    for (size_t r = 0; r < b.rows; ++r) out[r] ^= 1;
+                };
+            }
+            if (accept("(")) {
+                Node inner = parseOr(depth);
+                if (!accept(")")) throw std::runtime_error("expected ')'");
+                return inner;
+            }
+            return parseComparison();
+        }
+
+        struct Operand {
+            enum { Field, Number, String } kind;
+            std::string text;
+            double number = 0.0;
+        };
+
+        Operand parseOperand() {
+            skipWs();
+            if (pos >= text.size()) throw std::runtime_error("unexpected end of expression");
+            char c = text[pos];
+            if (c == '"') {
+                auto close = text.find('"', pos + 1);
+                if (close == std::string::npos) throw std::runtime_error("unterminated string");
+                Operand op{Operand::String, text.substr(pos + 1, close - pos - 1)};
+                pos = close + 1;
+                return op;
+            }
+            if (c == '-' || c == '.' || std::isdigit(static_cast<unsigned char>(c))) {
+                const char* start = text.c_str() + pos;
+                char* end = nullptr;
+                double value = std::strtod(start, &end);
+                if (end == start) throw std::runtime_error("invalid number");
+                pos += static_cast<size_t>(end - start);
+                return {Operand::Number, "", value};
+            }
+            size_t start = pos;
+            while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_')) ++pos;
+            if (start == pos) throw std::runtime_error(std::string("unexpected '") + c + "'");
+            std::string word = text.substr(start, pos - start);
+            if (word == "true") return {Operand::Number, "", 1.0};
+            if (word == "false") return {Operand::Number, "", 0.0};
+            return {Operand::Field, word};
+        }
+
+        Node parseComparison() {
+            Operand lhs = parseOperand();
+            static const char* const ops[] = {">=", "<=", "==", "!=", ">", "<"};
+            std::string op;
+            for (const char* candidate : ops) {
+                if (accept(candidate)) {
+                    op = candidate;
+                    break;
+                }
+            }
+            if (op.empty()) {
+                // campo isolado ("flag" ou "!flag"): verdadeiro se numérico e diferente de zero
+                if (lhs.kind != Operand::Field) throw std::runtime_error("expected comparison operator");
+                return numberLeaf(set.internField(lhs.text), 0.0, std::not_equal_to<double>());
+            }
+            Operand rhs = parseOperand();
+            if (lhs.kind != Operand::Field) {
+                // constante à esquerda: inverte o operador
+                std::swap(lhs, rhs);
+                if (op[0] == '>') op[0] = '<';
+                else if (op[0] == '<') op[0] = '>';
+            }
+            if (lhs.kind != Operand::Field || rhs.kind == Operand::Field) {
+                throw std::runtime_error("comparison needs one field and one constant");
+            }
+            size_t slot = set.internField(lhs.text);
+            if (rhs.kind == Operand::String) {
+                if (op != "==" && op != "!=") throw std::runtime_error("strings support only == and !=");
+                return stringLeaf(slot, rhs.text, op == "==");
+            }
+            double k = rhs.number;
+            if (op == ">") return numberLeaf(slot, k, std::greater<double>());
+            if (op == ">=") return numberLeaf(slot, k, std::greater_equal<double>());
+            if (op == "<") return numberLeaf(slot, k, std::less<double>());
+            if (op == "<=") return numberLeaf(slot, k, std::less_equal<double>());
+            if (op == "==") return numberLeaf(slot, k, std::equal_to<double>());
+            return numberLeaf(slot, k, std::not_equal_to<double>());
+        }
+    };
+};
+
+class RuleStage : public PipelineStage {
+public:
+    using Emitter = std::function<void(const std::string& topic, const std::string& payload)>;
+
+private:
+    const std::string path;
+    Emitter emit;
+    std::shared_ptr<const RuleSet> rules;
+    int64_t loadedMtimeNs = 0;
+    std::chrono::steady_clock::time_point lastReloadCheck{};
+
+public:
+    RuleStage(const std::string& rulesPath, Emitter emitter) : path(rulesPath), emit(std::move(emitter)) {
+        reload();
+    }
+
+    const char* name() const override { return "rules"; }
+    // Regras enxergam a temperatura já calibrada quando há enriquecimento
+    std::vector<std::string> runsAfter() const override { return {"validation", "enrichment"}; }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    // Marca a mensagem com as regras satisfeitas ("rules": [...]) e publica
+    // uma cópia no tópico de cada regra
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        auto set = std::atomic_load(&rules);
+        if (!set || set->size() == 0) return input;
+        static thread_local RuleBatch batch;
+        set->prepare(batch, 1);
+        set->extract(input, batch, 0);
+        set->evaluate(batch);
+        deadline.check(name());
+        uint64_t matched = batch.masks[0];
+        auto close = input.rfind('}');
+        if (!matched || close == std::string::npos) return input;
+
+        std::string tagged = input.substr(0, close);
+        tagged += ",\"rules\":[";
+        bool first = true;
+        for (size_t i = 0; i < set->size(); ++i) {
+            if (!(matched >> i & 1)) continue;
+            tagged += first ? "\"" : ",\"";
+            tagged += set->rule(i).name;
+            tagged += '"';
+            first = false;
+        }
+        tagged += "]";
+        tagged.append(input, close, std::string::npos);
+        for (size_t i = 0; i < set->size(); ++i) {
+            if (matched >> i & 1) emit(set->rule(i).topic, tagged);
+        }
+        return tagged;
+    }
+
+    // Recompila se o arquivo mudou; regras inválidas mantêm o conjunto anterior
+    void reload() {
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0) return;
+        int64_t mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        if (mtimeNs == loadedMtimeNs) return;
+        loadedMtimeNs = mtimeNs;
+        try {
+            std::ifstream in(path);
+            auto fresh = RuleSet::compile(in);
+            std::atomic_store(&rules, fresh);
+            std::cout << "[Middleware3] Rules loaded: " << fresh->size() << " rules from " << path << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Rules reload failed: " << e.what() << std::endl;
+        }
+    }
+
+    void onTick(std::chrono::steady_clock::time_point now) override {
+        if (now - lastReloadCheck < std::chrono::seconds(5)) return;
+        lastReloadCheck = now;
+        reload();
+    }
+};
+
+// Avaliação mensagem a mensagem vs em lote sobre o mesmo conjunto de regras
+static void runRuleBench(const std::string& path, long messages) {
+    std::ifstream file(path);
+    std::istringstream builtin(
+        "hot: temperature > 28 && status != \"normal\"\n"
+        "cold: temperature < 21 || humidity > 75\n"
+        "faulty: status == \"error\" || status == \"forced_error\"\n"
+        "watch: (temperature >= 25 && humidity <= 50) || !(status == \"normal\")\n");
+    auto set = RuleSet::compile(file ? static_cast<std::istream&>(file) : builtin);
+
+    const char* statuses[] = {"normal", "warning", "error"};
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 256; ++i) {
+        payloads.push_back("{\"seq\": " + std::to_string(i) + ", \"device_id\": \"device_" + std::to_string(i % 100) +
+                           "\", \"timestamp\": \"2024-01-01T12:00:00\", \"temperature\": " + std::to_string(20 + i % 11) +
+                           ".5, \"humidity\": " + std::to_string(40 + i % 41) + ", \"status\": \"" + statuses[i % 3] + "\"}");
+    }
+    RuleBatch batch;
+    for (size_t batchSize : {size_t(1), size_t(64)}) {
+        uint64_t matches = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (long done = 0; done < messages; done += static_cast<long>(batchSize)) {
+            set->prepare(batch, batchSize);
+            for (size_t r = 0; r < batchSize; ++r) {
+                set->extract(payloads[(done + static_cast<long>(r)) % payloads.size()], batch, r);
+            }
+            set->evaluate(batch);
+            for (uint64_t mask : batch.masks) matches += static_cast<uint64_t>(__builtin_popcountll(mask));
+        }
+        double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "[Middleware3][rules-bench] rules=" << set->size() << " batch=" << batchSize
+                  << " avg=" << nanos / messages << "ns/msg matches=" << matches << std::endl;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Reordenação por tempo de evento (REORDER_LATENESS_MS): heap mínimo por
+// dispositivo chaveado em (timestamp, seq). Uma leitura sai quando a marca
+// d'água do dispositivo (maior timestamp visto - atraso tolerado) passa por
+// ela ou quando já esperou o atraso tolerado; chegadas anteriores à última
+// liberada são descartadas como atrasadas. As liberadas voltam ao pipeline
+// no estágio seguinte.
+// ---------------------------------------------------------------------------
+
+// "2024-01-01T12:00:00.123456+00:00" -> µs desde a época; o fuso é ignorado (sender usa UTC)
+static bool parseEventMicros(std::string_view ts, int64_t& out) {
+    auto digits = [&](size_t pos, size_t len, int64_t& value) {
+        if (pos + len > ts.size()) return false;
+        value = 0;
+        for (size_t i = pos; i < pos + len; ++i) {
+            if (ts[i] < '0' || ts[i] > '9') return false;
+            value = value * 10 + (ts[i] - '0');
+        }
+        return true;
+    };
+    int64_t y, mo, d, h, mi, s;
+    if (!digits(0, 4, y) || !digits(5, 2, mo) || !digits(8, 2, d) || !digits(11, 2, h) ||
+        !digits(14, 2, mi) || !digits(17, 2, s) || ts[4] != '-' || ts[7] != '-' ||
+        (ts[10] != 'T' && ts[10] != ' ') || ts[13] != ':' || ts[16] != ':') {
+        return false;
+    }
+    int64_t micros = 0;
+    size_t pos = 19;
+    if (pos < ts.size() && ts[pos] == '.') {
+        int64_t scale = 100000;
+        for (++pos; pos < ts.size() && ts[pos] >= '0' && ts[pos] <= '9'; ++pos, scale /= 10) {
+            micros += (ts[pos] - '0') * scale;
+        }
+    }
+    // dias desde 1970-01-01 (algoritmo days_from_civil)
+    y -= mo <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+    out = ((days * 24 + h) * 60 + mi) * 60 * 1000000 + s * 1000000 + micros;
+    return true;
+}
+
+class ReorderStage : public PipelineStage {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Releaser = std::function<void(std::string payload, uint32_t device)>;
+    using Released = std::vector<std::pair<std::string, uint32_t>>;
+
+private:
+    struct Entry {
+        int64_t eventUs;
+        int64_t seq;
+        Clock::time_point arrival;
+        std::string payload;
+    };
+    struct Later {
+        bool operator()(const Entry& a, const Entry& b) const {
+            return a.eventUs != b.eventUs ? a.eventUs > b.eventUs : a.seq > b.seq;
+        }
+    };
+    struct Device {
+        std::vector<Entry> heap;
+        int64_t maxEventUs = INT64_MIN;
+        int64_t releasedUs = INT64_MIN;  // chave da última leitura liberada
+        int64_t releasedSeq = INT64_MIN;
+    };
+
+    DeviceInterner& interner;
+    const std::chrono::microseconds lateness;
+    const size_t maxPerDevice;
+    const size_t maxBytes;  // soma dos payloads retidos em todos os dispositivos
+    Releaser release;
+
+    std::mutex mtx;
+    std::vector<Device> devices;  // indexado pelo id internado
+    size_t bufferedBytes = 0;
+    // contadores do intervalo de relatório
+    uint64_t released = 0;
+    uint64_t lateDrops = 0;
+    uint64_t forced = 0;
+    double holdSumMs = 0.0;
+    double holdMaxMs = 0.0;
+    Clock::time_point lastReport = Clock::now();
+
+    void pop(uint32_t device, Clock::time_point now, Released& out) {
+        Device& d = devices[device];
+        std::pop_heap(d.heap.begin(), d.heap.end(), Later());
+        Entry& e = d.heap.back();
+        d.releasedUs = e.eventUs;
+        d.releasedSeq = e.seq;
+        double holdMs = std::chrono::duration<double, std::milli>(now - e.arrival).count();
+        holdSumMs += holdMs;
+        holdMaxMs = std::max(holdMaxMs, holdMs);
+        ++released;
+        bufferedBytes -= e.payload.size();
+        out.emplace_back(std::move(e.payload), device);
+        d.heap.pop_back();
+    }
+
+public:
+    ReorderStage(DeviceInterner& devices, std::chrono::microseconds allowedLateness, size_t perDevice,
+                 size_t bufferBytes, Releaser releaser)
+        : interner(devices), lateness(allowedLateness), maxPerDevice(std::max<size_t>(perDevice, 1)),
+          maxBytes(bufferBytes), release(std::move(releaser)) {}
+
+    const char* name() const override { return "reorder"; }
+    std::vector<std::string> runsAfter() const override { return {"validation"}; }
+
+    // Bufferiza a leitura e coleta em 'out' as liberadas pela nova marca d'água.
+    // Retorna false se a mensagem não tem dispositivo ou chave de tempo (segue sem reordenar).
+    bool offer(const std::string& payload, uint32_t device, Clock::time_point now, Released& out) {
+        if (device == DeviceInterner::NONE) return false;
+        namespace scan = reading_schema::detail;
+        std::string_view timestamp;
+        double seq = 0.0;
+        scan::Cursor c{payload.data(), payload.data() + payload.size()};
+        if (scan::lit(c, '{') && !scan::lit(c, '}')) {
+            do {
+                std::string_view key;
+                if (!scan::str(c, key) || !scan::lit(c, ':')) break;
+                bool integral;
+                bool ok = key == "timestamp" ? scan::str(c, timestamp)
+                        : key == "seq"       ? scan::num(c, seq, integral)
+                        : scan::skipValue(c, 0);
+                if (!ok) break;
+            } while (scan::lit(c, ','));
+        }
+        int64_t eventUs;
+        if (!parseEventMicros(timestamp, eventUs)) return false;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (device >= devices.size()) devices.resize(device + 1);
+        Device& d = devices[device];
+        auto key = static_cast<int64_t>(seq);
+        if (eventUs < d.releasedUs || (eventUs == d.releasedUs && key <= d.releasedSeq)) {
+            ++lateDrops;
+            return true;
+        }
+        d.heap.push_back(Entry{eventUs, key, now, payload});
+        std::push_heap(d.heap.begin(), d.heap.end(), Later());
+        bufferedBytes += payload.size();
+        d.maxEventUs = std::max(d.maxEventUs, eventUs);
+        int64_t watermark = d.maxEventUs - lateness.count();
+        // Acima de maxBytes o dispositivo que chegou libera antes da marca
+        // d'água: o total retido fica limitado a maxBytes + uma leitura
+        while (!d.heap.empty() && (d.heap.front().eventUs <= watermark || d.heap.size() > maxPerDevice ||
+                                   bufferedBytes > maxBytes)) {
+            if (d.heap.front().eventUs > watermark) ++forced;
+            pop(device, now, out);
+        }
+        return true;
+    }
+
+    // Libera o que já esperou o atraso tolerado (dispositivos parados não prendem leituras)
+    void flush(Clock::time_point now, Released& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (uint32_t device = 0; device < devices.size(); ++device) {
+            const Device& d = devices[device];
+            while (!d.heap.empty() && now - d.heap.front().arrival >= lateness) pop(device, now, out);
+        }
+    }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        return process(input, deadline, interner.internPayload(input));
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline, uint32_t device) override {
+        deadline.check(name());
+        Released out;
+        if (!offer(input, device, Clock::now(), out)) return input;
+        for (auto& item : out) release(std::move(item.first), item.second);
+        return "";
+    }
+
+    void onTick(Clock::time_point now) override {
+        Released out;
+        flush(now, out);
+        for (auto& item : out) release(std::move(item.first), item.second);
+        if (now - lastReport >= std::chrono::seconds(10)) {
+            std::cout << report() << std::endl;
+            lastReport = now;
+        }
+    }
+
+    // Custo da janela de atraso: tempo de retenção e descartes no intervalo
+    std::string report() {
+        return "[Middleware3][reorder] " + takeStats();
+    }
+
+    std::string takeStats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::ostringstream out;
+        out << "lateness=" << lateness.count() / 1000.0 << "ms released=" << released
+            << " late_drops=" << lateDrops << " forced=" << forced
+            << " hold_avg=" << (released ? holdSumMs / released : 0.0) << "ms hold_max=" << holdMaxMs << "ms";
+        released = lateDrops = forced = 0;
+        holdSumMs = holdMaxMs = 0.0;
+        return out.str();
+    }
+};
+
+// Fluxo sintético fora de ordem (20 dispositivos, 1 leitura/ms, 10% atrasadas
+// até 100 ms) em tempo simulado, para cada janela de atraso
+static void runReorderBench(long messages) {
+    using Clock = ReorderStage::Clock;
+    struct Arrival {
+        int64_t arrivalUs;
+        std::string payload;
+    };
+    std::vector<Arrival> arrivals;
+    uint64_t rng = 88172645463325252ull;
+    auto next = [&] {  // xorshift64
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    };
+    for (long i = 0; i < messages; ++i) {
+        int64_t eventUs = i * 1000;
+        int64_t delayUs = static_cast<int64_t>(next() % 5000);
+        if (next() % 10 == 0) delayUs += static_cast<int64_t>(next() % 100000);
+        char ts[64];
+        int64_t secs = eventUs / 1000000;
+        std::snprintf(ts, sizeof(ts), "2024-01-01T%02lld:%02lld:%02lld.%06lld+00:00",
+                      static_cast<long long>(secs / 3600 % 24), static_cast<long long>(secs / 60 % 60),
+                      static_cast<long long>(secs % 60), static_cast<long long>(eventUs % 1000000));
+        arrivals.push_back({eventUs + delayUs, "{\"seq\": " + std::to_string(i) + ", \"device_id\": \"device_" +
+                                                   std::to_string(i % 20) + "\", \"timestamp\": \"" + ts + "\"}"});
+    }
+    std::sort(arrivals.begin(), arrivals.end(),
+              [](const Arrival& a, const Arrival& b) { return a.arrivalUs < b.arrivalUs; });
+
+    for (long latenessMs : {0L, 10L, 50L, 200L}) {
+        DeviceInterner interner(64);
+        ReorderStage stage(interner, std::chrono::milliseconds(latenessMs), 1024, SIZE_MAX,
+                           [](std::string, uint32_t) {});
+        Clock::time_point origin{};
+        ReorderStage::Released out;
+        uint64_t inversions = 0;
+        std::map<long, long> lastSeq;
+        auto drain = [&] {
+            for (const auto& item : out) {
+                long seq = std::atol(item.first.c_str() + 8);
+                long& last = lastSeq.emplace(seq % 20, -1).first->second;
+                if (seq < last) ++inversions;
+                last = seq;
+            }
+            out.clear();
+        };
+        int64_t nextFlushUs = 0;
+        for (const auto& a : arrivals) {
+            while (nextFlushUs <= a.arrivalUs) {
+                stage.flush(origin + std::chrono::microseconds(nextFlushUs), out);
+                nextFlushUs += 1000;
+            }
+            stage.offer(a.payload, interner.internPayload(a.payload), origin + std::chrono::microseconds(a.arrivalUs), out);
+            drain();
+        }
+        stage.flush(origin + std::chrono::microseconds(nextFlushUs) + std::chrono::milliseconds(latenessMs), out);
+        drain();
+        std::cout << "[Middleware3][reorder-bench] " << stage.takeStats()
+                  << " inversions=" << inversions << std::endl;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Downsampling por dispositivo (DOWNSAMPLE_INTERVAL_MS): cada dispositivo ocupa
+// um slot numa tabela plana indexada pelo id internado e a emissão é disparada
+// por uma roda de timers avançada em onTick, sem verificação por mensagem.
+// O estágio retém toda mensagem; só o agregado do intervalo segue adiante.
+// ---------------------------------------------------------------------------
+
+// Roda de timers de um nível: basta que todo prazo caiba em uma volta
+class TimerWheel {
+private:
+    std::vector<std::vector<uint32_t>> buckets;
+    std::chrono::steady_clock::duration tick;
+    std::chrono::steady_clock::time_point origin;
+    uint64_t current = 0;  // próximo tick a disparar
+
+    uint64_t tickOf(std::chrono::steady_clock::time_point t) const {
+        return t <= origin ? 0 : static_cast<uint64_t>((t - origin) / tick);
+    }
+
+public:
+    TimerWheel(std::chrono::steady_clock::duration tickLength, std::chrono::steady_clock::duration horizon,
+               std::chrono::steady_clock::time_point start)
+        : buckets(static_cast<size_t>(horizon / tickLength) + 2), tick(tickLength), origin(start) {}
+
+    void schedule(uint32_t id, std::chrono::steady_clock::time_point due) {
+        uint64_t at = std::max(tickOf(due), current);
+        buckets[at % buckets.size()].push_back(id);
+    }
+
+    template <typename Fire>
+    void advance(std::chrono::steady_clock::time_point now, Fire fire) {
+        uint64_t target = tickOf(now);
+        while (current <= target) {
+            auto& bucket = buckets[current % buckets.size()];
+            for (uint32_t id : bucket) fire(id);
+            bucket.clear();
+            ++current;
+        }
+    }
+};
+
+enum class DownsampleMode { Latest, Average, MinMax };
+
+static DownsampleMode parseDownsampleMode(const std::string& value) {
+    if (value == "avg" || value == "average") return DownsampleMode::Average;
+    if (value == "minmax") return DownsampleMode::MinMax;
+    return DownsampleMode::Latest;
+}
+
+class DownsampleStage : public PipelineStage {
+public:
+    using Emitter = std::function<void(const std::string& payload)>;
+    static constexpr size_t MAX_FIELDS = 4;
+
+private:
+    struct Slot {
+        uint64_t count = 0;
+        uint64_t samples[MAX_FIELDS] = {};
+        double sum[MAX_FIELDS] = {};
+        double min[MAX_FIELDS] = {};
+        double max[MAX_FIELDS] = {};
+        std::string latest;
+        bool armed = false;  // agendado na roda para o fim do intervalo
+    };
+
+    DeviceInterner& interner;
+    const std::chrono::milliseconds interval;
+    const DownsampleMode mode;
+    const size_t maxDevices;
+    std::vector<std::string> fields;
+    Emitter emit;
+
+    std::mutex mtx;
+    std::vector<Slot> slots;  // indexado pelo id internado
+    TimerWheel wheel;
+    uint64_t overflow = 0;    // mensagens repassadas por id acima de DOWNSAMPLE_MAX_DEVICES
+
+    std::string render(Slot& slot) {
+        json j = json::parse(slot.latest);
+        for (size_t f = 0; f < fields.size(); ++f) {
+            if (slot.samples[f] == 0) continue;
+            if (mode == DownsampleMode::Average) {
+                j[fields[f]] = std::round(slot.sum[f] / slot.samples[f] * 1000.0) / 1000.0;
+            } else if (mode == DownsampleMode::MinMax) {
+                j[fields[f] + "_min"] = slot.min[f];
+                j[fields[f] + "_max"] = slot.max[f];
+            }
+        }
+        static const char* const modeNames[] = {"latest", "avg", "minmax"};
+        j["downsample"] = {{"mode", modeNames[static_cast<int>(mode)]}, {"count", slot.count}};
+        return j.dump();
+    }
+
+public:
+    DownsampleStage(DeviceInterner& devices, std::chrono::milliseconds every, DownsampleMode aggregation,
+                    const std::string& fieldList, size_t deviceLimit, std::chrono::milliseconds tick,
+                    Emitter emitter)
+        : interner(devices), interval(every), mode(aggregation), maxDevices(deviceLimit), emit(std::move(emitter)),
+          wheel(tick, every, std::chrono::steady_clock::now()) {
+        std::stringstream ss(fieldList);
+        std::string field;
+        while (std::getline(ss, field, ',') && fields.size() < MAX_FIELDS) {
+            if (!field.empty()) fields.push_back(field);
+        }
+    }
+
+    const char* name() const override { return "downsample"; }
+    // Agrega o resultado final do pipeline
+    std::vector<std::string> runsAfter() const override {
+        return {"validation", "reorder", "enrichment", "transformation", "rules"};
+    }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        return process(input, deadline, interner.internPayload(input));
+    }
+
+    // Retorna "" (mensagem retida) exceto quando não há slot para o dispositivo
+    std::string process(const std::string& input, const Deadline& deadline, uint32_t device) override {
+        if (device == DeviceInterner::NONE) return input;
+        namespace scan = reading_schema::detail;
+        double values[MAX_FIELDS];
+        bool present[MAX_FIELDS] = {};
+        scan::Cursor c{input.data(), input.data() + input.size()};
+        if (scan::lit(c, '{') && !scan::lit(c, '}')) {
+            do {
+                std::string_view key;
+                if (!scan::str(c, key) || !scan::lit(c, ':')) break;
+                scan::ws(c);
+                size_t f = 0;
+                while (f < fields.size() && fields[f] != key) ++f;
+                bool ok;
+                if (f < fields.size() && c.p < c.end && *c.p != '"') {
+                    bool integral;
+                    ok = present[f] = scan::num(c, values[f], integral);
+                } else {
+                    ok = scan::skipValue(c, 0);
+                }
+                if (!ok) break;
+            } while (scan::lit(c, ','));
+        }
+        deadline.check(name());
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (device >= maxDevices) {
+            if (overflow++ == 0) {
+                std::cerr << "[Middleware3] Downsample table full - passing new devices through" << std::endl;
+            }
+            return input;
+        }
+        if (device >= slots.size()) slots.resize(device + 1);
+        Slot& slot = slots[device];
+        ++slot.count;
+        slot.latest = input;
+        for (size_t f = 0; f < fields.size(); ++f) {
+            if (!present[f]) continue;
+            double v = values[f];
+            if (slot.samples[f]++ == 0) {
+                slot.sum[f] = slot.min[f] = slot.max[f] = v;
+            } else {
+                slot.sum[f] += v;
+                slot.min[f] = std::min(slot.min[f], v);
+                slot.max[f] = std::max(slot.max[f], v);
+            }
+        }
+        if (!slot.armed) {
+            slot.armed = true;
+            wheel.schedule(device, std::chrono::steady_clock::now() + interval);
+        }
+        return "";
+    }
+
+    // Dispara os intervalos vencidos; publica fora do lock
+    void onTick(std::chrono::steady_clock::time_point now) override {
+        std::vector<std::string> due;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            wheel.advance(now, [&](uint32_t at) {
+                Slot& slot = slots[at];
+                try {
+                    due.push_back(render(slot));
+                } catch (const std::exception& e) {
+                    std::cerr << "[Middleware3] Downsample render error: " << e.what() << std::endl;
+                }
+                slot.count = 0;
+                std::fill(std::begin(slot.samples), std::end(slot.samples), 0);
+                slot.latest.clear();  // mantém a capacidade do buffer
+                slot.armed = false;
+            });
+        }
+        for (const auto& payload : due) emit(payload);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Isolamento por processo (PIPELINE_ISOLATION=process): cada estágio roda em
+// um processo filho ligado ao pai por dois ShmRing. Workers ficam pré-forkados
+// e aquecidos num pool; um crash custa apenas a promoção de um worker do pool.
+// ---------------------------------------------------------------------------
+
+using StageFactory = std::function<std::unique_ptr<PipelineStage>()>;
+
+struct StageWorker {
+    pid_t pid = -1;
+    std::unique_ptr<ShmRing> requests;   // pai -> filho
+    std::unique_ptr<ShmRing> responses;  // filho -> pai ('O' + saída ou 'E' + erro)
+    mutable bool reaped = false;  // já recolhido por waitpid: o pid pode ter sido reutilizado
+
+    bool alive() const {
+        if (pid <= 0 || reaped) return false;
+        if (waitpid(pid, nullptr, WNOHANG) == 0) return true;
+        reaped = true;
+        return false;
+    }
+
+    // Mata e recolhe o filho, a menos que alive() já o tenha recolhido
+    void stop() {
+        if (pid <= 0 || reaped) return;
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        reaped = true;
+    }
+};
+
+class WarmPool {
+private:
+    StageFactory factory;
+    size_t size;
+    long crashEvery;  // falha simulada: SIGSEGV a cada N mensagens (0 = nunca)
+    std::deque<StageWorker> idle;
+
+    static void serve(PipelineStage& stage, ShmRing& requests, ShmRing& responses, long crashEvery) {
+        std::string request;
+        std::string reply;
+        long handled = 0;
+        while (true) {
+            // requisição: [int64 µs restantes][payload]; o prazo atravessa o processo
+            requests.pop(request);
+            if (crashEvery > 0 && ++handled % crashEvery == 0) raise(SIGSEGV);
+            int64_t remaining;
+            std::memcpy(&remaining, request.data(), sizeof(remaining));
+            Deadline deadline = remaining == std::chrono::microseconds::max().count()
+                ? Deadline::never()
+                : Deadline::after(std::chrono::microseconds(remaining));
+            try {
+                reply.assign(1, 'O');
+                reply += stage.process(request.substr(sizeof(remaining)), deadline);
+            } catch (const DeadlineExceeded& e) {
+                reply.assign(1, 'D');
+                reply += e.what();
+            } catch (const std::exception& e) {
+                reply.assign(1, 'E');
+                reply += e.what();
+            }
+            responses.push(reply);
+        }
+    }
+
+    StageWorker spawn() {
+        StageWorker w;
+        w.requests = std::make_unique<ShmRing>(1 << 20);
+        w.responses = std::make_unique<ShmRing>(1 << 20);
+        pid_t parent = getpid();
+        w.pid = fork();
+        if (w.pid < 0) throw std::runtime_error("WarmPool: fork failed");
+        if (w.pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent) _exit(0);
+            auto stage = factory();
+            serve(*stage, *w.requests, *w.responses, crashEvery);
+            _exit(0);
+        }
+        return w;
+    }
+
+public:
+    // Vazio: o worker ativo é criado sob demanda e os reservas em refill()
+    WarmPool(StageFactory stageFactory, size_t warmWorkers, long simulatedCrashEvery)
+        : factory(std::move(stageFactory)), size(warmWorkers), crashEvery(simulatedCrashEvery) {}
+
+    ~WarmPool() {
+        for (auto& w : idle) w.stop();
+    }
+
+    // Worker pronto para uso; só faz fork no caminho crítico se o pool esvaziou
+    StageWorker take() {
+        while (!idle.empty()) {
+            StageWorker w = std::move(idle.front());
+            idle.pop_front();
+            if (w.alive()) return w;
+        }
+        return spawn();
+    }
+
+    bool full() const { return idle.size() >= size; }
+
+    void refill() {
+        while (idle.size() < size) idle.push_back(spawn());
+    }
+};
+
+class Supervisor {
+public:
+    std::unique_ptr<PipelineStage> restartStage(std::unique_ptr<PipelineStage> stage) {
+        std::cout << "[Middleware3] Restarting failed stage..." << std::endl;
+        stage->restart();
+        return std::move(stage);
+    }
+
+    // Reinício no lugar: o estágio pode estar em uso por threads de bulkhead
+    void restartStage(PipelineStage& stage) {
+        std::cout << "[Middleware3] Restarting failed stage '" << stage.name() << "'..." << std::endl;
+        stage.restart();
+    }
+
+    // Substitui um worker morto por um do pool aquecido
+    StageWorker replaceWorker(StageWorker& crashed, WarmPool& pool, const std::string& stageName) {
+        auto started = std::chrono::steady_clock::now();
+        crashed.stop();
+        StageWorker next = pool.take();
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        std::cout << "[Middleware3] Worker " << crashed.pid << " of stage '" << stageName
+                  << "' died; replaced by warm worker " << next.pid << " in " << micros << "us"
+                  << std::endl;
+        return next;
+    }
+};
+
+// Estágio executado num processo isolado; a mensagem em voo é reenviada ao
+// worker substituto se o atual morrer durante o processamento
+class IsolatedStage : public PipelineStage {
+private:
+    std::string stageName;
+    WarmPool pool;
+    Supervisor& supervisor;
+    StageWorker active;
+    mutable std::mutex workerMtx;  // um worker atende uma requisição por vez
+    bool warmed = false;  // reservas liberadas por warmUp()
+    const int MAX_REPLAYS = 2;  // evita que uma mensagem venenosa derrube o pool todo
+
+    enum class Outcome { Replied, Died, TimedOut };
+
+    Outcome awaitReply(std::string& reply, const Deadline& deadline) {
+        while (true) {
+            if (active.responses->pop(reply, 1)) return Outcome::Replied;
+            if (!active.alive()) {
+                return active.responses->pop(reply, 0) ? Outcome::Replied : Outcome::Died;
+            }
+            if (deadline.expired()) return Outcome::TimedOut;
+        }
+    }
+
+public:
+    IsolatedStage(const std::string& name, StageFactory factory, size_t warmWorkers,
+                  long simulatedCrashEvery, Supervisor& sup)
+        : stageName(name), pool(std::move(factory), warmWorkers, simulatedCrashEvery),
+          supervisor(sup), active(pool.take()) {}
+
+    ~IsolatedStage() override { active.stop(); }
+
+    const char* name() const override { return stageName.c_str(); }
+
+    std::string process(const std::string& input) override {
+        return process(input, Deadline::never());
+    }
+
+    // Com o worker em outro processo o cancelamento é real: um worker que
+    // estoura o prazo é morto e substituído, sem replay da mensagem
+    std::string process(const std::string& input, const Deadline& deadline) override {
+        std::lock_guard<std::mutex> lock(workerMtx);
+        int64_t remaining = deadline.remaining().count();
+        std::string request(reinterpret_cast<const char*>(&remaining), sizeof(remaining));
+        request += input;
+
+        for (int attempt = 0; attempt <= MAX_REPLAYS; ++attempt) {
+            std::string reply;
+            Outcome outcome = active.requests->push(request, 100)
+                ? awaitReply(reply, deadline) : Outcome::Died;
+            if (outcome == Outcome::Replied) {
+                if (reply[0] == 'D') throw DeadlineExceeded(stageName);
+                if (reply[0] == 'E') throw std::runtime_error(reply.substr(1));
+                reply.erase(0, 1);
+                return reply;
+            }
+            // o pool é recomposto no tick, sem fork() antes do replay
+            active = supervisor.replaceWorker(active, pool, stageName);
+            if (outcome == Outcome::TimedOut) throw DeadlineExceeded(stageName);
+        }
+        throw std::runtime_error("Stage '" + stageName + "' crashed on message " +
+                                 std::to_string(MAX_REPLAYS + 1) + " times");
+    }
+
+    // Com o lock ocupado há uma requisição em curso, e process() já trata a
+    // morte do worker; o tick não espera por ela
+    bool isHealthy() const override {
+        std::unique_lock<std::mutex> lock(workerMtx, std::try_to_lock);
+        return !lock.owns_lock() || active.alive();
+    }
+
+    // Reservas só depois da partida: só o worker ativo atrasa a primeira mensagem
+    void warmUp() override {
+        std::lock_guard<std::mutex> lock(workerMtx);
+        warmed = true;
+        pool.refill();
+    }
+
+    // Repõe no tick os reservas consumidos por substituições
+    void onTick(std::chrono::steady_clock::time_point) override {
+        std::unique_lock<std::mutex> lock(workerMtx, std::try_to_lock);
+        if (lock.owns_lock() && warmed && !pool.full()) pool.refill();
+    }
+
+    void restart() override {
+        std::lock_guard<std::mutex> lock(workerMtx);
+        if (active.alive()) return;
+        active = supervisor.replaceWorker(active, pool, stageName);
+        if (warmed) pool.refill();
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Posicionamento de threads por papel. THREAD_CPUS="papel=lista;..." com
+// papéis consumer, stage, lane, publish, core (modo por core) e housekeeping,
+// ou o nome exato de um bulkhead; listas no formato "0-3,6". A i-ésima thread
+// de um papel fica na CPU i % n da lista. A máscara 'housekeeping' é aplicada
+// ao processo antes de criar clientes e threads auxiliares (Paho, supervisor),
+// que a herdam; as threads quentes saem dela ao se fixarem no próprio papel.
+// ---------------------------------------------------------------------------
+
+class ThreadPlacement {
+private:
+    std::map<std::string, std::vector<int>> roles;
+    std::mutex mtx;
+    std::map<std::string, size_t> assigned;  // threads já fixadas por papel
+
+    static bool applyMask(const std::vector<int>& cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+public:
+    explicit ThreadPlacement(const std::string& spec) {
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ';')) {
+            auto eq = item.find('=');
+            if (eq == std::string::npos) continue;
+            std::vector<int> cpus = parseCpuList(item.substr(eq + 1));
+            if (!cpus.empty()) roles[item.substr(0, eq)] = cpus;
+        }
+    }
+
+    static ThreadPlacement& instance() {
+        static ThreadPlacement placement(envString("THREAD_CPUS", ""));
+        return placement;
+    }
+
+    static std::vector<int> parseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0]))) continue;
+            auto dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+                if (cpu >= 0) cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // Nó NUMA da CPU pelo sysfs (-1 se desconhecido)
+    static int numaNode(int cpu) {
+        for (int node = 0; node < 64; ++node) {
+            struct stat st;
+            std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/node" + std::to_string(node);
+            if (stat(path.c_str(), &st) == 0) return node;
+        }
+        return -1;
+    }
+
+    bool enabled() const { return !roles.empty(); }
+
+    // Thread atual e as que ela criar a seguir herdam a máscara 'housekeeping'
+    bool isolateHousekeeping() {
+        auto it = roles.find("housekeeping");
+        return it != roles.end() && applyMask(it->second);
+    }
+
+    // Fixa a thread atual numa CPU do papel (ou de 'fallbackRole') e a nomeia
+    // "mw3-<papel>"; retorna a CPU ou -1 se o papel não foi configurado
+    int pin(const std::string& role, const std::string& fallbackRole = "") {
+        auto it = roles.find(role);
+        if (it == roles.end() && !fallbackRole.empty()) it = roles.find(fallbackRole);
+        std::string label = "mw3-" + role;
+        pthread_setname_np(pthread_self(), label.substr(0, 15).c_str());
+        if (it == roles.end()) return -1;
+        size_t ordinal;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            ordinal = assigned[it->first]++;
+        }
+        int cpu = it->second[ordinal % it->second.size()];
+        if (!applyMask({cpu})) {
+            std::cerr << "[Middleware3] Cannot pin " << label << " to CPU " << cpu << std::endl;
+            return -1;
+        }
+        std::cout << "[Middleware3] Thread " << label << " pinned to CPU " << cpu << " (NUMA node "
+                  << numaNode(cpu) << ")" << std::endl;
+        return cpu;
+    }
+};
+
+// Latência de entrega consumidor -> worker (validação + transformação) com
+// threads de ruído ocupando todas as CPUs, sem e com posicionamento. Sem
+// THREAD_CPUS o plano é consumer=0, stage=1 e housekeeping=demais CPUs.
+static void runPlacementBench(long messages) {
+    std::string spec = envString("THREAD_CPUS", "");
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    if (spec.empty()) {
+        spec = cpus >= 3 ? "consumer=0;stage=1;housekeeping=2-" + std::to_string(cpus - 1)
+                         : "consumer=0;stage=" + std::to_string(cpus - 1) + ";housekeeping=0-" + std::to_string(cpus - 1);
+    }
+    const std::string payload =
+        "{\"seq\": 1, \"device_id\": \"device_7\", \"timestamp\": \"2024-01-01T12:00:00.000000+00:00\", "
+        "\"temperature\": 24.5, \"humidity\": 55.1, \"status\": \"normal\"}";
+
+    for (bool placed : {false, true}) {
+        ThreadPlacement placement(placed ? spec : "");
+        std::atomic<bool> running{true};
+        std::vector<std::thread> noise;
+        for (unsigned i = 0; i < cpus; ++i) {
+            noise.emplace_back([&] {
+                if (placed) placement.isolateHousekeeping();
+                volatile uint64_t sink = 0;
+                while (running.load(std::memory_order_relaxed)) sink = sink + 1;
+            });
+        }
+        ShmRing ring(1 << 20);
+        std::vector<int64_t> latencies(static_cast<size_t>(messages));
+        std::thread worker([&] {
+            if (placed) placement.pin("stage");
+            ValidationStage validation;
+            TransformationStage transformation;
+            std::string record;
+            for (long i = 0; i < messages; ++i) {
+                ring.pop(record);
+                int64_t sent;
+                std::memcpy(&sent, record.data(), sizeof(sent));
+                transformation.process(validation.process(record.substr(sizeof(sent))));
+                latencies[static_cast<size_t>(i)] =
+                    std::chrono::steady_clock::now().time_since_epoch().count() - sent;
+            }
+        });
+        std::thread consumer([&] {
+            if (placed) placement.pin("consumer");
+            std::string record(sizeof(int64_t), '\0');
+            record += payload;
+            for (long i = 0; i < messages; ++i) {
+                int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+                std::memcpy(&record[0], &now, sizeof(now));
+                ring.push(record);
+                // ritmo fixo de ~20k msg/s: mede latência, não fila
+                auto next = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+                while (std::chrono::steady_clock::now() < next) {
+                }
+            }
+        });
+        consumer.join();
+        worker.join();
+        running = false;
+        for (auto& thread : noise) thread.join();
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            size_t k = std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()));
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(latencies[k])).count();
+        };
+        std::cout << "[Middleware3][placement-bench] " << (placed ? "pinned (" + spec + ")" : "unpinned")
+                  << " p50=" << percentile(0.50) << "us p99=" << percentile(0.99) << "us p999=" << percentile(0.999)
+                  << "us" << std::endl;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Busy-poll (BUSY_POLL=1): a ingestão e os workers dos bulkheads giram sobre a
+// fila com 'pause' em vez de dormir e só voltam a bloquear depois de
+// BUSY_POLL_IDLE_US sem trabalho. Troca CPU por latência; pensado para
+// núcleos dedicados (ver THREAD_CPUS).
+// ---------------------------------------------------------------------------
+
+static inline void cpuRelax() {
+#if defined(__SSE2__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static std::chrono::microseconds busyPollBudget() {
+    if (envLong("BUSY_POLL", 0) == 0) return std::chrono::microseconds(0);
+    return std::chrono::microseconds(envLong("BUSY_POLL_IDLE_US", 2000));
+}
+
+class SpinWait {
+private:
+    const std::chrono::microseconds idleBudget;
+    std::chrono::steady_clock::time_point lastWork = std::chrono::steady_clock::now();
+    unsigned pauses = 0;
+
+public:
+    explicit SpinWait(std::chrono::microseconds budget) : idleBudget(budget) {}
+
+    bool enabled() const { return idleBudget.count() > 0; }
+
+    // Ainda vale girar: houve trabalho há menos de idleBudget
+    bool spinning() const {
+        return enabled() && std::chrono::steady_clock::now() - lastWork < idleBudget;
+    }
+
+    void worked() { lastWork = std::chrono::steady_clock::now(); }
+
+    // Um passo de espera ativa; cede a CPU de tempos em tempos para não travar
+    // hosts com menos núcleos do que threads girando
+    void relax() {
+        cpuRelax();
+        if (++pauses % 256 == 0) std::this_thread::yield();
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Bulkheads: cada estágio (ou grupo de estágios) e o publish rodam em pool de
+// threads e fila limitada próprios, com política de saturação independente.
+// Um estágio lento só satura o próprio bulkhead.
+// ---------------------------------------------------------------------------
+
+enum class SaturationPolicy { Reject, DropOldest, CallerRuns };
+
+static SaturationPolicy parsePolicy(const std::string& name) {
+    if (name == "drop_oldest") return SaturationPolicy::DropOldest;
+    if (name == "caller_runs") return SaturationPolicy::CallerRuns;
+    return SaturationPolicy::Reject;
+}
+
+class Bulkhead {
+private:
+    struct Task {
+        std::function<void()> run;
+        size_t bytes;  // payload carregado pela tarefa, para o limite em bytes
+    };
+
+    const std::string bulkheadName;
+    const size_t threadCount;
+    const size_t capacity;
+    const size_t maxBytes;
+    const SaturationPolicy policy;
+    const std::chrono::microseconds spinBudget;  // busy-poll; zero = só bloqueia
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Task> queue;
+    size_t queuedBytes = 0;
+    std::atomic<size_t> queued{0};  // espelho de queue.size() para o giro sem lock
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    size_t highWater = 0;
+
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> callerRuns{0};
+    std::atomic<size_t> active{0};
+    std::atomic<int64_t> busyMicros{0};
+    uint64_t reportedCompleted = 0;
+    int64_t reportedBusy = 0;
+
+    void run(std::function<void()>& task) {
+        ++active;
+        auto started = std::chrono::steady_clock::now();
+        try {
+            task();
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3][bulkhead " << bulkheadName << "] Task error: " << e.what() << std::endl;
+        }
+        busyMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        --active;
+        ++completed;
+    }
+
+    void workerLoop() {
+        std::string role = "stage";
+        if (bulkheadName.compare(0, 5, "lane-") == 0) role = "lane";
+        if (bulkheadName == "publish") role = "publish";
+        ThreadPlacement::instance().pin(bulkheadName, role);
+        SpinWait spin(spinBudget);
+        while (true) {
+            while (spin.spinning() && queued.load(std::memory_order_acquire) == 0) spin.relax();
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                task = std::move(queue.front().run);
+                queuedBytes -= queue.front().bytes;
+                queue.pop_front();
+                queued.store(queue.size(), std::memory_order_release);
+            }
+            run(task);
+            spin.worked();
+        }
+    }
+
+public:
+    Bulkhead(const std::string& name, size_t threads, size_t queueCapacity, SaturationPolicy saturation,
+             std::chrono::microseconds busyPoll = std::chrono::microseconds(0), size_t queueBytes = SIZE_MAX)
+        : bulkheadName(name), threadCount(std::max<size_t>(1, threads)),
+          capacity(std::max<size_t>(1, queueCapacity)), maxBytes(queueBytes), policy(saturation),
+          spinBudget(busyPoll) {
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~Bulkhead() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    const std::string& name() const { return bulkheadName; }
+    size_t depth() const { return queued.load(std::memory_order_relaxed); }
+
+    // false se a tarefa foi rejeitada pela política de saturação. A fila satura
+    // por número de tarefas ou pela soma dos 'bytes' informados; uma tarefa
+    // maior que o limite sozinha ainda entra com a fila vazia
+    bool submit(std::function<void()> task, size_t bytes = 0) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto full = [&] {
+                return queue.size() >= capacity || (!queue.empty() && queuedBytes + bytes > maxBytes);
+            };
+            if (full()) {
+                if (policy == SaturationPolicy::Reject) {
+                    ++rejected;
+                    return false;
+                }
+                if (policy == SaturationPolicy::DropOldest) {
+                    while (full()) {
+                        queuedBytes -= queue.front().bytes;
+                        queue.pop_front();
+                        ++dropped;
+                    }
+                }
+            }
+            if (!full()) {
+                queue.push_back({std::move(task), bytes});
+                queuedBytes += bytes;
+                queued.store(queue.size(), std::memory_order_release);
+                highWater = std::max(highWater, queue.size());
+                cv.notify_one();
+                return true;
+            }
+        }
+        // CallerRuns: quem submete executa, propagando a pressão para trás
+        ++callerRuns;
+        run(task);
+        return true;
+    }
+
+    // Métricas do intervalo desde o último relatório
+    std::string report(std::chrono::steady_clock::duration interval) {
+        size_t depth;
+        size_t peak;
+        size_t bytes;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            depth = queue.size();
+            bytes = queuedBytes;
+            peak = highWater;
+            highWater = depth;
+        }
+        uint64_t done = completed.load();
+        int64_t busy = busyMicros.load();
+        double intervalMicros = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::microseconds>(interval).count());
+        double utilization = intervalMicros > 0
+            ? 100.0 * (busy - reportedBusy) / (intervalMicros * threadCount) : 0.0;
+
+        std::ostringstream out;
+        out << "[Middleware3][bulkhead " << bulkheadName << "] threads=" << threadCount
+            << " active=" << active.load() << " queue=" << depth << "/" << capacity
+            << " queue_kb=" << bytes / 1024
+            << " peak=" << peak << " completed=" << (done - reportedCompleted)
+            << " busy=" << utilization << "%" << " rejected=" << rejected.load()
+            << " dropped=" << dropped.load() << " caller_runs=" << callerRuns.load();
+        reportedCompleted = done;
+        reportedBusy = busy;
+        return out.str();
+    }
+};
+
+// BULKHEADS="nome:threads:fila:política,..." (reject|drop_oldest|caller_runs)
+struct BulkheadConfig {
+    size_t threads;
+    size_t queue;
+    SaturationPolicy policy;
+};
+
+static const BulkheadConfig PUBLISH_BULKHEAD{2, 1024, SaturationPolicy::CallerRuns};
+
+static std::map<std::string, BulkheadConfig> parseBulkheadConfigs(const std::string& spec) {
+    std::map<std::string, BulkheadConfig> configs;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        std::vector<std::string> parts;
+        std::stringstream fields(item);
+        std::string field;
+        while (std::getline(fields, field, ':')) parts.push_back(field);
+        if (parts.size() < 3) continue;
+        configs[parts[0]] = {static_cast<size_t>(std::atol(parts[1].c_str())),
+                             static_cast<size_t>(std::atol(parts[2].c_str())),
+                             parsePolicy(parts.size() > 3 ? parts[3] : "reject")};
+    }
+    return configs;
+}
+
+// BULKHEAD_MAX_MB limita a fila de cada bulkhead também em bytes de payload
+static size_t bulkheadQueueBytes() {
+    return static_cast<size_t>(std::max(1L, envLong("BULKHEAD_MAX_MB", 16))) * 1024 * 1024;
+}
+
+// Latência interna consumidor -> bulkhead de estágio -> bulkhead de publish
+// (publish nulo) a ritmo fixo, bloqueando e em busy-poll, com o custo em CPU
+// (tempo de CPU do processo / tempo de parede) de cada modo
+static void runBusyPollBench(long messages) {
+    const std::string payload =
+        "{\"seq\": 1, \"device_id\": \"device_7\", \"timestamp\": \"2024-01-01T12:00:00.000000+00:00\", "
+        "\"temperature\": 24.5, \"humidity\": 55.1, \"status\": \"normal\"}";
+    auto budget = std::chrono::microseconds(envLong("BUSY_POLL_IDLE_US", 2000));
+    auto interval = std::chrono::microseconds(envLong("BUSY_POLL_BENCH_INTERVAL_US", 100));
+    if (std::thread::hardware_concurrency() < 3) {
+        std::cout << "[Middleware3][busy-poll-bench] fewer than 3 CPUs: spinning threads share cores "
+                     "and busy-poll numbers measure contention" << std::endl;
+    }
+    for (auto spin : {std::chrono::microseconds(0), budget}) {
+        std::vector<int64_t> latencies(static_cast<size_t>(messages));
+        std::atomic<long> done{0};
+        rusage before;
+        getrusage(RUSAGE_SELF, &before);
+        auto started = std::chrono::steady_clock::now();
+        {
+            Bulkhead publish("bench-publish", 1, 1024, SaturationPolicy::CallerRuns, spin);
+            Bulkhead stage("bench-stage", 1, 1024, SaturationPolicy::CallerRuns, spin);
+            ValidationStage validation;
+            for (long i = 0; i < messages; ++i) {
+                auto sent = std::chrono::steady_clock::now();
+                stage.submit([&, i, sent] {
+                    std::string out = validation.process(payload);
+                    publish.submit([&, i, sent] {
+                        latencies[static_cast<size_t>(i)] = (std::chrono::steady_clock::now() - sent).count();
+                        done.fetch_add(1, std::memory_order_release);
+                    });
+                });
+                // intervalo fixo entre mensagens: mede latência, não fila
+                while (std::chrono::steady_clock::now() - sent < interval) cpuRelax();
+            }
+            while (done.load(std::memory_order_acquire) < messages) std::this_thread::yield();
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        auto seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+        double cpu = seconds(after.ru_utime) - seconds(before.ru_utime) + seconds(after.ru_stime) -
+                     seconds(before.ru_stime);
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            size_t k = std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()));
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(latencies[k])).count();
+        };
+        // o produtor gira entre envios nos dois modos e conta como ~1 núcleo
+        std::cout << "[Middleware3][busy-poll-bench] " << (spin.count() ? "busy-poll" : "blocking")
+                  << " p50=" << percentile(0.50) << "us p99=" << percentile(0.99) << "us p999=" << percentile(0.999)
+                  << "us cpu=" << cpu / wall << " cores" << std::endl;
+    }
+}
+
+// Mensagem em trânsito entre bulkheads; carrega a ordem de estágios vigente
+// quando entrou, para que uma reordenação não afete mensagens em voo
+struct PipelineJob {
+    std::string payload;
+    Deadline deadline;
+    std::shared_ptr<const std::vector<size_t>> order;
+    uint32_t device = DeviceInterner::NONE;
+    bool onLane = false;  // executado inteiro pela lane dona da partição
+};
+
+// ---------------------------------------------------------------------------
+// Ordenação automática: o executor mede custo e taxa de rejeição de cada
+// estágio e coloca primeiro os filtros baratos e seletivos (menor
+// custo / (1 - aprovação)), respeitando runsAfter(). Mensagens retidas
+// (reordenação, downsampling) não são rejeições: voltam a sair depois.
+// ---------------------------------------------------------------------------
+
+struct StageProfile {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> rejections{0};
+    std::atomic<uint64_t> retentions{0};
+    std::atomic<uint64_t> nanos{0};
+};
+
+class StageOrderPlanner {
+public:
+    struct Sample {
+        double costNanos;
+        double passRate;
+        double heldRate;  // só informativo; não entra no rank
+    };
+
+    // Ordenação topológica gulosa: entre os estágios liberados pelas
+    // restrições, escolhe sempre o de menor rank
+    static std::vector<size_t> plan(const std::vector<std::unique_ptr<PipelineStage>>& stages,
+                                    const std::vector<Sample>& samples) {
+        const size_t n = stages.size();
+        std::vector<std::vector<size_t>> predecessors(n);
+        for (size_t i = 0; i < n; ++i) {
+            for (const auto& dep : stages[i]->runsAfter()) {
+                for (size_t j = 0; j < n; ++j) {
+                    if (j != i && dep == stages[j]->name()) predecessors[i].push_back(j);
+                }
+            }
+        }
+
+        std::vector<size_t> order;
+        std::vector<bool> placed(n, false);
+        while (order.size() < n) {
+            size_t best = n;
+            for (size_t i = 0; i < n; ++i) {
+                if (placed[i]) continue;
+                bool ready = std::all_of(predecessors[i].begin(), predecessors[i].end(),
+                                         [&](size_t p) { return placed[p]; });
+                if (ready && (best == n || rank(samples[i]) < rank(samples[best]))) best = i;
+            }
+            if (best == n) {
+                // ciclo nas restrições: mantém a ordem declarada para o restante
+                for (size_t i = 0; i < n; ++i) if (!placed[i]) { order.push_back(i); placed[i] = true; }
+                break;
+            }
+            order.push_back(best);
+            placed[best] = true;
+        }
+        return order;
+    }
+
+private:
+    static double rank(const Sample& s) {
+        double rejection = 1.0 - s.passRate;
+        if (rejection <= 1e-9) return 1e18 + s.costNanos;  // não filtra: vai para o fim
+        return s.costNanos / rejection;
+    }
+};
+
+// STAGE_BUDGETS_MS="validation:5,transformation:20"; demais estágios usam STAGE_BUDGET_MS
+static void applyStageBudgets(std::vector<std::unique_ptr<PipelineStage>>& stages) {
+    auto fallback = Deadline::budgetFromMillis(envLong("STAGE_BUDGET_MS", 0));
+    std::map<std::string, long> configured;
+    std::stringstream ss(envString("STAGE_BUDGETS_MS", ""));
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        auto colon = item.find(':');
+        if (colon != std::string::npos) configured[item.substr(0, colon)] = std::atol(item.c_str() + colon + 1);
+    }
+    std::string inProcess;
+    for (auto& stage : stages) {
+        auto it = configured.find(stage->name());
+        stage->setBudget(it != configured.end() ? Deadline::budgetFromMillis(it->second) : fallback);
+        if (!dynamic_cast<IsolatedStage*>(stage.get())) inProcess += std::string(inProcess.empty() ? "" : ",") + stage->name();
+    }
+    // Prazo cooperativo: avisa uma vez (o modo por core monta um pipeline por core)
+    static std::atomic<bool> warned{false};
+    bool budgeted = envLong("MESSAGE_BUDGET_MS", 0) > 0 || envLong("STAGE_BUDGET_MS", 0) > 0 || !configured.empty();
+    if (budgeted && !inProcess.empty() && !warned.exchange(true)) {
+        std::cout << "[Middleware3] Budgets are cooperative for in-process stages (" << inProcess
+                  << "): a blocking call is only caught when it returns; PIPELINE_ISOLATION=process "
+                     "bounds validation/transformation" << std::endl;
+    }
+}
+
+// Saídas dos estágios fora do fluxo principal, fornecidas por quem monta o pipeline
+struct StageHooks {
+    // mensagem retida pelo estágio 'index' e liberada depois (reordenação)
+    std::function<void(size_t index, std::string payload, uint32_t device)> resume;
+    // publicações próprias dos estágios (alertas das regras, agregados)
+    std::function<void(const std::string& topic, const std::string& payload)> sideOutput;
+};
+
+// Estágios configurados pelo ambiente, na ordem declarada. Comum ao modo
+// normal e ao por core, para que os dois aceitem as mesmas opções
+static std::vector<std::unique_ptr<PipelineStage>> buildStages(DeviceInterner& interner, Supervisor& supervisor,
+                                                               const StageHooks& hooks) {
+    std::vector<std::unique_ptr<PipelineStage>> pipeline;
+    if (envString("PIPELINE_ISOLATION", "") == "process") {
+        size_t warm = static_cast<size_t>(envLong("WARM_WORKERS", 2));
+        long crashEvery = envLong("SIMULATE_STAGE_CRASH_EVERY", 0);
+        pipeline.push_back(std::make_unique<IsolatedStage>(
+            "validation", [] { return std::make_unique<ValidationStage>(); },
+            warm, 0, supervisor));
+        pipeline.push_back(std::make_unique<IsolatedStage>(
+            "transformation", [] { return std::make_unique<TransformationStage>(); },
+            warm, crashEvery, supervisor));
+    } else {
+        pipeline.push_back(std::make_unique<ValidationStage>());
+        pipeline.push_back(std::make_unique<TransformationStage>());
+    }
+    std::string registryPath = envString("DEVICE_REGISTRY_PATH", "");
+    if (!registryPath.empty()) {
+        pipeline.insert(pipeline.begin() + 1, std::make_unique<EnrichmentStage>(registryPath));
+    }
+    long latenessMs = envLong("REORDER_LATENESS_MS", -1);
+    if (latenessMs >= 0) {
+        size_t index = pipeline.size();
+        pipeline.push_back(std::make_unique<ReorderStage>(
+            interner, std::chrono::milliseconds(latenessMs),
+            static_cast<size_t>(envLong("REORDER_MAX_PER_DEVICE", 64)),
+            static_cast<size_t>(std::max(1L, envLong("REORDER_MAX_MB", 64))) * 1024 * 1024,
+            [resume = hooks.resume, index](std::string payload, uint32_t device) {
+                resume(index, std::move(payload), device);
+            }));
+    }
+    std::string rulesPath = envString("RULES_PATH", "");
+    if (!rulesPath.empty()) {
+        pipeline.push_back(std::make_unique<RuleStage>(rulesPath, hooks.sideOutput));
+    }
+    long downsampleMs = envLong("DOWNSAMPLE_INTERVAL_MS", 0);
+    if (downsampleMs > 0) {
+        pipeline.push_back(std::make_unique<DownsampleStage>(
+            interner, std::chrono::milliseconds(downsampleMs),
+            parseDownsampleMode(envString("DOWNSAMPLE_MODE", "latest")),
+            envString("DOWNSAMPLE_FIELDS", "temperature,humidity"),
+            static_cast<size_t>(envLong("DOWNSAMPLE_MAX_DEVICES", 4096)),
+            std::chrono::milliseconds(envLong("DOWNSAMPLE_TICK_MS", 100)),
+            [sideOutput = hooks.sideOutput](const std::string& payload) { sideOutput("iot/data", payload); }));
+    }
+    applyStageBudgets(pipeline);
+    return pipeline;
+}
+
+// Estágios permitidos por rota (stages=a+b); vetor vazio: pipeline inteiro
+static std::vector<bool> routeStageMask(const TopicRoute& route,
+                                        const std::vector<std::unique_ptr<PipelineStage>>& pipeline) {
+    std::vector<bool> allowed;
+    if (route.stages.empty()) return allowed;
+    allowed.assign(pipeline.size(), false);
+    for (const auto& name : route.stages) {
+        bool found = false;
+        for (size_t i = 0; i < pipeline.size(); ++i) {
+            if (pipeline[i]->name() == name) allowed[i] = found = true;
+        }
+        if (!found) {
+            std::cerr << "[Middleware3] Route '" << route.pattern << "' names unknown stage '" << name << "'"
+                      << std::endl;
+        }
+    }
+    return allowed;
+}
+
+// ---------------------------------------------------------------------------
+// Modo thread-por-core (EXECUTION_MODE=per-core): cada core tem consumidor
+// próprio (assinatura compartilhada $share/middleware3/...), instância própria
+// do pipeline, interner e conexão de publish. Nada mutável é dividido no
+// caminho quente; com afinidade por dispositivo, a mensagem de um dispositivo
+// de outro core segue por um ring SPSC dedicado ao par (origem, destino).
+// O pipeline é o mesmo do modo normal; uma rota com lane=N fica no core N % cores.
+// ---------------------------------------------------------------------------
+
+class CoreRings {
+private:
+    size_t cores = 0;
+    std::vector<std::unique_ptr<ShmRing>> rings;  // [origem * cores + destino]
+
+public:
+    CoreRings(size_t coreCount, size_t capacity) : cores(coreCount) {
+        for (size_t i = 0; i < cores * cores; ++i) {
+            rings.push_back(i / cores == i % cores ? nullptr : std::make_unique<ShmRing>(capacity));
+        }
+    }
+
+    bool enabled() const { return !rings.empty(); }
+    ShmRing* ring(size_t from, size_t to) { return rings[from * cores + to].get(); }
+
+    // Páginas dos rings de entrada no nó NUMA do core que os consome
+    void prefaultInbound(size_t to) {
+        for (size_t from = 0; from < cores; ++from) {
+            if (from != to) ring(from, to)->prefault();
+        }
+    }
+};
+
+class CoreShard {
+public:
+    using Output = std::function<void(const std::string& topic, const std::string& payload)>;
+
+private:
+    const size_t index;
+    const size_t cores;
+    CoreRings& rings;
+    Output output;
+    DeviceInterner interner{static_cast<size_t>(envLong("DEVICE_INTERN_CAPACITY", 65536))};
+    Supervisor supervisor;
+    std::vector<std::unique_ptr<PipelineStage>> pipeline;
+    std::vector<TopicRoute> routes = parseTopicRoutes(envString("TOPIC_ROUTES", "iot/input"));
+    std::vector<std::vector<bool>> routeStages;  // paralelo a 'routes'
+    TopicTrie topicRoutes;
+    bool warmedUp = false;
+    std::chrono::steady_clock::time_point lastHealthCheck{};
+    const std::chrono::microseconds messageBudget = Deadline::budgetFromMillis(envLong("MESSAGE_BUDGET_MS", 0));
+    const std::string FALLBACK_TOPIC = envString("FALLBACK_TOPIC", "iot/fallback");
+    std::string inbound;
+
+    // Escritos só pela thread do core; atômicos apenas para o relatório
+    std::atomic<uint64_t> processed{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> handedOff{0};
+    std::atomic<uint64_t> spilled{0};  // ring cheio: processada no core de entrada
+
+public:
+    CoreShard(size_t coreIndex, size_t coreCount, CoreRings& coreRings, Output sink)
+        : index(coreIndex), cores(coreCount), rings(coreRings), output(std::move(sink)) {
+        // Tudo roda na thread do core: liberações e saídas laterais seguem direto
+        StageHooks hooks;
+        hooks.resume = [this](size_t stage, std::string payload, uint32_t device) {
+            run(stage + 1, std::move(payload), device, nullptr);
+        };
+        hooks.sideOutput = [this](const std::string& topic, const std::string& payload) { output(topic, payload); };
+        pipeline = buildStages(interner, supervisor, hooks);
+        for (size_t r = 0; r < routes.size(); ++r) {
+            topicRoutes.add(routes[r].pattern, static_cast<int>(r));
+            routeStages.push_back(routeStageMask(routes[r], pipeline));
+        }
+    }
+
+    const std::vector<TopicRoute>& subscriptions() const { return routes; }
+    uint64_t completed() const {
+        return processed.load(std::memory_order_relaxed) + rejected.load(std::memory_order_relaxed);
+    }
+
+    // Entrada do consumidor deste core; com afinidade, o dono do dispositivo
+    // é hash(device_id) % cores (ou o core da lane da rota) e as demais
+    // mensagens seguem pelo ring, prefixadas pelo índice da rota
+    void ingest(const std::string& topic, std::string payload) {
+        int r = topicRoutes.match(topic);
+        if (rings.enabled()) {
+            std::string_view id;
+            size_t owner = index;
+            if (r != TopicTrie::NO_ROUTE && routes[r].lane >= 0) {
+                owner = static_cast<size_t>(routes[r].lane) % cores;
+            } else if (r != TopicTrie::NO_ROUTE && routes[r].keyLevel >= 0
+                           ? topicLevel(topic, static_cast<size_t>(routes[r].keyLevel), id)
+                           : partitionKey(topic, payload, id)) {
+                owner = hashDeviceId(id) % cores;
+            }
+            if (owner != index) {
+                std::string framed(reinterpret_cast<const char*>(&r), sizeof(r));
+                framed += payload;
+                if (rings.ring(index, owner)->push(framed, 0)) {
+                    handedOff.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                spilled.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        process(std::move(payload), r);
+    }
+
+    // Mensagens entregues pelos outros cores e timers dos estágios
+    void poll(std::chrono::steady_clock::time_point now) {
+        if (rings.enabled()) {
+            for (size_t from = 0; from < cores; ++from) {
+                if (from == index) continue;
+                ShmRing* ring = rings.ring(from, index);
+                while (!ring->empty() && ring->pop(inbound, 0)) {
+                    int r;
+                    std::memcpy(&r, inbound.data(), sizeof(r));
+                    process(inbound.substr(sizeof(r)), r);
+                }
+            }
+        }
+        // Reservas dos workers isolados só depois que o core já está consumindo
+        if (!warmedUp) {
+            for (auto& stage : pipeline) stage->warmUp();
+            warmedUp = true;
+        }
+        // Saúde na mesma cadência de ~100 ms do modo normal
+        bool checkHealth = now - lastHealthCheck >= std::chrono::milliseconds(100);
+        if (checkHealth) lastHealthCheck = now;
+        for (auto& stage : pipeline) {
+            stage->onTick(now);
+            if (checkHealth && !stage->isHealthy()) supervisor.restartStage(*stage);
+        }
+    }
+
+    std::string report() const {
+        std::ostringstream out;
+        out << "core " << index << ": processed=" << processed.load() << " rejected=" << rejected.load()
+            << " handed_off=" << handedOff.load() << " spilled=" << spilled.load()
+            << " devices=" << interner.size();
+        return out.str();
+    }
+
+private:
+    void process(std::string payload, int route) {
+        std::string_view id;
+        uint32_t device = extractDeviceId(payload, id) ? interner.intern(id) : DeviceInterner::NONE;
+        const std::vector<bool>* allowed = route != TopicTrie::NO_ROUTE ? &routeStages[route] : nullptr;
+        run(0, std::move(payload), device, allowed);
+    }
+
+    // Executa a partir do estágio 'first'; uma mensagem liberada pela
+    // reordenação já foi contada ao ser retida e segue o pipeline inteiro
+    void run(size_t first, std::string payload, uint32_t device, const std::vector<bool>* allowed) {
+        const bool fresh = first == 0;
+        Deadline deadline = Deadline::within(messageBudget);
+        try {
+            for (size_t i = first; i < pipeline.size(); ++i) {
+                if (allowed && !allowed->empty() && !(*allowed)[i]) continue;
+                auto& stage = pipeline[i];
+                Deadline stageDeadline = deadline.narrowedTo(stage->budget());
+                std::string next = stage->process(payload, stageDeadline, device);
+                if (next.empty()) {
+                    if (fresh) processed.fetch_add(1, std::memory_order_relaxed);  // retida
+                    return;
+                }
+                // chamada que bloqueou além do prazo sem check(): vai para o fallback
+                if (stageDeadline.expired()) throw DeadlineExceeded(stage->name());
+                payload = std::move(next);
+            }
+        } catch (const DeadlineExceeded&) {
+            if (fresh) rejected.fetch_add(1, std::memory_order_relaxed);
+            output(FALLBACK_TOPIC, payload);
+            return;
+        } catch (const std::exception&) {
+            if (fresh) rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (fresh) processed.fetch_add(1, std::memory_order_relaxed);
+        output("iot/data", payload);
+    }
+};
+
+// Um consumidor, um shard e um publisher por core. Sem log por mensagem:
+// o lock do std::cout seria estado compartilhado no caminho quente
+// Estado por dispositivo (agregação, reordenação) e lanes fixas pedem
+// afinidade; CORE_DEVICE_AFFINITY força a escolha
+static bool coreDeviceAffinity() {
+    auto routes = parseTopicRoutes(envString("TOPIC_ROUTES", "iot/input"));
+    bool needsAffinity = envLong("DOWNSAMPLE_INTERVAL_MS", 0) > 0 || envLong("REORDER_LATENESS_MS", -1) >= 0 ||
+                         std::any_of(routes.begin(), routes.end(), [](const TopicRoute& r) { return r.lane >= 0; });
+    return envLong("CORE_DEVICE_AFFINITY", needsAffinity) != 0;
+}
+
+static void runPerCore(const std::string& brokerAddress) {
+    size_t cores = static_cast<size_t>(envLong("CORES", std::max(1u, std::thread::hardware_concurrency())));
+    bool affinity = coreDeviceAffinity();
+    CoreRings rings(affinity ? cores : 0, static_cast<size_t>(envLong("CORE_RING_BYTES", 1 << 18)));
+    std::cout << "[Middleware3] Per-core mode: " << cores << " core(s)"
+              << (affinity ? ", device affinity via rings" : "") << std::endl;
+
+    // Todos os clientes de todos os cores conectam juntos, antes das threads:
+    // uma falha definitiva sai pelo main em vez de derrubar uma thread
+    StartupTimer& startup = StartupTimer::instance();
+    startup.mark("init");
+    std::vector<std::unique_ptr<mqtt::async_client>> consumers;
+    std::vector<std::unique_ptr<mqtt::async_client>> publishers;
+    std::vector<std::pair<mqtt::async_client*, std::string>> clients;
+    for (size_t i = 0; i < cores; ++i) {
+        std::string id = "middleware3_core" + std::to_string(i);
+        consumers.push_back(std::make_unique<mqtt::async_client>(brokerAddress, id));
+        publishers.push_back(std::make_unique<mqtt::async_client>(brokerAddress, id + "_pub"));
+        clients.emplace_back(consumers.back().get(), id);
+        clients.emplace_back(publishers.back().get(), id + "_pub");
+    }
+    BrokerConnector("Middleware3", clients).connect();
+    startup.mark("connect");
+
+    std::atomic<size_t> ready{0};  // nenhum core publica em ring antes do prefault de todos
+    std::atomic<size_t> subscribed{0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cores; ++i) {
+        threads.emplace_back([&, i] {
+            mqtt::async_client& consumer = *consumers[i];
+            mqtt::async_client& publisher = *publishers[i];
+            // Fixado só depois do connect: as threads do Paho ficam no housekeeping.
+            // Shard e rings de entrada são alocados já no core (memória local)
+            ThreadPlacement::instance().pin("core");
+            // A partida fecha na primeira leitura entregue ao receiver por qualquer core
+            CoreShard shard(i, cores, rings, [&publisher, &startup](const std::string& topic, const std::string& payload) {
+                try {
+                    publisher.publish(topic, payload, 1, false)->wait();
+                    if (topic == "iot/data") startup.firstMessage();
+                } catch (const std::exception& e) {
+                    std::cerr << "[Middleware3] Core publish error: " << e.what() << std::endl;
+                }
+            });
+            if (rings.enabled()) rings.prefaultInbound(i);
+            ready.fetch_add(1);
+            while (ready.load() < cores) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            consumer.start_consuming();
+            std::vector<mqtt::token_ptr> subscriptions;
+            for (const auto& route : shard.subscriptions()) {
+                subscriptions.push_back(consumer.subscribe("$share/middleware3/" + route.pattern, 1));
+            }
+            for (auto& token : subscriptions) token->wait();
+            if (subscribed.fetch_add(1) + 1 == cores) {
+                startup.mark("subscribe");
+                startup.ready();
+            }
+            // Com afinidade o consumo espera pouco: os rings também precisam ser drenados
+            auto wait = std::chrono::milliseconds(affinity ? 1 : 100);
+            SpinWait spin(busyPollBudget());
+            auto lastReport = std::chrono::steady_clock::now();
+            while (true) {
+                mqtt::const_message_ptr msg;
+                bool received = spin.spinning() ? consumer.try_consume_message(&msg)
+                                                : consumer.try_consume_message_for(&msg, wait);
+                if (received && msg) {
+                    shard.ingest(msg->get_topic(), msg->to_string());
+                    spin.worked();
+                } else if (spin.spinning()) {
+                    spin.relax();
+                }
+                auto now = std::chrono::steady_clock::now();
+                shard.poll(now);
+                if (now - lastReport >= std::chrono::seconds(10)) {
+                    std::cout << "[Middleware3] " << shard.report() << std::endl;
+                    lastReport = now;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+// Escalabilidade do modo por core sem broker: cada core consome sua fatia de
+// mensagens sintéticas e publica num contador local. Com afinidade, (N-1)/N
+// das mensagens cruzam um ring até o core dono do dispositivo
+static void runCoreScalingBench(long messages) {
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 4096; ++i) {
+        payloads.push_back("{\"seq\": " + std::to_string(i) + ", \"device_id\": \"device_" +
+                           std::to_string(i % 1000) + "\", \"timestamp\": \"2024-01-01T12:00:00.000000+00:00\", "
+                           "\"temperature\": 24.5, \"humidity\": 55.1, \"status\": \"normal\"}");
+    }
+    size_t maxCores = static_cast<size_t>(envLong("CORES", std::max(1u, std::thread::hardware_concurrency())));
+    std::vector<size_t> steps;
+    for (size_t cores = 1; cores < maxCores; cores *= 2) steps.push_back(cores);
+    steps.push_back(maxCores);
+    for (bool affinity : {false, true}) {
+        double baseline = 0.0;
+        for (size_t cores : steps) {
+            CoreRings rings(affinity ? cores : 0, 1 << 18);
+            std::vector<std::unique_ptr<CoreShard>> shards;
+            for (size_t i = 0; i < cores; ++i) {
+                shards.push_back(std::make_unique<CoreShard>(i, cores, rings, [](const std::string&, const std::string&) {}));
+            }
+            auto total = [&] {
+                uint64_t done = 0;
+                for (auto& shard : shards) done += shard->completed();
+                return done;
+            };
+            std::vector<std::thread> threads;
+            auto started = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < cores; ++i) {
+                threads.emplace_back([&, i] {
+                    CoreShard& shard = *shards[i];
+                    for (long n = static_cast<long>(i); n < messages; n += static_cast<long>(cores)) {
+                        shard.ingest("iot/input", payloads[static_cast<size_t>(n) % payloads.size()]);
+                        if ((n & 63) == 0) shard.poll(std::chrono::steady_clock::now());
+                    }
+                    while (total() < static_cast<uint64_t>(messages)) shard.poll(std::chrono::steady_clock::now());
+                });
+            }
+            for (auto& thread : threads) thread.join();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            double rate = messages / seconds;
+            if (cores == 1) baseline = rate;
+            std::cout << "[Middleware3][core-bench] affinity=" << (affinity ? "on" : "off") << " cores=" << cores
+                      << " " << static_cast<long>(rate) << " msg/s speedup=" << rate / baseline
+                      << "x efficiency=" << 100.0 * rate / baseline / cores << "%" << std::endl;
+        }
+    }
+}
+
+// Destino do soak no lugar do publish no broker. Na fase de queda cada
+// entrega fica presa SOAK_OUTAGE_STALL_MS, como o wait() de um publish sem
+// PUBACK: o bulkhead de publish enche até a política de saturação agir e,
+// com caller_runs, a pressão volta aos cores e aos rings
+class SoakReceiver {
+private:
+    std::atomic<bool> down{false};
+    const std::chrono::milliseconds stall;
+    const std::string fallbackTopic;
+    LatencyTracker& latency;
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> fallback{0};
+
+public:
+    SoakReceiver(LatencyTracker& tracker, std::chrono::milliseconds outageStall, std::string fallbackTo)
+        : stall(outageStall), fallbackTopic(std::move(fallbackTo)), latency(tracker) {}
+
+    void setDown(bool value) { down.store(value, std::memory_order_relaxed); }
+    uint64_t deliveredCount() const { return delivered.load(std::memory_order_relaxed); }
+    uint64_t fallbackCount() const { return fallback.load(std::memory_order_relaxed); }
+
+    void deliver(const std::string& topic, const std::string& payload) {
+        if (down.load(std::memory_order_relaxed)) std::this_thread::sleep_for(stall);
+        if (topic == fallbackTopic) {
+            fallback.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (topic != "iot/data") return;  // saídas laterais dos estágios
+        std::chrono::steady_clock::duration since;
+        if (soak::sinceSent(payload, since)) latency.record(since);
+        delivered.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Soak do modo por core sem broker: cada core gera sua fatia do tráfego nos
+// ciclos de soak.h e a passa pelo CoreShard (rings, pipeline e estágios
+// configurados); a saída segue pelo bulkhead de publish para o SoakReceiver.
+// A thread principal amostra memória, fila do publish e p99 de entrega e, ao
+// fim, sinaliza tendências de alta entre ciclos. Retorna false se houve alguma
+static bool runSoak(long seconds) {
+    const double rate = soak::setting("SOAK_RATE", 50);
+    const double overloadFactor = soak::setting("SOAK_OVERLOAD_FACTOR", 4);
+    const double cycleSeconds = soak::setting("SOAK_CYCLE_SECONDS", 600);
+    const auto sampleInterval = std::chrono::duration<double>(soak::setting("SOAK_SAMPLE_SECONDS", 10));
+    const size_t cores = static_cast<size_t>(envLong("CORES", std::max(1u, std::thread::hardware_concurrency())));
+    const bool affinity = coreDeviceAffinity();
+    auto routes = parseTopicRoutes(envString("TOPIC_ROUTES", "iot/input"));
+    const std::string topic = routes.front().pattern.find_first_of("+#") == std::string::npos
+                                  ? routes.front().pattern : "iot/input";
+    const std::vector<std::string> replay = soak::loadReplay("Middleware3", envString("SOAK_REPLAY", ""));
+    std::ofstream csv(envString("SOAK_CSV", "/tmp/middleware3-soak.csv"), std::ios::trunc);
+    csv << "elapsed_s,cycle,phase,rss_mb,heap_arena_mb,heap_inuse_mb,heap_free_mb,heap_mmap_mb,"
+           "fragmentation,publish_queue,generated,delivered,fallback,p99_us\n";
+
+    LatencyTracker deliveryLatency(4096);
+    SoakReceiver receiver(deliveryLatency, std::chrono::milliseconds(envLong("SOAK_OUTAGE_STALL_MS", 100)),
+                          envString("FALLBACK_TOPIC", "iot/fallback"));
+    auto configs = parseBulkheadConfigs(envString("BULKHEADS", ""));
+    auto configured = configs.find("publish");
+    BulkheadConfig pc = configured != configs.end() ? configured->second : PUBLISH_BULKHEAD;
+    Bulkhead publish("publish", pc.threads, pc.queue, pc.policy, busyPollBudget(), bulkheadQueueBytes());
+
+    CoreRings rings(affinity ? cores : 0, static_cast<size_t>(envLong("CORE_RING_BYTES", 1 << 18)));
+    std::vector<std::unique_ptr<CoreShard>> shards;
+    for (size_t i = 0; i < cores; ++i) {
+        shards.push_back(std::make_unique<CoreShard>(i, cores, rings,
+            [&publish, &receiver](const std::string& to, const std::string& payload) {
+                publish.submit([&receiver, to, payload] { receiver.deliver(to, payload); }, to.size() + payload.size());
+            }));
+    }
+    std::cout << "[Middleware3][soak] " << seconds << "s at " << rate << " msg/s on " << cores << " core(s)"
+              << (affinity ? " with device affinity" : "") << ", cycle " << cycleSeconds << "s, overload x"
+              << overloadFactor << ", "
+              << (replay.empty() ? std::string("synthetic readings") : std::to_string(replay.size()) + " replayed payloads")
+              << std::endl;
+
+    auto started = std::chrono::steady_clock::now();
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> generated{0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < cores; ++i) {
+        threads.emplace_back([&, i] {
+            ThreadPlacement::instance().pin("core");
+            CoreShard& shard = *shards[i];
+            if (rings.enabled()) rings.prefaultInbound(i);
+            // Cada core segue o relógio do ciclo sozinho; a fase só muda a taxa
+            int phase = -1;
+            auto phaseStarted = started;
+            double phaseSent = 0;
+            uint64_t seq = i;
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto now = std::chrono::steady_clock::now();
+                double cycles = std::chrono::duration<double>(now - started).count() / cycleSeconds;
+                int nowPhase = soak::phaseAt(cycles - std::floor(cycles));
+                if (nowPhase != phase) {
+                    phase = nowPhase;
+                    phaseStarted = now;
+                    phaseSent = 0;
+                }
+                double phaseRate = (phase == soak::OVERLOAD ? rate * overloadFactor : rate) / cores;
+                double due = std::chrono::duration<double>(now - phaseStarted).count() * phaseRate;
+                while (phaseSent < due) {
+                    shard.ingest(topic, replay.empty() ? soak::syntheticReading(seq)
+                                                       : soak::stamp(replay[seq % replay.size()]));
+                    seq += cores;
+                    phaseSent += 1;
+                    generated.fetch_add(1, std::memory_order_relaxed);
+                }
+                shard.poll(now);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+
+    std::vector<SoakBaseline> baselines;
+    SoakBaseline current;
+    auto nextSample = started;
+    auto lastSample = started;
+    int phase = -1;
+    long cycle = 0;
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - started).count();
+        long nowCycle = static_cast<long>(elapsed / cycleSeconds);
+        int nowPhase = soak::phaseAt(elapsed / cycleSeconds - nowCycle);
+
+        if (nowCycle != cycle) {
+            // linha de base do ciclo: memória e fila depois da recuperação
+            HeapStats heap = HeapStats::sample();
+            current.rssMb = heap.rssMb;
+            current.heapInUseMb = heap.inUseMb;
+            current.fragmentation = heap.fragmentation();
+            current.queueDepth = static_cast<double>(publish.depth());
+            baselines.push_back(current);
+            std::cout << "[Middleware3][soak] cycle " << cycle << " baseline: rss=" << current.rssMb
+                      << "MB heap_inuse=" << current.heapInUseMb << "MB frag=" << current.fragmentation
+                      << " queued=" << current.queueDepth << " normal_p99=" << current.p99Micros << "us"
+                      << std::endl;
+            current = SoakBaseline();
+            cycle = nowCycle;
+        }
+        if (elapsed >= seconds) break;
+        if (nowPhase != phase) {
+            if (phase == soak::NORMAL) current.p99Micros = static_cast<double>(deliveryLatency.p99Micros());
+            phase = nowPhase;
+            if (phase == soak::NORMAL) deliveryLatency.reset();
+            receiver.setDown(phase == soak::OUTAGE);
+            std::cout << "[Middleware3][soak] cycle " << cycle << " phase " << soak::phaseName(phase) << std::endl;
+        }
+
+        if (now >= nextSample) {
+            nextSample += std::chrono::duration_cast<std::chrono::steady_clock::duration>(sampleInterval);
+            HeapStats heap = HeapStats::sample();
+            csv << static_cast<long>(elapsed) << "," << cycle << "," << soak::phaseName(phase) << "," << heap.rssMb
+                << "," << heap.arenaMb << "," << heap.inUseMb << "," << heap.freeMb << "," << heap.mmapMb << ","
+                << heap.fragmentation() << "," << publish.depth() << "," << generated.load() << ","
+                << receiver.deliveredCount() << "," << receiver.fallbackCount() << "," << deliveryLatency.p99Micros()
+                << std::endl;
+            std::cout << "[Middleware3][soak] t=" << static_cast<long>(elapsed) << "s " << soak::phaseName(phase)
+                      << " rss=" << heap.rssMb << "MB heap_inuse=" << heap.inUseMb << "MB heap_free="
+                      << heap.freeMb << "MB frag=" << heap.fragmentation() << " publish_queue=" << publish.depth()
+                      << " delivered=" << receiver.deliveredCount() << " fallback=" << receiver.fallbackCount()
+                      << " p99=" << deliveryLatency.p99Micros() << "us" << std::endl;
+            std::cout << publish.report(now - lastSample) << std::endl;
+            lastSample = now;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    stop.store(true);
+    receiver.setDown(false);
+    for (auto& thread : threads) thread.join();
+    for (auto& shard : shards) std::cout << "[Middleware3][soak] " << shard->report() << std::endl;
+
+    bool flagged = soak::reportTrends("Middleware3", baselines);
+    std::cout << "[Middleware3][soak] " << (flagged ? "FLAGGED" : "PASS") << " after " << baselines.size()
+              << " cycle(s), " << generated.load() << " messages, " << receiver.deliveredCount() << " delivered"
+              << std::endl;
+    return !flagged;
+}
+
+class MQTTMiddleware {
+private:
+    mqtt::async_client client;
+    mqtt::async_client sender_client;
+    // Antes do pipeline: estágios guardam referência e o id viaja em cada job
+    DeviceInterner interner{static_cast<size_t>(envLong("DEVICE_INTERN_CAPACITY", 65536))};
+    std::vector<std::unique_ptr<PipelineStage>> pipeline;
+    Supervisor supervisor;
+
+    // Orçamento total por mensagem; estouros seguem para o tópico de fallback
+    const std::chrono::microseconds messageBudget =
+        Deadline::budgetFromMillis(envLong("MESSAGE_BUDGET_MS", 0));
+    const std::string FALLBACK_TOPIC = envString("FALLBACK_TOPIC", "iot/fallback");
+    std::mutex overrunMtx;
+    std::map<std::string, uint64_t> overruns;
+
+    // Declarados por último: as threads param antes do pipeline e dos clientes
+    std::map<std::string, std::unique_ptr<Bulkhead>> bulkheads;
+    std::vector<Bulkhead*> stageBulkhead;  // bulkhead de cada estágio do pipeline
+    Bulkhead* publishBulkhead = nullptr;
+    // PARTITION_LANES=N: uma thread por lane; o dispositivo define a lane
+    std::vector<Bulkhead*> lanes;
+
+    // Perfil por estágio e ordem de execução vigente (índices em 'pipeline')
+    std::unique_ptr<StageProfile[]> profiles;
+    std::shared_ptr<const std::vector<size_t>> stageOrder;
+    const bool reorderEnabled = envLong("PIPELINE_REORDER", 1) != 0;
+    const long reorderMinSamples = envLong("PIPELINE_REORDER_MIN_SAMPLES", 100);
+
+    DeviceSketch deviceSketch{static_cast<size_t>(std::max(1L, envLong("HOT_DEVICES_K", 64)))};
+
+    // Rotas por filtro de tópico; cada uma guarda a ordem vigente já filtrada
+    // pelos seus estágios, refeita quando o replanejamento troca a ordem
+    struct RoutePlan {
+        std::vector<bool> allowed;  // vazio: todos os estágios
+        std::shared_ptr<const std::vector<size_t>> source;
+        std::shared_ptr<const std::vector<size_t>> order;
+    };
+    std::vector<TopicRoute> routes = parseTopicRoutes(envString("TOPIC_ROUTES", "iot/input"));
+    std::vector<RoutePlan> routePlans;
+    TopicTrie topicRoutes;
+
+public:
+    // O pipeline é montado em start(), enquanto os CONNECTs estão em voo
+    MQTTMiddleware(const std::string& brokerAddress) 
+        : client(brokerAddress, "middleware3"),
+          sender_client(brokerAddress, "middleware3_sender") 
+    {}
+
+    void start() {
+        StartupTimer& startup = StartupTimer::instance();
+        startup.mark("init");
+        // Consumidor e publicador conectam em paralelo; a montagem do pipeline
+        // (workers, registro, regras, bulkheads) ocupa o tempo dos handshakes
+        BrokerConnector connector("Middleware3", {{&client, "consumer"}, {&sender_client, "publisher"}});
+        connector.begin();
+        buildPipeline();
+        startup.mark("pipeline");
+        connector.finish();
+        startup.mark("connect");
+
+        // Alinha com middleware1: consumir por fila interna
+        client.start_consuming();
+        // Depois dos connects: as threads do Paho herdaram a máscara de housekeeping
+        ThreadPlacement::instance().pin("consumer");
+
+        // Todos os SUBSCRIBEs saem antes de esperar pelos SUBACKs
+        std::vector<mqtt::token_ptr> subscriptions;
+        for (const auto& r : routes) subscriptions.push_back(client.subscribe(r.pattern, 1));
+        for (size_t i = 0; i < routes.size(); ++i) {
+            subscriptions[i]->wait();
+            std::cout << "[Middleware3] Subscribed to topic: " << routes[i].pattern << std::endl;
+        }
+        startup.mark("subscribe");
+        startup.ready();
+        auto subscribedAt = std::chrono::steady_clock::now();
+        bool warmedUp = false;
+
+        SpinWait spin(busyPollBudget());
+        if (spin.enabled()) std::cout << "[Middleware3] Busy-poll ingest enabled" << std::endl;
+        auto lastReport = std::chrono::steady_clock::now();
+        auto lastHealthCheck = lastReport;
+        while (true) {
+            // Espera limitada: os timers dos estágios (onTick) avançam mesmo sem tráfego.
+            // Em busy-poll a fila é consultada sem esperar enquanto houve tráfego recente
+            mqtt::const_message_ptr msg;
+            bool received = spin.spinning() ? client.try_consume_message(&msg)
+                                            : client.try_consume_message_for(&msg, std::chrono::milliseconds(100));
+            if (received && msg) {
+                // o log por mensagem custaria mais que todo o orçamento do busy-poll
+                if (!spin.enabled()) {
+                    std::cout << "[Middleware3] Message received on topic '" 
+                              << msg->get_topic() << "': " << msg->to_string() << std::endl;
+                }
+                route(msg->get_topic(), msg->to_string());
+                spin.worked();
+            } else if (spin.spinning()) {
+                spin.relax();
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (!warmedUp && (startup.done() || now - subscribedAt >= std::chrono::seconds(1))) {
+                for (auto& stage : pipeline) stage->warmUp();
+                warmedUp = true;
+            }
+            // Em busy-poll os timers mantêm a cadência de ~100 ms do modo normal
+            if (!spin.enabled() || now - lastHealthCheck >= std::chrono::milliseconds(100)) {
+                checkPipelineHealth();
+                lastHealthCheck = now;
+            }
+            if (now - lastReport >= std::chrono::seconds(10)) {
+                for (auto& entry : bulkheads) {
+                    std::cout << entry.second->report(now - lastReport) << std::endl;
+                }
+                replanStageOrder();
+                std::cout << "[Middleware3] Device stats: " << deviceSketch.report(5) << std::endl;
+                lastReport = now;
+            }
+            if (!spin.enabled()) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+private:
+    void buildPipeline() {
+        StageHooks hooks;
+        hooks.resume = [this](size_t index, std::string payload, uint32_t device) {
+            resumeAfter(index, std::move(payload), device);
+        };
+        hooks.sideOutput = [this](const std::string& topic, const std::string& payload) {
+            publishBulkhead->submit([this, topic, payload] { publishSideOutput(topic, payload); },
+                                    topic.size() + payload.size());
+        };
+        pipeline = buildStages(interner, supervisor, hooks);
+        buildBulkheads();
+
+        profiles.reset(new StageProfile[pipeline.size()]);
+        std::vector<size_t> declared(pipeline.size());
+        for (size_t i = 0; i < declared.size(); ++i) declared[i] = i;
+        stageOrder = std::make_shared<const std::vector<size_t>>(declared);
+        buildRoutes();
+    }
+
+    // BULKHEADS="nome:threads:fila:política,..." (reject|drop_oldest|caller_runs)
+    // BULKHEAD_GROUPS="estágio=bulkhead,..." agrupa estágios num mesmo bulkhead;
+    // por padrão cada estágio tem o seu e o publish usa o bulkhead "publish"
+    // BULKHEAD_MAX_MB limita a fila de cada bulkhead também em bytes de payload
+    void buildBulkheads() {
+        const size_t queueBytes = bulkheadQueueBytes();
+        std::map<std::string, BulkheadConfig> configs = parseBulkheadConfigs(envString("BULKHEADS", ""));
+        std::map<std::string, std::string> groups;
+        std::stringstream gs(envString("BULKHEAD_GROUPS", ""));
+        std::string item;
+        while (std::getline(gs, item, ',')) {
+            auto eq = item.find('=');
+            if (eq != std::string::npos) groups[item.substr(0, eq)] = item.substr(eq + 1);
+        }
+
+        auto obtain = [&](const std::string& name, BulkheadConfig fallback) {
+            auto& slot = bulkheads[name];
+            if (!slot) {
+                auto it = configs.find(name);
+                BulkheadConfig c = it != configs.end() ? it->second : fallback;
+                slot = std::make_unique<Bulkhead>(name, c.threads, c.queue, c.policy, busyPollBudget(), queueBytes);
+            }
+            return slot.get();
+        };
+        for (auto& stage : pipeline) {
+            auto it = groups.find(stage->name());
+            std::string name = it != groups.end() ? it->second : stage->name();
+            stageBulkhead.push_back(obtain(name, {1, 256, SaturationPolicy::Reject}));
+        }
+        publishBulkhead = obtain("publish", PUBLISH_BULKHEAD);
+        long laneCount = envLong("PARTITION_LANES", 0);
+        for (long i = 0; i < laneCount; ++i) {
+            lanes.push_back(obtain("lane-" + std::to_string(i), {1, 1024, SaturationPolicy::Reject}));
+        }
+    }
+
+    void buildRoutes() {
+        for (size_t r = 0; r < routes.size(); ++r) {
+            topicRoutes.add(routes[r].pattern, static_cast<int>(r));
+            RoutePlan plan;
+            plan.allowed = routeStageMask(routes[r], pipeline);
+            routePlans.push_back(std::move(plan));
+        }
+    }
+
+    // Ordem de estágios da rota; mensagens retidas e liberadas depois por um
+    // estágio (reordenação) seguem a ordem completa a partir dele
+    std::shared_ptr<const std::vector<size_t>> orderFor(int route) {
+        auto current = std::atomic_load(&stageOrder);
+        if (route == TopicTrie::NO_ROUTE || routePlans[route].allowed.empty()) return current;
+        RoutePlan& plan = routePlans[route];
+        if (plan.source != current) {
+            std::vector<size_t> filtered;
+            for (size_t index : *current) {
+                if (plan.allowed[index]) filtered.push_back(index);
+            }
+            plan.order = std::make_shared<const std::vector<size_t>>(std::move(filtered));
+            plan.source = std::move(current);
+        }
+        return plan.order;
+    }
+
+    // Entrada: a rota vem da trie de filtros; só a chave de partição é lida
+    // aqui (nível do tópico ou varredura do payload) e internada uma única
+    // vez; o parse completo fica nos estágios, executados pela lane dona do
+    // dispositivo quando há lanes
+    void route(const std::string& topic, std::string payload) {
+        int r = topicRoutes.match(topic);
+        const TopicRoute* matched = r != TopicTrie::NO_ROUTE ? &routes[r] : nullptr;
+        uint32_t device = DeviceInterner::NONE;
+        std::string_view id;
+        bool keyed = matched && matched->keyLevel >= 0
+                         ? topicLevel(topic, static_cast<size_t>(matched->keyLevel), id)
+                         : partitionKey(topic, payload, id);
+        if (keyed) {
+            uint64_t hash = hashDeviceId(id);
+            deviceSketch.observe(id, hash);
+            device = interner.intern(id, hash);
+        }
+        auto order = orderFor(r);
+        if (lanes.empty()) {
+            processMessage(std::move(payload), device, std::move(order), false);
+            return;
+        }
+        size_t index = device == DeviceInterner::NONE ? 0 : device;
+        if (matched && matched->lane >= 0) index = static_cast<size_t>(matched->lane);
+        Bulkhead* lane = lanes[index % lanes.size()];
+        size_t bytes = payload.size();
+        bool accepted = lane->submit([this, payload = std::move(payload), device, order = std::move(order)]() mutable {
+            processMessage(std::move(payload), device, std::move(order), true);
+        }, bytes);
+        if (!accepted) {
+            std::cerr << "[Middleware3] Lane '" << lane->name() << "' saturated - message rejected" << std::endl;
+        }
+    }
+
+    void processMessage(std::string payload, uint32_t device,
+                        std::shared_ptr<const std::vector<size_t>> order, bool onLane) {
+        auto job = std::make_shared<PipelineJob>(PipelineJob{
+            std::move(payload), Deadline::within(messageBudget), std::move(order), device, onLane});
+        dispatch(0, job);
+    }
+
+    // Reinsere no pipeline, logo após o estágio 'index', uma mensagem que ele
+    // havia retido (ex.: reordenação); o orçamento recomeça na liberação
+    void resumeAfter(size_t index, std::string payload, uint32_t device) {
+        auto order = std::atomic_load(&stageOrder);
+        size_t position = std::find(order->begin(), order->end(), index) - order->begin();
+        auto job = std::make_shared<PipelineJob>(PipelineJob{
+            std::move(payload), Deadline::within(messageBudget), std::move(order), device});
+        dispatch(position + 1, job);
+    }
+
+    // Entrega o job ao bulkhead da posição 'position' da sua ordem (ou do publish, ao final)
+    void dispatch(size_t position, std::shared_ptr<PipelineJob> job) {
+        const auto& order = *job->order;
+        if (job->onLane && position < order.size()) {
+            runSegment(position, job);  // a lane executa os estágios sem trocar de thread
+            return;
+        }
+        Bulkhead* target = position < order.size() ? stageBulkhead[order[position]] : publishBulkhead;
+        bool accepted = target->submit([this, position, job] {
+            if (position < job->order->size()) {
+                runSegment(position, job);
+            } else {
+                publish(*job);
+            }
+        }, job->payload.size());
+        if (!accepted) {
+            std::cerr << "[Middleware3] Bulkhead '" << target->name()
+                      << "' saturated - message rejected" << std::endl;
+        }
+    }
+
+    // Executa os estágios consecutivos (na ordem do job) que compartilham o bulkhead atual
+    void runSegment(size_t position, const std::shared_ptr<PipelineJob>& job) {
+        const auto& order = *job->order;
+        Bulkhead* current = stageBulkhead[order[position]];
+        try {
+            job->deadline.check("queue of bulkhead '" + current->name() + "'");
+            while (position < order.size() && stageBulkhead[order[position]] == current) {
+                size_t index = order[position];
+                auto& stage = pipeline[index];
+                StageProfile& profile = profiles[index];
+                Deadline stageDeadline = job->deadline.narrowedTo(stage->budget());
+                auto started = std::chrono::steady_clock::now();
+                auto account = [&] {
+                    profile.nanos.fetch_add(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - started).count()),
+                        std::memory_order_relaxed);
+                    profile.calls.fetch_add(1, std::memory_order_relaxed);
+                };
+                std::string output;
+                try {
+                    output = stage->process(job->payload, stageDeadline, job->device);
+                } catch (const DeadlineExceeded&) {
+                    account();
+                    throw;
+                } catch (const std::exception&) {
+                    profile.rejections.fetch_add(1, std::memory_order_relaxed);
+                    account();
+                    throw;
+                }
+                account();
+                if (output.empty()) {
+                    // estágio reteve a mensagem (ex.: downsampling); nada a publicar
+                    profile.retentions.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                if (stageDeadline.expired()) throw DeadlineExceeded(stage->name());
+                job->payload = std::move(output);
+                ++position;
+            }
+        } catch (const DeadlineExceeded& e) {
+            std::string reason = e.what();
+            publishBulkhead->submit([this, job, reason] { routeToFallback(job->payload, reason); },
+                                    job->payload.size());
+            return;
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Pipeline error: " << e.what() << std::endl;
+            return;
+        }
+        dispatch(position, job);
+    }
+
+    // Recalcula a ordem a partir do perfil do último intervalo
+    void replanStageOrder() {
+        std::vector<StageOrderPlanner::Sample> samples;
+        bool enough = true;
+        for (size_t i = 0; i < pipeline.size(); ++i) {
+            uint64_t calls = profiles[i].calls.exchange(0);
+            uint64_t rejections = profiles[i].rejections.exchange(0);
+            uint64_t retentions = profiles[i].retentions.exchange(0);
+            uint64_t nanos = profiles[i].nanos.exchange(0);
+            if (calls < static_cast<uint64_t>(reorderMinSamples)) enough = false;
+            uint64_t passed = calls - std::min(calls, rejections);
+            samples.push_back({calls ? static_cast<double>(nanos) / calls : 0.0,
+                               calls ? static_cast<double>(passed) / calls : 1.0,
+                               calls ? static_cast<double>(retentions) / calls : 0.0});
+        }
+        if (!reorderEnabled || !enough) return;
+
+        auto planned = StageOrderPlanner::plan(pipeline, samples);
+        if (planned == *std::atomic_load(&stageOrder)) return;
+        std::atomic_store(&stageOrder, std::make_shared<const std::vector<size_t>>(planned));
+
+        std::ostringstream out;
+        out << "[Middleware3] Stage order:";
+        for (size_t k = 0; k < planned.size(); ++k) {
+            const auto& sample = samples[planned[k]];
+            out << (k ? " ->" : "") << " " << pipeline[planned[k]]->name()
+                << " (" << sample.costNanos / 1000.0 << "us, pass " << 100.0 * sample.passRate << "%";
+            if (sample.heldRate > 0) out << ", held " << 100.0 * sample.heldRate << "%";
+            out << ")";
+        }
+        std::cout << out.str() << std::endl;
+    }
+
+    void publish(const PipelineJob& job) {
+        try {
+            sender_client.publish("iot/data", job.payload, 1, false)->wait();
+            StartupTimer::instance().firstMessage();
+            std::cout << "[Middleware3] Forwarded processed message to receiver" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Publish error: " << e.what() << std::endl;
+        }
+    }
+
+    // Publicações emitidas pelos próprios estágios (regras, agregados)
+    void publishSideOutput(const std::string& topic, const std::string& payload) {
+        try {
+            sender_client.publish(topic, payload, 1, false)->wait();
+            if (topic == "iot/data") StartupTimer::instance().firstMessage();  // agregado do downsampling
+            std::cout << "[Middleware3] Stage output published to " << topic << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Stage output publish error: " << e.what() << std::endl;
+        }
+    }
+
+    // Encaminha o último resultado completo (antes do estágio que estourou)
+    void routeToFallback(const std::string& partial, const std::string& reason) {
+        uint64_t count;
+        {
+            std::lock_guard<std::mutex> lock(overrunMtx);
+            count = ++overruns[reason];
+        }
+        std::cerr << "[Middleware3] " << reason << " (" << count << " overruns) - routing to "
+                  << FALLBACK_TOPIC << std::endl;
+        try {
+            sender_client.publish(FALLBACK_TOPIC, partial, 1, false)->wait();
+        } catch (const std::exception& e) {
+            std::cerr << "[Middleware3] Fallback publish error: " << e.what() << std::endl;
+        }
+    }
+
+    void checkPipelineHealth() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& stage : pipeline) {
+            stage->onTick(now);
+            if (!stage->isHealthy()) {
+                std::cout << "[Middleware3] Stage failed, restarting..." << std::endl;
+                supervisor.restartStage(*stage);
+            }
+        }
+    }
+};
+
+int main() {
+    StartupTimer::instance("Middleware3");
+
+    long shmBenchMessages = envLong("SHM_RING_BENCH_MESSAGES", 0);
+    if (shmBenchMessages > 0) {
+        runShmRingBench(shmBenchMessages, static_cast<size_t>(envLong("SHM_RING_BENCH_SIZE", 256)));
+    }
+    long internBenchMessages = envLong("INTERN_BENCH_MESSAGES", 0);
+    if (internBenchMessages > 0) {
+        runInternBench(internBenchMessages);
+    }
+    long topicBenchMatches = envLong("TOPIC_BENCH_MATCHES", 0);
+    if (topicBenchMatches > 0) {
+        runTopicMatchBench(topicBenchMatches);
+    }
+    long partitionBenchMessages = envLong("PARTITION_BENCH_MESSAGES", 0);
+    if (partitionBenchMessages > 0) {
+        runPartitionBench(partitionBenchMessages);
+    }
+    long validatorBenchMessages = envLong("VALIDATOR_BENCH_MESSAGES", 0);
+    if (validatorBenchMessages > 0) {
+        runValidatorBench(validatorBenchMessages);
+    }
+    long reorderBenchMessages = envLong("REORDER_BENCH_MESSAGES", 0);
+    if (reorderBenchMessages > 0) {
+        runReorderBench(reorderBenchMessages);
+    }
+    long rulesBenchMessages = envLong("RULES_BENCH_MESSAGES", 0);
+    if (rulesBenchMessages > 0) {
+        runRuleBench(envString("RULES_PATH", ""), rulesBenchMessages);
+    }
+    long registryBenchLookups = envLong("REGISTRY_BENCH_LOOKUPS", 0);
+    if (registryBenchLookups > 0) {
+        runRegistryBench(envString("DEVICE_REGISTRY_PATH", "/data/devices.reg"), registryBenchLookups);
+    }
+
+    long busyPollBenchMessages = envLong("BUSY_POLL_BENCH_MESSAGES", 0);
+    if (busyPollBenchMessages > 0) {
+        runBusyPollBench(busyPollBenchMessages);
+    }
+    long placementBenchMessages = envLong("PLACEMENT_BENCH_MESSAGES", 0);
+    if (placementBenchMessages > 0) {
+        runPlacementBench(placementBenchMessages);
+    }
+    long coreBenchMessages = envLong("CORE_BENCH_MESSAGES", 0);
+    if (coreBenchMessages > 0) {
+        runCoreScalingBench(coreBenchMessages);
+    }
+
+    // Antes de criar as threads do middleware: clientes e auxiliares herdam a
+    // máscara de housekeeping
+    if (ThreadPlacement::instance().isolateHousekeeping()) {
+        std::cout << "[Middleware3] Main and helper threads restricted to housekeeping CPUs" << std::endl;
+    }
+
+    // SOAK_SECONDS > 0: execução longa do modo por core sem broker; o código
+    // de saída reflete o veredito (2 = tendência sinalizada)
+    long soakSeconds = envLong("SOAK_SECONDS", 0);
+    if (soakSeconds > 0) {
+        return runSoak(soakSeconds) ? 0 : 2;
+    }
+    try {
+        if (envString("EXECUTION_MODE", "") == "per-core") {
+            runPerCore("tcp://mosquitto:1883");
+            return 0;
+        }
+        MQTTMiddleware middleware("tcp://mosquitto:1883");
+        middleware.start();
+    } catch (const std::exception& e) {
+        std::cerr << "[Middleware3] Startup failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
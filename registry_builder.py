@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# registry_builder.py
+#
+# Gera o registro binário de dispositivos lido pelo EnrichmentStage do
+# middleware3 (DEVICE_REGISTRY_PATH). Formato: header "DREG" + registros de
+# 64 bytes ordenados por device_id. A escrita é atômica (arquivo temporário +
+# rename), então o middleware pode recarregar com o arquivo em uso.
+#
+# Entrada opcional: CSV com colunas device_id,site,unit,calibration_offset.
+# Sem CSV, gera device_1..device_N compatíveis com o sender.
+
+import argparse
+import csv
+import os
+import random
+import struct
+
+MAGIC = b"DREG"
+VERSION = 1
+RECORD = struct.Struct("<32s20s8sf")  # device_id, site, unit, calibration_offset
+
+def synthetic_devices(n):
+    sites = ["lab-a", "lab-b", "warehouse", "greenhouse"]
+    rnd = random.Random(42)
+    return [{
+        "device_id": f"device_{i}",
+        "site": sites[i % len(sites)],
+        "unit": "celsius",
+        "calibration_offset": round(rnd.uniform(-0.5, 0.5), 3),
+    } for i in range(1, n + 1)]
+
+def read_csv(path):
+    with open(path, newline="") as f:
+        return [{
+            "device_id": row["device_id"],
+            "site": row.get("site", ""),
+            "unit": row.get("unit", ""),
+            "calibration_offset": float(row.get("calibration_offset", 0) or 0),
+        } for row in csv.DictReader(f)]
+
+def write_registry(devices, out_path):
+    devices = sorted(devices, key=lambda d: d["device_id"].encode())
+    tmp = out_path + ".tmp"
+    with open(tmp, "wb") as f:
+        f.write(MAGIC + struct.pack("<III", VERSION, len(devices), 0))
+        for d in devices:
+            f.write(RECORD.pack(d["device_id"].encode()[:32], d["site"].encode()[:20],
+                                d["unit"].encode()[:8], float(d["calibration_offset"])))
+    os.replace(tmp, out_path)
+    print(f"[ok] {len(devices)} dispositivos gravados em {out_path}")
+
+def main():
+    p = argparse.ArgumentParser(description="Gera o registro binário de dispositivos do middleware3")
+    p.add_argument("--csv", type=str, help="CSV device_id,site,unit,calibration_offset")
+    p.add_argument("--devices", type=int, default=100, help="qtde de dispositivos sintéticos")
+    p.add_argument("--out", type=str, default="registry/devices.reg", help="arquivo de saída")
+    args = p.parse_args()
+
+    devices = read_csv(args.csv) if args.csv else synthetic_devices(args.devices)
+    os.makedirs(os.path.dirname(args.out) or ".", exist_ok=True)
+    write_registry(devices, args.out)
+
+if __name__ == "__main__":
+    main()